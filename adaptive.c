@@ -0,0 +1,233 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, adaptive.c
+ *
+ * adaptive embedding: hide bits only where the carrier is busy
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <stdint.h>
+#include <emmintrin.h>
+
+/*
+ * flipping lsbs in a flat patch of sky, or in digital silence, is what
+ * steganalysis picks up first.  in adaptive mode the carrier is cut into
+ * blocks of ADAPTIVE_BLOCK units and each block is scored by its texture: the
+ * mean absolute difference between every value and its neighbor (the same
+ * color channel of the previous pixel, or the same audio channel of the
+ * previous frame).  only blocks scoring at least the threshold are used.
+ *
+ * the score ignores lsbs entirely, so embedding can't change it, and the
+ * recovering side derives exactly the same blocks from the stego file.
+ */
+
+#define ADAPTIVE_BLOCK 64
+
+/*
+ * sum of |x[j] - x[j - size]| over bitmap row bytes [j0, j1), lsbs masked
+ * off.  sixteen bytes at a time with PSADBW
+ */
+static long energy_row(const unsigned char *row, int j0, int j1, int size)
+{
+    long sum = 0;
+    int j = (j0 > size) ? j0 : size;
+
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi8( (char)0xFE );
+    __m128i acc = _mm_setzero_si128();
+
+    for ( ; j + 16 <= j1; j += 16 )
+    {
+        __m128i a = _mm_and_si128( _mm_loadu_si128((const __m128i *)(row + j)), mask );
+        __m128i b = _mm_and_si128( _mm_loadu_si128((const __m128i *)(row + j - size)), mask );
+
+        acc = _mm_add_epi64( acc, _mm_sad_epu8(a, b) );
+    }
+
+    sum = _mm_cvtsi128_si64( acc ) + _mm_cvtsi128_si64( _mm_unpackhi_epi64(acc, acc) );
+#endif
+
+    for ( ; j < j1; j++ )
+        sum += abs( (row[j] & 0xFE) - (row[j - size] & 0xFE) );
+
+    return sum;
+}
+
+/*
+ * little-endian signed sample, lsb dropped
+ */
+static inline int32_t sample_value(const unsigned char *q, int size)
+{
+    switch ( size )
+    {
+        case 2:  return (int16_t)(q[0] | (q[1] << 8)) >> 1;
+        case 3:  return ((int32_t)((uint32_t)(q[0] | (q[1] << 8) | (q[2] << 16)) << 8)) >> 9;
+        default: return (int32_t)(q[0] | (q[1] << 8) | (q[2] << 16) | ((uint32_t)q[3] << 24)) >> 1;
+    }
+}
+
+/*
+ * the same score over samples [s0, s1), each against the previous frame
+ */
+static long energy_samples(struct container *c, long s0, long s1)
+{
+    const unsigned char *q;
+    long s, sum = 0;
+    int size = c->w->sample_size, ch = c->w->channels;
+
+    if ( s0 < ch )
+        s0 = ch;
+
+    q = c->w->samples + s0 * size;
+
+    for ( s = s0; s < s1; s++, q += size )
+        sum += labs( (long)sample_value(q, size) - sample_value(q - ch * size, size) );
+
+    return sum;
+}
+
+/*
+ * append units [start, start + len) to the selection, merging with the
+ * previous span when they touch
+ */
+static void select_units(struct container *c, long start, long len)
+{
+    struct span *last = c->spans + c->nspans - 1;
+
+    if ( c->nspans > 0 && last->start + last->len == start )
+        last->len += len;
+    else
+    {
+        c->spans[c->nspans].start = start;
+        c->spans[c->nspans].len   = len;
+        c->nspans++;
+    }
+}
+
+/*
+ * score the carrier block by block and select the units of every block whose
+ * mean neighbor difference reaches 'threshold', stopping as soon as 'needed'
+ * units have been found.  returns the number of units selected
+ */
+long adaptive_select(struct container *c, double threshold, long needed)
+{
+    long units = carrier_units( c ), selected = 0, b, energy, len;
+
+    c->spans  = arena_alloc( &job_arena, (units / ADAPTIVE_BLOCK + 2) * sizeof(*c->spans) );
+    c->nspans = 0;
+
+    if ( c->type != wavfile )
+    {
+        struct layout *l = &c->layout;
+        int datalen = l->run_units, i, j, j0, j1;
+
+        // blocks don't straddle rows; the row above isn't a neighbor
+        for ( i = 0; i < c->b->height && selected < needed; i++ )
+        {
+            for ( j = 0; j < datalen && selected < needed; j += ADAPTIVE_BLOCK )
+            {
+                len = (datalen - j < ADAPTIVE_BLOCK) ? datalen - j : ADAPTIVE_BLOCK;
+
+                // score the bytes of the groups the block's units live in
+                // (whole pixels with 32-bit or --channels)
+                j0 = (j / l->lanes) * l->stride;
+                j1 = ((j + len - 1) / l->lanes + 1) * l->stride;
+
+                energy = energy_row( c->b->pixel[i], j0, j1, c->b->size );
+
+                if ( energy >= threshold * (j1 - j0) )
+                {
+                    select_units( c, (long)i * datalen + j, len );
+                    selected += len;
+                }
+            }
+        }
+    }
+    else
+    {
+        for ( b = 0; b < units && selected < needed; b += ADAPTIVE_BLOCK )
+        {
+            len    = (units - b < ADAPTIVE_BLOCK) ? units - b : ADAPTIVE_BLOCK;
+            energy = energy_samples( c, b, b + len );
+
+            if ( energy >= threshold * len )
+            {
+                select_units( c, b, len );
+                selected += len;
+            }
+        }
+    }
+
+    return selected;
+}
+
+/*
+ * adaptive equivalent of bitmap_cover() and pcm_cover(): the payload bits go,
+ * in order, into the units adaptive_select() picked
+ */
+int adaptive_cover(struct container *c, struct payload *p)
+{
+    long s, n, run, bitcount = 0, total = 8L * p->size, changed = 0;
+    int stride, bit;
+    unsigned char *q;
+
+    printf( "mixing bits from %s into the busiest parts of %s...\n", p->filename, c->filename );
+
+    PROBE2( cover_start, 0L, total );
+
+    for ( s = 0; s < c->nspans && bitcount < total; s++ )
+    {
+        for ( n = 0; n < c->spans[s].len && bitcount < total; )
+        {
+            q = carrier_unit( c, c->spans[s].start + n, &run, &stride );
+
+            for ( ; run > 0 && n < c->spans[s].len && bitcount < total; run--, n++, bitcount++, q += stride )
+            {
+                bit = 1 & (p->bytes[bitcount / 8] >> (7 - (bitcount % 8)));
+
+                if ( (*q & 1) != bit )
+                {
+                    *q = (*q & ~1) | bit;
+                    changed++;
+                }
+            }
+        }
+    }
+
+    PROBE3( cover_done, 0L, total, changed );
+
+    show_quality( c, changed );
+
+    return 0;
+}
+
+/*
+ * adaptive equivalent of bitmap_uncover() and pcm_uncover()
+ */
+int adaptive_uncover(struct container *c, struct payload *p)
+{
+    long s, n, run, bitcount = 0, total = 8L * p->size;
+    int stride;
+    unsigned char *q;
+
+    memset( p->bytes, 0, p->size );
+
+    PROBE2( uncover_start, 0L, total );
+
+    for ( s = 0; s < c->nspans && bitcount < total; s++ )
+    {
+        for ( n = 0; n < c->spans[s].len && bitcount < total; )
+        {
+            q = carrier_unit( c, c->spans[s].start + n, &run, &stride );
+
+            for ( ; run > 0 && n < c->spans[s].len && bitcount < total; run--, n++, bitcount++, q += stride )
+                p->bytes[bitcount / 8] |= (*q & 1) << (7 - (bitcount % 8));
+        }
+    }
+
+    PROBE2( uncover_done, 0L, total );
+
+    return 0;
+}
@@ -0,0 +1,922 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, analyze.c
+ *
+ * LSB steganalysis: audit carriers for signs of embedding
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#define _GNU_SOURCE          // for nftw(), madvise()
+#include "steganographer.h"
+#include <stdint.h>
+#include <math.h>
+#include <ftw.h>             // for nftw()
+#include <limits.h>          // for PATH_MAX
+#include <fcntl.h>           // for open()
+#include <unistd.h>          // for close(), sysconf()
+#include <pthread.h>
+#include <sys/mman.h>        // for mmap()
+#include <sys/stat.h>
+#include <immintrin.h>
+
+/*
+ * three classic detectors are run over every carrier:
+ *
+ *  - chi-square "pairs of values" (Westfeld & Pfitzmann): embedding evens out
+ *    the histogram counts of 2k and 2k+1.  reported as the probability that
+ *    the lsb plane has been overwritten with random data.
+ *
+ *  - RS analysis (Fridrich, Goljan & Du): counts of regular and singular
+ *    pixel groups under lsb flipping drift apart in a predictable way as the
+ *    message grows.  reported as the estimated embedding rate.
+ *
+ *  - sample pair analysis (Dumitrescu, Wu & Wang): the same idea applied to
+ *    adjacent pairs of samples.  reported as the estimated embedding rate.
+ *
+ * the embedding rate is the fraction of carrier units holding message bits;
+ * a clean carrier estimates close to 0 and a full one close to 1.
+ */
+
+// files whose RS or SPA estimate reaches this rate are flagged
+#define ANALYZE_SUSPECT_RATE 0.10
+
+// everything we learn about one file
+struct analysis
+{
+    char   path[PATH_MAX];
+    int    type;
+    int    ok;                // 0 if the file couldn't be analyzed
+    char   error[128];
+
+    int64_t units;            // carrier units examined
+    int64_t hist[256];        // histogram of the carrier bytes holding the lsbs
+    double chi_p;             // probability of embedding (chi-square)
+
+    int64_t groups;           // RS: groups examined
+    int64_t rm, sm, rnm, snm; // RS: regular/singular counts, masks M and -M
+    int64_t rmf, smf, rnmf, snmf; // ... and again with every lsb flipped
+    double rs;                // RS estimate of the embedding rate
+
+    int64_t pairs;            // SPA: adjacent pairs examined
+    int64_t x, y, k;          // SPA: pair counts, see spa_estimate()
+    double spa;               // SPA estimate of the embedding rate
+};
+
+// work list shared by the analysis threads
+static struct analysis *jobs;
+static int njobs, jobs_alloc, next_job;
+
+/*
+ * values in one "lane" of the carrier: successive samples of the same color
+ * channel of a row, or of the same audio channel
+ */
+struct lane
+{
+    const unsigned char *p;   // first value
+    int64_t count;            // number of values
+    int     stride;           // bytes between values
+    int     width;            // bytes per value (1 for bitmaps)
+};
+
+static inline int64_t lane_value(const struct lane *l, int64_t i)
+{
+    const unsigned char *q = l->p + i * l->stride;
+
+    // pcm samples are little-endian and signed, except 8-bit ones
+    switch ( l->width )
+    {
+        case 1:  return q[0];
+        case 2:  return (int16_t)(q[0] | (q[1] << 8));
+        case 3:  return ((int32_t)((uint32_t)(q[0] | (q[1] << 8) | (q[2] << 16)) << 8)) >> 8;
+        default: return (int32_t)(q[0] | (q[1] << 8) | (q[2] << 16) | ((uint32_t)q[3] << 24));
+    }
+}
+
+// values of a lane the vector kernels take at a time
+#define LANE_CHUNK 1024
+
+/*
+ * histogram 'n' bytes, 'stride' apart.  four sub-histograms break the
+ * load/increment/store dependency on runs of equal bytes (typical of flat
+ * image regions), which otherwise serializes the loop
+ */
+static void histogram_scalar(int64_t *hist, const unsigned char *p, int64_t n, int stride)
+{
+    uint32_t h[4][256];
+    int64_t i;
+    int v;
+
+    memset( h, 0, sizeof(h) );
+
+    for ( i = 0; i + 4 <= n; i += 4, p += 4 * stride )
+    {
+        h[0][p[0]]++;
+        h[1][p[stride]]++;
+        h[2][p[2 * stride]]++;
+        h[3][p[3 * stride]]++;
+    }
+
+    for ( ; i < n; i++, p += stride )
+        h[0][p[0]]++;
+
+    for ( v = 0; v < 256; v++ )
+        hist[v] += (int64_t)h[0][v] + h[1][v] + h[2][v] + h[3][v];
+}
+
+/*
+ * the same, eight bytes at a time: PSHUFB packs four strided bytes from each
+ * of two loads into one 64-bit word, whose bytes go to eight sub-histograms.
+ * strides up to 4 (every carrier we analyze) fit four bytes in a load
+ */
+__attribute__((target("ssse3")))
+static void histogram_ssse3(int64_t *hist, const unsigned char *p, int64_t n, int stride)
+{
+    uint32_t h[8][256];
+    unsigned char lo[16], hi[16];
+    __m128i pick_lo, pick_hi, w;
+    uint64_t b;
+    int64_t i = 0, end = (n - 1) * stride + 1;
+    int k, v;
+
+    if ( stride > 4 )
+    {
+        histogram_scalar( hist, p, n, stride );
+        return;
+    }
+
+    memset( h, 0, sizeof(h) );
+    memset( lo, 0x80, sizeof(lo) );
+    memset( hi, 0x80, sizeof(hi) );
+
+    for ( k = 0; k < 4; k++ )
+    {
+        lo[k]     = k * stride;
+        hi[k + 4] = k * stride;
+    }
+
+    pick_lo = _mm_loadu_si128( (const __m128i *)lo );
+    pick_hi = _mm_loadu_si128( (const __m128i *)hi );
+
+    // neither load may reach past the last byte
+    for ( ; (i + 4) * stride + 16 <= end; i += 8 )
+    {
+        w = _mm_or_si128( _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + i * stride)), pick_lo),
+                          _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + (i + 4) * stride)), pick_hi) );
+        b = _mm_cvtsi128_si64( w );
+
+        for ( k = 0; k < 8; k++ )
+            h[k][(b >> (8 * k)) & 0xFF]++;
+    }
+
+    for ( ; i < n; i++ )
+        h[0][p[i * stride]]++;
+
+    for ( v = 0; v < 256; v++ )
+        hist[v] += (int64_t)h[0][v] + h[1][v] + h[2][v] + h[3][v] + h[4][v] + h[5][v] + h[6][v] + h[7][v];
+}
+
+// the flipping functions of RS analysis: F1 swaps 2k <-> 2k+1, F-1 swaps
+// 2k-1 <-> 2k
+static inline int64_t flip_pos(int64_t x) { return x ^ 1; }
+static inline int64_t flip_neg(int64_t x) { return ((x + 1) ^ 1) - 1; }
+
+// smoothness of a group of four: the sum of absolute neighbor differences
+static inline int64_t discrimination(const int64_t *g)
+{
+    return llabs( g[1] - g[0] ) + llabs( g[2] - g[1] ) + llabs( g[3] - g[2] );
+}
+
+/*
+ * classify a group as regular (flipping made it noisier) or singular (flipping
+ * made it smoother) under the masks M = [0 1 1 0] and -M
+ */
+static void rs_group(const int64_t *g, int64_t *rm, int64_t *sm, int64_t *rnm, int64_t *snm)
+{
+    int64_t f = discrimination( g );
+    int64_t pos[4] = { g[0], flip_pos(g[1]), flip_pos(g[2]), g[3] };
+    int64_t neg[4] = { g[0], flip_neg(g[1]), flip_neg(g[2]), g[3] };
+    int64_t fp = discrimination( pos );
+    int64_t fn = discrimination( neg );
+
+    *rm  += fp > f;
+    *sm  += fp < f;
+    *rnm += fn > f;
+    *snm += fn < f;
+}
+
+// SPA counts for the pair of adjacent values (u, v)
+static inline void spa_pair(struct analysis *a, int64_t u, int64_t v)
+{
+    if ( ((v & 1) == 0 && u < v) || ((v & 1) && u > v) )
+        a->x++;
+    if ( ((v & 1) == 0 && u > v) || ((v & 1) && u < v) )
+        a->y++;
+    if ( (u >> 1) == (v >> 1) )
+        a->k++;
+
+    a->pairs++;
+}
+
+// RS counts for a group of four, as is and with every lsb flipped
+static void rs_count(struct analysis *a, const int64_t *g)
+{
+    int64_t gf[4] = { g[0] ^ 1, g[1] ^ 1, g[2] ^ 1, g[3] ^ 1 };
+
+    rs_group( g,  &a->rm,  &a->sm,  &a->rnm,  &a->snm );
+    rs_group( gf, &a->rmf, &a->smf, &a->rnmf, &a->snmf );
+    a->groups++;
+}
+
+/*
+ * RS and SPA counts over one lane
+ */
+static void analyze_lane_scalar(struct analysis *a, const struct lane *l)
+{
+    int64_t i, g[4];
+    int j;
+
+    // sample pairs
+    for ( i = 0; i + 1 < l->count; i++ )
+        spa_pair( a, lane_value(l, i), lane_value(l, i + 1) );
+
+    // disjoint groups of four
+    for ( i = 0; i + 4 <= l->count; i += 4 )
+    {
+        for ( j = 0; j < 4; j++ )
+            g[j] = lane_value( l, i + j );
+
+        rs_count( a, g );
+    }
+}
+
+// set lanes of a 32-bit compare mask
+__attribute__((target("ssse3")))
+static inline int mask_count(__m128i m)
+{
+    return __builtin_popcount( _mm_movemask_ps(_mm_castsi128_ps(m)) );
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i discrimination4(__m128i g0, __m128i g1, __m128i g2, __m128i g3)
+{
+    return _mm_add_epi32( _mm_add_epi32(_mm_abs_epi32(_mm_sub_epi32(g1, g0)), _mm_abs_epi32(_mm_sub_epi32(g2, g1))),
+                          _mm_abs_epi32(_mm_sub_epi32(g3, g2)) );
+}
+
+/*
+ * rs_group() for four groups at once: g0 holds the first value of each, g1
+ * the second, and so on
+ */
+__attribute__((target("ssse3")))
+static void rs_group4(__m128i g0, __m128i g1, __m128i g2, __m128i g3,
+                      int64_t *rm, int64_t *sm, int64_t *rnm, int64_t *snm)
+{
+    const __m128i one = _mm_set1_epi32( 1 );
+    __m128i f  = discrimination4( g0, g1, g2, g3 );
+    __m128i fp = discrimination4( g0, _mm_xor_si128(g1, one), _mm_xor_si128(g2, one), g3 );
+    __m128i fn = discrimination4( g0, _mm_sub_epi32(_mm_xor_si128(_mm_add_epi32(g1, one), one), one),
+                                      _mm_sub_epi32(_mm_xor_si128(_mm_add_epi32(g2, one), one), one), g3 );
+
+    *rm  += mask_count( _mm_cmpgt_epi32(fp, f) );
+    *sm  += mask_count( _mm_cmpgt_epi32(f, fp) );
+    *rnm += mask_count( _mm_cmpgt_epi32(fn, f) );
+    *snm += mask_count( _mm_cmpgt_epi32(f, fn) );
+}
+
+/*
+ * the same counts, four pairs or four groups at a time.  the lane is read a
+ * chunk at a time into 32-bit values (one past the chunk, for its last
+ * pair), which holds anything up to 24-bit audio with room for the
+ * differences; 32-bit audio goes to the scalar loops
+ */
+__attribute__((target("ssse3")))
+static void analyze_lane_ssse3(struct analysis *a, const struct lane *l)
+{
+    const __m128i one = _mm_set1_epi32( 1 );
+    int32_t buf[LANE_CHUNK + 1];
+    int64_t c0, n, m, j, g[4];
+    __m128i u, v, odd, lt, gt, r0, r1, r2, r3, t0, t1, t2, t3, g0, g1, g2, g3;
+    int k;
+
+    if ( l->width > 3 )
+    {
+        analyze_lane_scalar( a, l );
+        return;
+    }
+
+    for ( c0 = 0; c0 < l->count; c0 += LANE_CHUNK )
+    {
+        n = (l->count - c0 < LANE_CHUNK) ? l->count - c0 : LANE_CHUNK;
+        m = (c0 + n < l->count) ? n + 1 : n;
+
+        for ( j = 0; j < m; j++ )
+            buf[j] = lane_value( l, c0 + j );
+
+        // sample pairs
+        for ( j = 0; j + 4 < m; j += 4 )
+        {
+            u   = _mm_loadu_si128( (const __m128i *)(buf + j) );
+            v   = _mm_loadu_si128( (const __m128i *)(buf + j + 1) );
+            odd = _mm_cmpeq_epi32( _mm_and_si128(v, one), one );
+            lt  = _mm_cmpgt_epi32( v, u );
+            gt  = _mm_cmpgt_epi32( u, v );
+
+            a->x += mask_count( _mm_or_si128(_mm_andnot_si128(odd, lt), _mm_and_si128(odd, gt)) );
+            a->y += mask_count( _mm_or_si128(_mm_andnot_si128(odd, gt), _mm_and_si128(odd, lt)) );
+            a->k += mask_count( _mm_cmpeq_epi32(_mm_srai_epi32(u, 1), _mm_srai_epi32(v, 1)) );
+            a->pairs += 4;
+        }
+
+        for ( ; j + 1 < m; j++ )
+            spa_pair( a, buf[j], buf[j + 1] );
+
+        // groups of four, four groups at a time, transposed so that each
+        // vector holds the same position of every group
+        for ( j = 0; j + 16 <= n; j += 16 )
+        {
+            r0 = _mm_loadu_si128( (const __m128i *)(buf + j) );
+            r1 = _mm_loadu_si128( (const __m128i *)(buf + j + 4) );
+            r2 = _mm_loadu_si128( (const __m128i *)(buf + j + 8) );
+            r3 = _mm_loadu_si128( (const __m128i *)(buf + j + 12) );
+
+            t0 = _mm_unpacklo_epi32( r0, r1 );
+            t1 = _mm_unpacklo_epi32( r2, r3 );
+            t2 = _mm_unpackhi_epi32( r0, r1 );
+            t3 = _mm_unpackhi_epi32( r2, r3 );
+
+            g0 = _mm_unpacklo_epi64( t0, t1 );
+            g1 = _mm_unpackhi_epi64( t0, t1 );
+            g2 = _mm_unpacklo_epi64( t2, t3 );
+            g3 = _mm_unpackhi_epi64( t2, t3 );
+
+            rs_group4( g0, g1, g2, g3, &a->rm, &a->sm, &a->rnm, &a->snm );
+            rs_group4( _mm_xor_si128(g0, one), _mm_xor_si128(g1, one), _mm_xor_si128(g2, one), _mm_xor_si128(g3, one),
+                       &a->rmf, &a->smf, &a->rnmf, &a->snmf );
+            a->groups += 4;
+        }
+
+        for ( ; j + 4 <= n; j += 4 )
+        {
+            for ( k = 0; k < 4; k++ )
+                g[k] = buf[j + k];
+
+            rs_count( a, g );
+        }
+    }
+}
+
+// picked once, by analyze()
+static void (*histogram)(int64_t *, const unsigned char *, int64_t, int);
+static void (*analyze_lane)(struct analysis *, const struct lane *);
+
+/*
+ * upper regularized incomplete gamma function Q(s, x), by series for small x
+ * and by continued fraction otherwise (Numerical Recipes, 6.2)
+ */
+static double gamma_q(double s, double x)
+{
+    double sum, term, b, c, d, h, an;
+    int n;
+
+    if ( x <= 0 )
+        return 1.0;
+
+    if ( x < s + 1 )
+    {
+        sum = term = 1.0 / s;
+
+        for ( n = 1; n < 1000 && fabs(term) > fabs(sum) * 1e-15; n++ )
+        {
+            term *= x / (s + n);
+            sum  += term;
+        }
+
+        return 1.0 - sum * exp( -x + s * log(x) - lgamma(s) );
+    }
+
+    b = x + 1 - s;
+    c = 1e300;
+    d = 1 / b;
+    h = d;
+
+    for ( n = 1; n < 1000; n++ )
+    {
+        an = -n * (n - s);
+        b += 2;
+        d  = an * d + b;
+        c  = b + an / c;
+
+        if ( fabs(d) < 1e-300 ) d = 1e-300;
+        if ( fabs(c) < 1e-300 ) c = 1e-300;
+
+        d  = 1 / d;
+        h *= d * c;
+
+        if ( fabs(d * c - 1) < 1e-15 )
+            break;
+    }
+
+    return exp( -x + s * log(x) - lgamma(s) ) * h;
+}
+
+static double chi_square_p(const int64_t *hist)
+{
+    double chi = 0, expected;
+    int k, df = -1;
+
+    for ( k = 0; k < 128; k++ )
+    {
+        expected = (hist[2 * k] + hist[2 * k + 1]) / 2.0;
+
+        // sparse categories only add noise
+        if ( expected <= 4 )
+            continue;
+
+        chi += (hist[2 * k] - expected) * (hist[2 * k] - expected) / expected;
+        df++;
+    }
+
+    if ( df < 1 )
+        return 0;
+
+    // probability the pairs are this even by chance, i.e. of embedding
+    return gamma_q( df / 2.0, chi / 2.0 );
+}
+
+/*
+ * smaller root of a z^2 + b z + c = 0
+ */
+static double small_root(double a, double b, double c)
+{
+    double disc, r1, r2;
+
+    if ( fabs(a) < 1e-12 )
+        return (fabs(b) < 1e-12) ? 0 : -c / b;
+
+    disc = b * b - 4 * a * c;
+
+    if ( disc < 0 )
+        disc = 0;
+
+    r1 = (-b + sqrt(disc)) / (2 * a);
+    r2 = (-b - sqrt(disc)) / (2 * a);
+
+    return (fabs(r1) < fabs(r2)) ? r1 : r2;
+}
+
+static double rs_estimate(struct analysis *a)
+{
+    double n = a->groups, d0, d1, dn0, dn1, z;
+
+    if ( a->groups == 0 )
+        return 0;
+
+    d0  = (a->rm - a->sm) / n;
+    d1  = (a->rmf - a->smf) / n;
+    dn0 = (a->rnm - a->snm) / n;
+    dn1 = (a->rnmf - a->snmf) / n;
+
+    z = small_root( 2 * (d1 + d0), dn0 - dn1 - d1 - 3 * d0, d0 - dn0 );
+
+    if ( fabs(z - 0.5) < 1e-12 )
+        return 0;
+
+    return z / (z - 0.5);
+}
+
+/*
+ * x: pairs whose larger value is even (or smaller value odd) ...
+ * y: ... the other way around
+ * k: pairs that differ at most in the lsb
+ *
+ * the embedding rate is twice the smaller root of
+ * 2k b^2 + 2(2x - n) b + (y - x) = 0
+ */
+static double spa_estimate(struct analysis *a)
+{
+    if ( a->k == 0 )
+        return 0;
+
+    return 2 * small_root( 2.0 * a->k, 2.0 * (2.0 * a->x - a->pairs), (double)(a->y - a->x) );
+}
+
+static uint32_t rd32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t rd16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+/*
+ * the header readers in bitmap.c and pcm.c abort the whole program on a bad
+ * file, which won't do halfway through auditing a directory from a worker
+ * thread.  these read the same fields from the mapped file and return 0,
+ * with the reason in a->error, for anything that can't be analyzed
+ */
+/*
+ * the byte of a 32-bit pixel a BI_BITFIELDS mask selects, or -1 if the mask
+ * isn't exactly one byte; as in bitmap.c, such a channel holds no payload
+ */
+static int mask_byte(uint32_t mask)
+{
+    int k;
+
+    for ( k = 0; k < 4; k++ )
+        if ( mask == (uint32_t)0xFF << (8 * k) )
+            return k;
+
+    return -1;
+}
+
+/*
+ * color[] gets the byte positions of blue, green and red within a pixel
+ * (-1 for none); a 32-bit pixel's alpha byte is left out, as when hiding
+ */
+static int bitmap_header(struct analysis *a, const unsigned char *map, int64_t len, struct bitmap *b, int *color)
+{
+    int64_t rowlen;
+    int k;
+
+    if ( len < OFF_COLOR_MASKS )
+    {
+        snprintf( a->error, sizeof(a->error), "bitmap header cut short" );
+        return 0;
+    }
+
+    b->data_offset = rd32( map + OFF_PIXEL_START );
+    b->width       = rd32( map + OFF_BITMAP_WIDTH );
+    b->height      = rd32( map + OFF_BITMAP_HEIGHT );
+    b->depth       = rd16( map + OFF_BITMAP_DEPTH );
+    b->compression = rd32( map + OFF_COMPRESSION );
+
+    if ( (b->depth != 24 && b->depth != 32) || b->height <= 0 || b->width <= 0 || b->width > (1 << 28)
+      || b->data_offset < 0 )
+    {
+        snprintf( a->error, sizeof(a->error), "unsupported bitmap (%d-bit, %dx%d)", b->depth, b->width, b->height );
+        return 0;
+    }
+
+    if ( b->compression != BI_RGB && !(b->depth == 32 && b->compression == BI_BITFIELDS) )
+    {
+        snprintf( a->error, sizeof(a->error), "compressed bitmap (method %d)", b->compression );
+        return 0;
+    }
+
+    for ( k = 0; k < 3; k++ )
+        color[k] = k;
+
+    if ( b->compression == BI_BITFIELDS )
+    {
+        if ( len < OFF_COLOR_MASKS + 12 )
+        {
+            snprintf( a->error, sizeof(a->error), "bitmap header cut short" );
+            return 0;
+        }
+
+        // the masks are stored red, green, blue
+        for ( k = 0; k < 3; k++ )
+            color[k] = mask_byte( rd32(map + OFF_COLOR_MASKS + 4 * (2 - k)) );
+    }
+
+    b->size   = b->depth / 8;
+    rowlen    = (int64_t)b->size * b->width;
+    b->pad    = (4 - rowlen % 4) % 4;
+    b->start  = b->data_offset;
+    b->rowlen = rowlen + b->pad;
+
+    return 1;
+}
+
+static int wav_header(struct analysis *a, const unsigned char *map, int64_t len, struct pcm *w)
+{
+    int64_t pos = 12, size;
+    int fmt = 0;
+
+    if ( len < 12 || memcmp(map + 8, "WAVE", 4) != 0 )
+    {
+        snprintf( a->error, sizeof(a->error), "not a WAVE file" );
+        return 0;
+    }
+
+    // walk the chunks up to "data"
+    for ( ; pos + 8 <= len; pos += 8 + size + (size & 1) )
+    {
+        size = rd32( map + pos + 4 );
+
+        if ( memcmp(map + pos, "data", 4) == 0 )
+            break;
+
+        if ( memcmp(map + pos, "fmt ", 4) == 0 && size >= 16 && pos + 24 <= len )
+        {
+            w->audioformat = rd16( map + pos + 8 );
+            w->channels    = rd16( map + pos + 10 );
+            w->rate        = rd32( map + pos + 12 );
+            w->block_align = rd16( map + pos + 20 );
+            w->depth       = rd16( map + pos + 22 );
+            fmt = 1;
+        }
+    }
+
+    if ( !fmt || pos + 8 > len )
+    {
+        snprintf( a->error, sizeof(a->error), "no %s chunk", fmt ? "data" : "fmt" );
+        return 0;
+    }
+
+    if ( w->audioformat != 1 )
+    {
+        snprintf( a->error, sizeof(a->error), "not PCM audio (format %d)", w->audioformat );
+        return 0;
+    }
+
+    if ( w->depth < 8 || w->depth > 32 || w->depth % 8 || w->channels < 1
+      || w->block_align != w->channels * (w->depth / 8) )
+    {
+        snprintf( a->error, sizeof(a->error), "unsupported sample format (%d-bit, %d channels, %d-byte frames)",
+                  w->depth, w->channels, w->block_align );
+        return 0;
+    }
+
+    if ( rd32(map + pos + 4) > len - pos - 8 )
+    {
+        snprintf( a->error, sizeof(a->error), "truncated (%ld of %ld bytes)", (long)len, (long)(pos + 8 + rd32(map + pos + 4)) );
+        return 0;
+    }
+
+    w->sample_size   = w->depth / 8;
+    w->data_offset   = pos + 8;
+    w->subchunk2size = rd32( map + pos + 4 );
+
+    return 1;
+}
+
+/*
+ * analyze one carrier.  the header is read straight from the memory-mapped
+ * file by bitmap_header() or wav_header(), which skip a file they can't
+ * handle rather than abort the audit, and the data is scanned in place
+ */
+static void analyze_file(struct analysis *a)
+{
+    struct bitmap b;
+    struct pcm w;
+    struct stat st;
+    struct lane l;
+    unsigned char magic[12];
+    unsigned char *map;
+    FILE *fp;
+    int fd, i, ch, ok, color[3];
+    int64_t datalen, end;
+
+    memset( &b, 0, sizeof(b) );
+    memset( &w, 0, sizeof(w) );
+    memset( magic, 0, sizeof(magic) );
+
+    fp = fopen( a->path, "rb" );
+
+    if ( fp == NULL )
+    {
+        snprintf( a->error, sizeof(a->error), "%s", strerror(errno) );
+        return;
+    }
+
+    fread( magic, sizeof(magic), 1, fp );
+    a->type = magic_type( magic );
+
+    if ( a->type != bitmap && a->type != wavfile )
+    {
+        snprintf( a->error, sizeof(a->error), "not a bitmap or WAV file" );
+        fclose( fp );
+        return;
+    }
+
+    fd = fileno( fp );
+    fstat( fd, &st );
+
+    map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+    if ( map == MAP_FAILED )
+    {
+        snprintf( a->error, sizeof(a->error), "mmap: %s", strerror(errno) );
+        fclose( fp );
+        return;
+    }
+
+    if ( a->type == bitmap )
+    {
+        ok  = bitmap_header( a, map, st.st_size, &b, color );
+        end = (int64_t)b.start + (int64_t)b.height * b.rowlen;
+    }
+    else
+    {
+        ok  = wav_header( a, map, st.st_size, &w );
+        end = (int64_t)w.data_offset + w.subchunk2size;
+    }
+
+    if ( ok && end > st.st_size )
+    {
+        snprintf( a->error, sizeof(a->error), "truncated (%ld of %ld bytes)", (long)st.st_size, (long)end );
+        ok = 0;
+    }
+
+    if ( !ok )
+    {
+        munmap( map, st.st_size );
+        fclose( fp );
+        return;
+    }
+
+    madvise( map, st.st_size, MADV_SEQUENTIAL );
+
+    if ( a->type == bitmap )
+    {
+        datalen = b.rowlen - b.pad;
+
+        for ( i = 0; i < b.height; i++ )
+        {
+            const unsigned char *row = map + b.start + (int64_t)i * b.rowlen;
+
+            // a 24-bit row is all color; a 32-bit one goes channel by channel
+            if ( b.size == 3 )
+            {
+                histogram( a->hist, row, datalen, 1 );
+                a->units += datalen;
+            }
+
+            // each color channel of the row is a lane
+            for ( ch = 0; ch < 3; ch++ )
+            {
+                if ( color[ch] < 0 )
+                    continue;
+
+                l.p = row + color[ch];
+                l.count  = b.width;
+                l.stride = b.size;
+                l.width  = 1;
+
+                if ( b.size == 4 )
+                {
+                    histogram( a->hist, l.p, l.count, l.stride );
+                    a->units += l.count;
+                }
+
+                analyze_lane( a, &l );
+            }
+        }
+    }
+    else
+    {
+        int64_t frames = w.subchunk2size / w.block_align;
+
+        histogram( a->hist, map + w.data_offset, frames * w.channels, w.sample_size );
+        a->units = frames * w.channels;
+
+        // each audio channel is a lane
+        for ( ch = 0; ch < w.channels; ch++ )
+        {
+            l.p = map + w.data_offset + ch * w.sample_size;
+            l.count  = frames;
+            l.stride = w.block_align;
+            l.width  = w.sample_size;
+
+            analyze_lane( a, &l );
+        }
+    }
+
+    munmap( map, st.st_size );
+    fclose( fp );
+
+    a->chi_p = chi_square_p( a->hist );
+    a->rs    = rs_estimate( a );
+    a->spa   = spa_estimate( a );
+    a->ok    = 1;
+}
+
+static void *analyze_worker(void *arg)
+{
+    int n;
+
+    (void)arg;
+
+    while ( (n = __sync_fetch_and_add(&next_job, 1)) < njobs )
+        analyze_file( &jobs[n] );
+
+    return NULL;
+}
+
+static void add_job(const char *path)
+{
+    if ( njobs == jobs_alloc )
+    {
+        jobs_alloc = jobs_alloc ? 2 * jobs_alloc : 64;
+        jobs = realloc( jobs, jobs_alloc * sizeof(*jobs) );
+
+        if ( jobs == NULL )
+        {
+            fprintf( stderr, "[ERROR] analyze: memory allocation failed, aborting.\n" );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    memset( &jobs[njobs], 0, sizeof(*jobs) );
+    strncpy( jobs[njobs].path, path, PATH_MAX - 1 );
+    njobs++;
+}
+
+static int collect(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)ftw;
+
+    if ( flag == FTW_F )
+        add_job( path );
+
+    return 0;
+}
+
+/*
+ * analyze 'path' (a carrier, or a directory tree of them) using 'threads'
+ * threads; returns the number of files flagged as suspect
+ */
+int analyze(const char *path, int threads)
+{
+    pthread_t *tid;
+    struct stat st;
+    int i, suspect = 0, failed = 0;
+
+    if ( stat(path, &st) != 0 )
+    {
+        fprintf( stderr, "[ERROR] could not open %s: %s\nAborting.\n", path, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( S_ISDIR(st.st_mode) )
+        nftw( path, collect, 32, FTW_PHYS );
+    else
+        add_job( path );
+
+    __builtin_cpu_init();
+
+    if ( __builtin_cpu_supports("ssse3") )
+    {
+        histogram    = histogram_ssse3;
+        analyze_lane = analyze_lane_ssse3;
+    }
+    else
+    {
+        histogram    = histogram_scalar;
+        analyze_lane = analyze_lane_scalar;
+    }
+
+    if ( threads <= 0 )
+        threads = sysconf( _SC_NPROCESSORS_ONLN );
+
+    if ( threads > njobs )
+        threads = njobs;
+
+    tid = malloc( threads * sizeof(*tid) );
+
+    for ( i = 0; i < threads; i++ )
+        pthread_create( &tid[i], NULL, analyze_worker, NULL );
+
+    for ( i = 0; i < threads; i++ )
+        pthread_join( tid[i], NULL );
+
+    printf( "%-40s %-7s %12s %8s %8s %8s %8s\n", "file", "type", "units", "lsb=1", "chi2 p", "RS", "SPA" );
+
+    for ( i = 0; i < njobs; i++ )
+    {
+        struct analysis *a = &jobs[i];
+        int64_t ones = 0;
+        int v, flag;
+
+        if ( !a->ok )
+        {
+            printf( "%-40s skipped: %s\n", a->path, a->error );
+            failed++;
+            continue;
+        }
+
+        for ( v = 1; v < 256; v += 2 )
+            ones += a->hist[v];
+
+        flag = (a->rs >= ANALYZE_SUSPECT_RATE) || (a->spa >= ANALYZE_SUSPECT_RATE);
+        suspect += flag;
+
+        printf( "%-40s %-7s %12ld %8.4f %8.4f %8.4f %8.4f%s\n", a->path,
+                (a->type == bitmap) ? "bitmap" : "wav", (long)a->units,
+                a->units ? (double)ones / a->units : 0.0,
+                a->chi_p, a->rs, a->spa, flag ? "  [SUSPECT]" : "" );
+    }
+
+    printf( "\n%d file%s analyzed, %d suspect, %d skipped.\n",
+            njobs - failed, (njobs - failed == 1) ? "" : "s", suspect, failed );
+
+    free( tid );
+    free( jobs );
+
+    return suspect;
+}
@@ -0,0 +1,121 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, arena.c
+ *
+ * per-job arena allocator backed by huge pages
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <sys/mman.h>  // for mmap(), madvise()
+
+#define HUGE_PAGE_SIZE  (2UL * 1024 * 1024)
+#define ARENA_ALIGN     64  // cache line; also keeps vector loads aligned
+
+// every allocation a job makes comes out of this arena
+struct arena job_arena;
+
+/*
+ * map a chunk of at least 'size' usable bytes, rounded up to whole 2 MB
+ * pages.  explicit huge pages (MAP_HUGETLB) are tried first; if none are
+ * reserved on this host we fall back to ordinary pages and ask for
+ * transparent huge pages instead.
+ */
+static struct arena_chunk *map_chunk(size_t size)
+{
+    struct arena_chunk *ch;
+    size_t len;
+    int huge = 1;
+
+    len = (size + sizeof(*ch) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+    ch = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+
+    if ( ch == MAP_FAILED )
+    {
+        huge = 0;
+        ch = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+        if ( ch == MAP_FAILED )
+        {
+            fprintf( stderr, "[ERROR] arena: could not map %lu bytes: %s, aborting.\n",
+                     (unsigned long)len, strerror(errno) );
+            exit( EXIT_FAILURE );
+        }
+
+        madvise( ch, len, MADV_HUGEPAGE );
+    }
+
+    ch->next = NULL;
+    ch->len  = len;
+    ch->used = (sizeof(*ch) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ch->huge = huge;
+
+    return ch;
+}
+
+/*
+ * bump-allocate 'size' bytes from the arena.  chunks are never returned to
+ * the system until arena_destroy(), so a reset arena serves the next job
+ * from memory that is already mapped (and already backed by huge pages).
+ *
+ * memory is NOT zeroed after a reset
+ */
+void *arena_alloc(struct arena *a, size_t size)
+{
+    struct arena_chunk *ch, **link;
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    // first chunk with enough room left
+    for ( link = &a->head; (ch = *link) != NULL; link = &ch->next )
+        if ( ch->len - ch->used >= size )
+            break;
+
+    if ( ch == NULL )
+    {
+        ch = map_chunk( size );
+        *link = ch;
+
+        a->mapped += ch->len;
+
+        if ( ch->huge )
+            a->huge += ch->len;
+    }
+
+    ptr = (unsigned char *)ch + ch->used;
+    ch->used += size;
+
+    return ptr;
+}
+
+/*
+ * forget every allocation at once
+ */
+void arena_reset(struct arena *a)
+{
+    struct arena_chunk *ch;
+
+    for ( ch = a->head; ch != NULL; ch = ch->next )
+        ch->used = (sizeof(*ch) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/*
+ * hand the arena's memory back to the system
+ */
+void arena_destroy(struct arena *a)
+{
+    struct arena_chunk *ch, *next;
+
+    for ( ch = a->head; ch != NULL; ch = next )
+    {
+        next = ch->next;
+        munmap( ch, ch->len );
+    }
+
+    a->head   = NULL;
+    a->mapped = 0;
+    a->huge   = 0;
+}
@@ -0,0 +1,567 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, autotune.c
+ *
+ * per-host tuning of the engine and carrier i/o
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#define _GNU_SOURCE          // for O_DIRECT
+#include "steganographer.h"
+#include <fcntl.h>
+#include <time.h>            // for clock_gettime()
+#include <unistd.h>          // for dup(), gethostname(), sysconf()
+
+/*
+ * which embedding kernel, how many threads (-j) and whether O_DIRECT
+ * (--direct, and with what request size) pay off depends on the cpu, the
+ * number of sockets and the storage, so autotune mode measures them.  it
+ * writes a synthetic bitmap and WAV file of AUTOTUNE_BYTES each to the
+ * directory being tuned for and then
+ *
+ *     times cover_units() and uncover_units() over the loaded bitmap with the
+ *     SSSE3 kernels and with the scalar loops
+ *
+ *     times whole hide jobs -- load, embed, write and sync -- on both files,
+ *     from a cold page cache, with plain stdio on 1, 2, 4... threads and with
+ *     O_DIRECT at a few request sizes
+ *
+ * the fastest of each goes into a profile, by default ~/.steganographer-<host>
+ * (or $STEGANOGRAPHER_PROFILE).  every later run reads the profile at startup
+ * and uses it for whatever the command line leaves open: -j and --direct
+ * given by hand always win, and --no-profile ignores the profile entirely.
+ */
+
+#define AUTOTUNE_BYTES  (32L << 20)   // size of each synthetic carrier
+#define AUTOTUNE_ROUNDS 3             // runs per configuration; the best one counts
+#define AUTOTUNE_WIDTH  4096          // synthetic bitmap width in pixels
+
+#define MAX_CONFIGS     32
+
+// one way of running a job
+struct config
+{
+    int  threads;             // 1 for a single thread
+    int  direct;              // O_DIRECT i/o
+    long request;             // ... in requests of this many bytes
+    double secs;              // best time, bitmap and WAV together
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * where the profile lives: $STEGANOGRAPHER_PROFILE, or one file per host in
+ * the home directory (which may well be shared between hosts)
+ */
+static void profile_path(char *buf, size_t len)
+{
+    const char *env = getenv( "STEGANOGRAPHER_PROFILE" ), *home = getenv( "HOME" );
+    char host[64] = "localhost";
+
+    if ( env && *env )
+    {
+        snprintf( buf, len, "%s", env );
+        return;
+    }
+
+    gethostname( host, sizeof(host) - 1 );
+
+    snprintf( buf, len, "%s/.steganographer-%s", home ? home : ".", host );
+}
+
+/*
+ * the benchmarked jobs print what a real one would; keep it off the screen
+ */
+static int quiet(void)
+{
+    int saved, null;
+
+    fflush( stdout );
+
+    saved = dup( STDOUT_FILENO );
+    null  = open( "/dev/null", O_WRONLY );
+
+    dup2( null, STDOUT_FILENO );
+    close( null );
+
+    return saved;
+}
+
+static void loud(int saved)
+{
+    fflush( stdout );
+
+    dup2( saved, STDOUT_FILENO );
+    close( saved );
+}
+
+/*
+ * fill 'len' bytes with noise (xorshift64), a busy enough image or signal
+ */
+static void noise(unsigned char *buf, long len, uint64_t *state)
+{
+    long i;
+
+    for ( i = 0; i < len; i++ )
+    {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+
+        buf[i] = *state >> 56;
+    }
+}
+
+static void put16(unsigned char *b, int v)
+{
+    b[0] = v;
+    b[1] = v >> 8;
+}
+
+static void put32(unsigned char *b, long v)
+{
+    put16( b, v );
+    put16( b + 2, v >> 16 );
+}
+
+/*
+ * write a 24-bit bitmap or a 16-bit stereo WAV file of about AUTOTUNE_BYTES
+ * of noise, synced to disk
+ */
+static void make_carrier(const char *name, int type)
+{
+    unsigned char header[54], *buf;
+    long data, pos, len, hlen;
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    FILE *f = fopen( name, "wb" );
+
+    if ( !f )
+    {
+        fprintf( stderr, "[ERROR] could not create %s: %s\n", name, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    memset( header, 0, sizeof(header) );
+
+    if ( type == bitmap )
+    {
+        data = AUTOTUNE_BYTES / (3 * AUTOTUNE_WIDTH) * (3 * AUTOTUNE_WIDTH);
+        hlen = 54;
+
+        memcpy( header, "BM", 2 );
+        put32( header + OFF_FILE_SIZE, hlen + data );
+        put32( header + OFF_PIXEL_START, hlen );
+        put32( header + 0x0E, 40 );
+        put32( header + OFF_BITMAP_WIDTH, AUTOTUNE_WIDTH );
+        put32( header + OFF_BITMAP_HEIGHT, data / (3 * AUTOTUNE_WIDTH) );
+        put16( header + 0x1A, 1 );
+        put16( header + OFF_BITMAP_DEPTH, 24 );
+        put32( header + OFF_COMPRESSION, BI_RGB );
+        put32( header + 0x22, data );
+    }
+    else
+    {
+        data = AUTOTUNE_BYTES / 4 * 4;
+        hlen = 44;
+
+        memcpy( header, "RIFF", 4 );
+        put32( header + 4, 36 + data );
+        memcpy( header + 8, "WAVEfmt ", 8 );
+        put32( header + 16, 16 );
+        put16( header + 20, 1 );            // PCM
+        put16( header + 22, 2 );            // stereo
+        put32( header + 24, 44100 );
+        put32( header + 28, 44100 * 4 );
+        put16( header + 32, 4 );
+        put16( header + 34, 16 );
+        memcpy( header + 36, "data", 4 );
+        put32( header + 40, data );
+    }
+
+    buf = malloc( 1L << 20 );
+
+    fwrite( header, 1, hlen, f );
+
+    for ( pos = 0; pos < data; pos += len )
+    {
+        len = (data - pos < (1L << 20)) ? data - pos : (1L << 20);
+
+        noise( buf, len, &state );
+
+        if ( (long)fwrite(buf, 1, len, f) != len )
+        {
+            fprintf( stderr, "[ERROR] could not write %s: %s\n", name, strerror(errno) );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    free( buf );
+
+    fflush( f );
+    fdatasync( fileno(f) );
+    fclose( f );
+}
+
+/*
+ * open a synthetic carrier and read its header.  p gets random payload bytes
+ * for half of what the carrier holds (the first time; the bytes are
+ * malloc()ed, they outlive arena resets)
+ */
+static void open_carrier(struct container *c, const char *name, int type, struct payload *p)
+{
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+
+    memset( c, 0, sizeof(*c) );
+
+    c->type = type;
+    c->fp   = open_file( name, &c->filename );
+
+    bind_carrier( c, 0, 0 );
+    get_info( c );
+
+    if ( p->bytes == NULL )
+    {
+        strncpy( p->filename, "(autotune)", MAX_FILENAME_LENGTH );
+        p->size     = carrier_capacity( c ) / 2;
+        p->datasize = p->size;
+        p->bytes    = malloc( p->size );
+
+        noise( p->bytes, p->size, &state );
+    }
+}
+
+/*
+ * one hide job, start to finish, the way main() would run it with 'cfg';
+ * returns the seconds from the first carrier byte read to the output synced
+ */
+static double time_job(const char *name, int type, const char *out, struct config *cfg, struct payload *p)
+{
+    struct container c;
+    double t0, t;
+    FILE *f;
+
+    open_carrier( &c, name, type, p );
+
+    // every run starts cold, as a real job on a big carrier does
+    posix_fadvise( fileno(c.fp), 0, 0, POSIX_FADV_DONTNEED );
+
+    t0 = now();
+
+    if ( cfg->direct )
+    {
+        direct_request = cfg->request;
+        direct_load( &c );
+    }
+    else
+    {
+        init_data_storage( &c );
+
+        if ( cfg->threads > 1 )
+            numa_load( &c, cfg->threads );
+        else
+            get_data( &c );
+    }
+
+    if ( c.numa )
+        numa_cover( &c, p );
+    else
+        mode_action( &c, p );
+
+    if ( cfg->direct )
+    {
+        direct_write( &c, out );
+    }
+    else
+    {
+        if ( (f = fopen(out, "wb")) == NULL )
+        {
+            fprintf( stderr, "Error opening %s for writing: %s\n", out, strerror(errno) );
+            exit( EXIT_FAILURE );
+        }
+
+        write_header( f, &c );
+        write_data( f, &c );
+
+        // O_DIRECT writes reach the disk; make the stdio ones do the same
+        fflush( f );
+        fdatasync( fileno(f) );
+        posix_fadvise( fileno(f), 0, 0, POSIX_FADV_DONTNEED );
+        fclose( f );
+    }
+
+    t = now() - t0;
+
+    fclose( c.fp );
+    arena_reset( &job_arena );
+
+    return t;
+}
+
+/*
+ * best of AUTOTUNE_ROUNDS embeds and extracts over the whole loaded bitmap,
+ * with the vector kernels on or off
+ */
+static double time_kernel(const char *name, struct payload *p, int vector)
+{
+    struct container c;
+    long units;
+    double t0, best = 0, t;
+    int round, saved = quiet();
+
+    open_carrier( &c, name, bitmap, p );
+    init_data_storage( &c );
+    get_data( &c );
+
+    vector_kernels = vector;
+    units = 8L * p->size;
+
+    for ( round = 0; round < AUTOTUNE_ROUNDS; round++ )
+    {
+        t0 = now();
+
+        cover_units( &c, p, 0, units );
+        uncover_units( &c, p, 0, units );
+
+        t = now() - t0;
+
+        if ( round == 0 || t < best )
+            best = t;
+    }
+
+    vector_kernels = 1;
+
+    fclose( c.fp );
+    arena_reset( &job_arena );
+
+    loud( saved );
+
+    return best;
+}
+
+/*
+ * the configurations worth trying on this host: stdio on 1, 2, 4... threads
+ * up to the cpu count, and O_DIRECT at a few request sizes if the tuned
+ * directory supports it
+ */
+static int list_configs(struct config *cfg, const char *dir)
+{
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN ), t;
+    long requests[] = { 1L << 20, 8L << 20, 32L << 20 };
+    char name[MAX_FILENAME_LENGTH + 1];
+    int n = 0, fd;
+    unsigned i;
+
+    for ( t = 1; t < cpus && n < MAX_CONFIGS - 4; t *= 2 )
+        cfg[n++] = (struct config){ t, 0, 0, 0 };
+
+    cfg[n++] = (struct config){ (cpus > 1) ? cpus : 1, 0, 0, 0 };
+
+    if ( n > 1 && cfg[n - 1].threads == cfg[n - 2].threads )
+        n--;
+
+    snprintf( name, sizeof(name), "%s/.autotune-probe", dir );
+
+    fd = open( name, O_WRONLY | O_CREAT | O_DIRECT, 0644 );
+
+    if ( fd >= 0 )
+    {
+        for ( i = 0; i < sizeof(requests) / sizeof(*requests); i++ )
+            cfg[n++] = (struct config){ 1, 1, requests[i], 0 };
+
+        close( fd );
+    }
+    else
+    {
+        printf( "%s has no O_DIRECT support; not trying --direct.\n", dir );
+    }
+
+    unlink( name );
+
+    return n;
+}
+
+static void describe(struct config *cfg, char *buf, size_t len)
+{
+    if ( cfg->direct )
+        snprintf( buf, len, "O_DIRECT, %ld MB requests", cfg->request >> 20 );
+    else
+        snprintf( buf, len, "stdio, %d thread%s", cfg->threads, (cfg->threads == 1) ? "" : "s" );
+}
+
+/*
+ * benchmark this host, storing scratch carriers in 'dir', and write the
+ * fastest configuration to 'profile' (the default profile if empty).
+ * returns 0
+ */
+int autotune(const char *dir, const char *profile)
+{
+    struct config cfg[MAX_CONFIGS], *best;
+    struct payload pb, pw;
+    char bmp[MAX_FILENAME_LENGTH + 1], wav[MAX_FILENAME_LENGTH + 1], out[MAX_FILENAME_LENGTH + 1];
+    char path[MAX_FILENAME_LENGTH + 1], host[64] = "localhost", what[64];
+    double vec, scalar, t, tb, tw;
+    long request = direct_request;
+    int n, i, round, saved;
+    FILE *f;
+
+    snprintf( bmp, sizeof(bmp), "%s/.autotune.bmp", dir );
+    snprintf( wav, sizeof(wav), "%s/.autotune.wav", dir );
+    snprintf( out, sizeof(out), "%s/.autotune.out", dir );
+
+    if ( profile[0] )
+        snprintf( path, sizeof(path), "%s", profile );
+    else
+        profile_path( path, sizeof(path) );
+
+    printf( "writing %ld MB synthetic carriers to %s...\n", 2 * AUTOTUNE_BYTES >> 20, dir );
+
+    make_carrier( bmp, bitmap );
+    make_carrier( wav, wavfile );
+
+    memset( &pb, 0, sizeof(pb) );
+    memset( &pw, 0, sizeof(pw) );
+
+    // the kernels, in memory
+    vec    = time_kernel( bmp, &pb, 1 );
+    scalar = time_kernel( bmp, &pb, 0 );
+
+    printf( "\n%-32s %10s\n", "embed + extract kernel", "seconds" );
+    printf( "%-32s %10.4f\n", "SSSE3", vec );
+    printf( "%-32s %10.4f\n", "scalar", scalar );
+
+    vector_kernels = (vec <= scalar);
+
+    // whole jobs, with the kernel just chosen
+    n = list_configs( cfg, dir );
+
+    printf( "\n%-32s %10s %10s %10s\n", "carrier i/o", "bitmap", "wav", "total" );
+
+    for ( i = 0; i < n; i++ )
+    {
+        tb = tw = 0;
+
+        for ( round = 0; round < AUTOTUNE_ROUNDS; round++ )
+        {
+            saved = quiet();
+
+            t = time_job( bmp, bitmap, out, &cfg[i], &pb );
+            tb = (round == 0 || t < tb) ? t : tb;
+
+            t = time_job( wav, wavfile, out, &cfg[i], &pw );
+            tw = (round == 0 || t < tw) ? t : tw;
+
+            loud( saved );
+        }
+
+        cfg[i].secs = tb + tw;
+
+        describe( &cfg[i], what, sizeof(what) );
+        printf( "%-32s %10.4f %10.4f %10.4f\n", what, tb, tw, cfg[i].secs );
+    }
+
+    unlink( bmp );
+    unlink( wav );
+    unlink( out );
+
+    direct_request = request;
+
+    free( pb.bytes );
+    free( pw.bytes );
+
+    for ( best = &cfg[0], i = 1; i < n; i++ )
+        if ( cfg[i].secs < best->secs )
+            best = &cfg[i];
+
+    gethostname( host, sizeof(host) - 1 );
+
+    if ( (f = fopen(path, "w")) == NULL )
+    {
+        fprintf( stderr, "[ERROR] could not write profile %s: %s\n", path, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    describe( best, what, sizeof(what) );
+
+    fprintf( f, "# steganographer autotune profile; rerun -T to refresh\n"
+                "host=%s\n"
+                "kernel=%s\n"
+                "threads=%d\n"
+                "direct=%d\n"
+                "request=%ld\n",
+             host, vector_kernels ? "ssse3" : "scalar", best->threads, best->direct,
+             best->direct ? best->request : direct_request );
+
+    fclose( f );
+
+    printf( "\nfastest: %s kernel, %s.\nprofile written to %s.\n", vector_kernels ? "SSSE3" : "scalar", what, path );
+
+    return 0;
+}
+
+/*
+ * read the profile, if this host has one, into whatever the command line
+ * left open.  -j and --direct are only filled in for jobs that load the whole
+ * carrier (whole-payload hide and recover without --delta or --checkpoint)
+ */
+void load_profile(struct user_input *u)
+{
+    char path[MAX_FILENAME_LENGTH + 1], line[256], key[32], value[200], host[64] = "localhost";
+    int threads = 0, direct = 0, whole;
+    long request;
+    FILE *f;
+
+    profile_path( path, sizeof(path) );
+
+    if ( (f = fopen(path, "r")) == NULL )
+        return;
+
+    gethostname( host, sizeof(host) - 1 );
+
+    while ( fgets(line, sizeof(line), f) )
+    {
+        if ( line[0] == '#' || sscanf(line, "%31[^=]=%199s", key, value) != 2 )
+            continue;
+
+        // a profile copied over from another machine says nothing about this one
+        if ( !strcmp(key, "host") && strcmp(value, host) )
+        {
+            fclose( f );
+            return;
+        }
+
+        if ( !strcmp(key, "kernel") )
+            vector_kernels = strcmp( value, "scalar" ) != 0;
+        else if ( !strcmp(key, "threads") )
+            threads = atoi( value );
+        else if ( !strcmp(key, "direct") )
+            direct = atoi( value );
+        else if ( !strcmp(key, "request") && (request = atol(value)) > 0 && request % 4096 == 0 )
+            direct_request = request;
+    }
+
+    fclose( f );
+
+    whole = (mode == hide || mode == recover) && !u->range_set && !u->deltafile[0] && !u->checkpoint;
+
+    if ( !whole || u->threads || u->direct )
+        return;
+
+    if ( threads > 1 )
+    {
+        u->threads = threads;
+        printf( "tuned profile %s: -j %d\n", path, threads );
+    }
+    else if ( direct )
+    {
+        u->direct = 1;
+        printf( "tuned profile %s: --direct, %ld MB requests\n", path, direct_request >> 20 );
+    }
+}
@@ -10,6 +10,71 @@
 #include "steganographer.h"
 #include <math.h>  // for floor() in calculate_padding()
 
+/*
+ * the byte of a 32-bit pixel that a BI_BITFIELDS mask selects, or -1 if the
+ * mask isn't exactly one byte (10-bit channels and such)
+ */
+static int mask_byte(uint32_t mask)
+{
+    int k;
+
+    for ( k = 0; k < 4; k++ )
+        if ( mask == (uint32_t)0xFF << (8 * k) )
+            return k;
+
+    return -1;
+}
+
+/*
+ * describe where the payload bits go.  24-bit pixels are stored blue, green,
+ * red; 32-bit pixels add an alpha (or unused) byte, which is never touched --
+ * with BI_RGB it's the last one, with BI_BITFIELDS the masks say where the
+ * colors are.  only the channels in 'channel_mask' are used.  a 24-bit row
+ * with all three is just a run of bytes.  any other depth is treated as plain
+ * bytes, the way it always was; validate_bitmap() turns those away before
+ * hiding anything
+ */
+static void find_layout(struct container *c)
+{
+    struct bitmap *b = c->b;
+    struct layout *l = &c->layout;
+    int pos[3] = { 0, 1, 2 }; // blue, green, red
+    int k;
+
+    if ( b->channel_mask == 0 )
+        b->channel_mask = CHANNEL_ALL;
+
+    if ( b->depth == 32 && b->compression == BI_BITFIELDS )
+    {
+        pos[0] = mask_byte( b->color_mask[2] );
+        pos[1] = mask_byte( b->color_mask[1] );
+        pos[2] = mask_byte( b->color_mask[0] );
+    }
+
+    l->offset     = b->start;
+    l->runs       = b->height;
+    l->run_stride = b->rowlen;
+
+    if ( (b->depth == 24 && b->channel_mask == CHANNEL_ALL) || (b->depth != 24 && b->depth != 32) )
+    {
+        l->groups    = b->rowlen - b->pad;
+        l->stride    = 1;
+        l->lane_mask = 1;
+    }
+    else
+    {
+        l->groups    = b->width;
+        l->stride    = b->size;
+        l->lane_mask = 0;
+
+        for ( k = 0; k < 3; k++ )
+            if ( (b->channel_mask & (1 << k)) && pos[k] >= 0 )
+                l->lane_mask |= 1 << pos[k];
+    }
+
+    set_layout( l );
+}
+
 /*
  * load header data from a bitmap file
  */
@@ -37,6 +102,21 @@ void get_bitmap_info(struct container *c)
 
     fseek( c->fp, OFF_BITMAP_DEPTH, SEEK_SET );
     fread( &c->b->depth, sizeof(c->b->depth), 1, c->fp );
+    fread( &c->b->compression, sizeof(c->b->compression), 1, c->fp );
+
+    if ( c->b->compression == BI_BITFIELDS )
+    {
+        fseek( c->fp, OFF_COLOR_MASKS, SEEK_SET );
+        fread( c->b->color_mask, sizeof(c->b->color_mask), 1, c->fp );
+    }
+
+    // derive a few essential values; see 'bitmap' declaration in steganographer.h
+    c->b->pad    = calculate_padding( c->b->width, c->b->depth );
+    c->b->size   = c->b->depth / 8;
+    c->b->start  = c->b->data_offset;
+    c->b->rowlen = c->b->size * c->b->width + c->b->pad;
+
+    find_layout( c );
 
     return;
 }
@@ -87,22 +167,38 @@ int write_bitmap_header(FILE *target, struct container *c)
 }
 
 /*
- * ensure we're using a 24-bit bitmap, and that the base file is at least 8
- * times larger than the payload
+ * ensure we're using a 24- or 32-bit bitmap with usable color channels, and
+ * that the base file is at least 8 times larger than the payload
  */
 void validate_bitmap(struct container *c, struct payload *p)
 {
     int bitmap_size;
 
-    if ( (c->b->depth != 24) )
+    if ( (c->b->depth != 24) && (c->b->depth != 32) )
     {
         fprintf( stderr,
-                "[ERROR] unsupported color-depth detected; bitmap format must be 24-bit color.\n"
+                "[ERROR] unsupported color-depth detected; bitmap format must be 24- or 32-bit color.\n"
                  "%s: %d-bit\n", c->filename, c->b->depth );
 
         exit( EXIT_FAILURE );
     }
 
+    if ( (c->b->compression != BI_RGB) && !(c->b->depth == 32 && c->b->compression == BI_BITFIELDS) )
+    {
+        fprintf( stderr, "[ERROR] %s: compressed bitmaps (method %d) are not supported.\n",
+                 c->filename, c->b->compression );
+
+        exit( EXIT_FAILURE );
+    }
+
+    if ( c->layout.lanes == 0 )
+    {
+        fprintf( stderr, "[ERROR] %s: none of the selected color channels is an 8-bit channel we can use.\n",
+                 c->filename );
+
+        exit( EXIT_FAILURE );
+    }
+
     bitmap_size = c->b->width * c->b->height;
 
     if ( (bitmap_size / p->size) < 8 )
@@ -152,12 +248,15 @@ void show_bitmap_info(struct container *c, struct payload *p)
             c->filename, c->filesize, c->b->data_offset,
             c->b->width, c->b->height, c->b->depth );
 
+    if ( c->layout.stride > 1 )
+        printf( "\nembedding in %d of %d bytes per pixel.", c->layout.lanes, c->layout.stride );
+
     printf( "\n%d byte%s of padding required per row.\n", c->b->pad, (c->b->pad == 1) ? "" : "s" );
     printf( "row length (+ padding): %d bytes\n\n", c->b->rowlen );
 
     printf( "--[hide file]------------------\n"
             "file name: %s\n"
-            "file size: %d bytes (IMPORTANT: this number is required to recover the file)\n", p->filename, p->size );
+            "file size: %d bytes (IMPORTANT: this number is required to recover the file)\n", p->filename, p->datasize );
 
     puts( "-------------------------------\n" );
 
@@ -0,0 +1,298 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, checkpoint.c
+ *
+ * checkpointed hide and recover jobs that survive being killed
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <stdint.h>
+#include <fcntl.h>     // for open()
+#include <unistd.h>    // for pread(), pwrite(), fdatasync()
+#include <sys/stat.h>  // for fstat()
+
+/*
+ * a normal job loads the whole carrier, mixes the payload in and writes
+ * everything out at the end, so a job killed at 90% starts over from zero.
+ * with --checkpoint the carrier is streamed instead, CHECKPOINT_CHUNK bytes
+ * at a time, and every CHECKPOINT_INTERVAL chunks the output is synced and a
+ * sidecar (the output filename plus ".ckpt") records how far we got:
+ *
+ *     the carrier offset and payload bit reached
+ *     how many output bytes are on disk, and their FNV-1a hash
+ *     the carrier size and an FNV-1a hash of the hidden stream, so a resume
+ *     against a different carrier or payload is caught
+ *
+ * --resume rehashes the output written so far, and if it matches the sidecar
+ * picks the job up from there.  a kill costs at most one interval of work.
+ * the sidecar is removed once the job completes.
+ */
+
+#define CHECKPOINT_CHUNK    (8L << 20)    // carrier bytes per read
+#define CHECKPOINT_INTERVAL 8             // chunks between checkpoints (64 MB)
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+// the sidecar file, written whole every checkpoint
+struct checkpoint
+{
+    char     magic[4];        // "STGK"
+    int32_t  mode;            // hide or recover
+    int64_t  carrier_size;    // size of the carrier file
+    int64_t  stream_size;     // size of the hidden stream
+    uint64_t stream_hash;     // FNV-1a of the stream (hide mode)
+    int64_t  carrier_pos;     // carrier offset the next chunk starts at
+    int64_t  bit;             // payload bits done
+    int64_t  written;         // output bytes synced to disk
+    uint64_t output_hash;     // FNV-1a of those bytes
+};
+
+static uint64_t fnv1a(uint64_t h, const unsigned char *b, long len)
+{
+    long i;
+
+    for ( i = 0; i < len; i++ )
+        h = (h ^ b[i]) * FNV_PRIME;
+
+    return h;
+}
+
+/*
+ * one past the last carrier byte the output covers: the end of the pixel
+ * matrix or the sample data in hide mode, the last unit we read in recover
+ */
+static long carrier_end(struct container *c, struct payload *p)
+{
+    if ( mode == recover )
+        return carrier_offset( c, 8L * p->size - 1 ) + 1;
+
+    return carrier_data_end( c );
+}
+
+static void write_sidecar(const char *name, struct checkpoint *ck)
+{
+    char tmp[MAX_FILENAME_LENGTH + 16];
+    FILE *f;
+
+    // write a fresh copy and rename it over the old one, so a kill while
+    // checkpointing leaves the previous checkpoint intact
+    snprintf( tmp, sizeof(tmp), "%s.tmp", name );
+
+    f = fopen( tmp, "wb" );
+
+    if ( !f || fwrite(ck, sizeof(*ck), 1, f) != 1 || fflush(f) || fdatasync(fileno(f)) )
+    {
+        fprintf( stderr, "[ERROR] could not write checkpoint %s: %s\n", tmp, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    fclose( f );
+
+    if ( rename(tmp, name) )
+    {
+        fprintf( stderr, "[ERROR] could not write checkpoint %s: %s\n", name, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+}
+
+static void save_checkpoint(int out, const char *name, struct checkpoint *ck)
+{
+    // the output has to be on disk before the sidecar says it is
+    if ( fdatasync(out) )
+    {
+        fprintf( stderr, "[ERROR] could not sync output: %s\n", strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    write_sidecar( name, ck );
+}
+
+/*
+ * load and check the sidecar for a resumed job; on success the output file is
+ * truncated back to what the sidecar vouches for
+ */
+static void load_checkpoint(int out, const char *name, struct checkpoint *ck, struct checkpoint *want,
+                            struct payload *p)
+{
+    unsigned char *buf;
+    uint64_t h = FNV_OFFSET;
+    long pos, len;
+    FILE *f = fopen( name, "rb" );
+
+    if ( !f || fread(ck, sizeof(*ck), 1, f) != 1 || memcmp(ck->magic, "STGK", 4) )
+    {
+        fprintf( stderr, "[ERROR] no usable checkpoint in %s, start the job without --resume.\n", name );
+        exit( EXIT_FAILURE );
+    }
+
+    fclose( f );
+
+    if ( ck->mode != want->mode || ck->carrier_size != want->carrier_size
+      || ck->stream_size != want->stream_size || ck->stream_hash != want->stream_hash )
+    {
+        fprintf( stderr, "[ERROR] %s belongs to a different job (carrier, payload or mode changed), aborting.\n", name );
+        exit( EXIT_FAILURE );
+    }
+
+    // rehash what's on disk; recovered bytes go straight back into the payload
+    buf = (mode == recover) ? p->bytes : arena_alloc( &job_arena, CHECKPOINT_CHUNK );
+
+    for ( pos = 0; pos < ck->written; pos += len )
+    {
+        len = (ck->written - pos < CHECKPOINT_CHUNK) ? ck->written - pos : CHECKPOINT_CHUNK;
+
+        if ( pread(out, (mode == recover) ? buf + pos : buf, len, pos) != len )
+            break;
+
+        h = fnv1a( h, (mode == recover) ? buf + pos : buf, len );
+    }
+
+    if ( pos < ck->written || h != ck->output_hash )
+    {
+        fprintf( stderr, "[ERROR] the output no longer matches checkpoint %s; start over without --resume.\n", name );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( ftruncate(out, ck->written) )
+    {
+        fprintf( stderr, "[ERROR] could not truncate output: %s\n", strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    printf( "resuming at carrier byte %ld, payload bit %ld (%ld output bytes verified).\n",
+            (long)ck->carrier_pos, (long)ck->bit, (long)ck->written );
+}
+
+/*
+ * hide or recover p in c, streaming the carrier in chunks and checkpointing
+ * as we go.  in recover mode p->bytes holds the whole hidden stream on return.
+ * returns the number of bytes written to 'outname'
+ */
+long checkpoint_run(struct container *c, struct payload *p, const char *outname, int resume)
+{
+    char sidecar[MAX_FILENAME_LENGTH + 8];
+    struct checkpoint ck, want;
+    struct stat st;
+    unsigned char *buf;
+    long end, len, off, total = 8L * p->size, chunks = 0, first, changed;
+    unsigned char v;
+    int in, out;
+
+    snprintf( sidecar, sizeof(sidecar), "%s.ckpt", outname );
+
+    in  = open( c->filename, O_RDONLY );
+    out = open( outname, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0644 );
+
+    if ( in < 0 || out < 0 || fstat(in, &st) )
+    {
+        fprintf( stderr, "[ERROR] could not open %s: %s\n", (in < 0) ? c->filename : outname, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    memset( &want, 0, sizeof(want) );
+    memcpy( want.magic, "STGK", 4 );
+    want.mode         = mode;
+    want.carrier_size = st.st_size;
+    want.stream_size  = p->size;
+    want.stream_hash  = (mode == hide) ? fnv1a( FNV_OFFSET, p->bytes, p->size ) : 0;
+    want.carrier_pos  = (mode == recover) ? carrier_offset( c, 0 ) : 0;
+    want.output_hash  = FNV_OFFSET;
+
+    if ( resume )
+        load_checkpoint( out, sidecar, &ck, &want, p );
+    else
+        ck = want;
+
+    end = carrier_end( c, p );
+    buf = arena_alloc( &job_arena, CHECKPOINT_CHUNK );
+
+    if ( mode == hide )
+        printf( "mixing bits from %s into %s, checkpointing to %s...\n", p->filename, c->filename, sidecar );
+
+    while ( ck.carrier_pos < end )
+    {
+        len = (end - ck.carrier_pos < CHECKPOINT_CHUNK) ? end - ck.carrier_pos : CHECKPOINT_CHUNK;
+
+        if ( pread(in, buf, len, ck.carrier_pos) != len )
+        {
+            fprintf( stderr, "[ERROR] %s: short read at byte %ld, aborting.\n", c->filename, (long)ck.carrier_pos );
+            exit( EXIT_FAILURE );
+        }
+
+        first   = ck.bit;
+        changed = 0;
+
+        if ( mode == hide )
+            PROBE2( cover_start, first, total );
+        else
+            PROBE2( uncover_start, first, total );
+
+        // every payload bit whose carrier byte falls in this chunk
+        for ( ; ck.bit < total && (off = carrier_offset(c, ck.bit)) < ck.carrier_pos + len; ck.bit++ )
+        {
+            unsigned char *q = buf + (off - ck.carrier_pos);
+
+            if ( mode == hide )
+            {
+                v        = (*q & ~1) | (1 & (p->bytes[ck.bit / 8] >> (7 - (ck.bit % 8))));
+                changed += (v != *q);
+                *q       = v;
+            }
+            else
+                p->bytes[ck.bit / 8] |= (*q & 1) << (7 - (ck.bit % 8));
+        }
+
+        if ( mode == hide )
+        {
+            PROBE3( cover_done, first, (long)ck.bit, changed );
+            PROBE1( write_start, (long)ck.carrier_pos );
+
+            if ( pwrite(out, buf, len, ck.carrier_pos) != len )
+                goto WRITE_ERROR;
+
+            PROBE2( write_done, (long)ck.carrier_pos, len );
+
+            ck.output_hash = fnv1a( ck.output_hash, buf, len );
+            ck.written     = ck.carrier_pos + len;
+            ck.carrier_pos = ck.written;
+        }
+        else
+        {
+            // only whole bytes go out; the next chunk starts over at the
+            // carrier byte of the first bit of the incomplete one
+            long done = ck.bit / 8;
+
+            PROBE2( uncover_done, first, (long)ck.bit );
+            PROBE1( write_start, (long)ck.written );
+
+            if ( pwrite(out, p->bytes + ck.written, done - ck.written, ck.written) != done - ck.written )
+                goto WRITE_ERROR;
+
+            PROBE2( write_done, (long)ck.written, done - ck.written );
+
+            ck.output_hash = fnv1a( ck.output_hash, p->bytes + ck.written, done - ck.written );
+            ck.written     = done;
+            ck.bit         = 8 * done;
+            ck.carrier_pos = (ck.bit < total) ? carrier_offset( c, ck.bit ) : end;
+
+            if ( ck.bit < total )
+                p->bytes[done] = 0;
+        }
+
+        if ( ++chunks % CHECKPOINT_INTERVAL == 0 )
+            save_checkpoint( out, sidecar, &ck );
+    }
+
+    close( in );
+    close( out );
+    unlink( sidecar );
+
+    return ck.written;
+
+WRITE_ERROR:
+    fprintf( stderr, "[ERROR] could not write %s: %s\n", outname, strerror(errno) );
+    exit( EXIT_FAILURE );
+}
@@ -0,0 +1,328 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, delta.c
+ *
+ * compact binary deltas: ship the carrier changes instead of the carrier
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <stdint.h>
+#include <fcntl.h>     // for open()
+#include <unistd.h>    // for close()
+#include <sys/mman.h>  // for mmap()
+#include <sys/stat.h>  // for fstat()
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * delta file layout (little-endian)                             *
+ *                                                               *
+ * Offset (hex)    Size (bytes)    Description                   *
+ * ------------    ------------    ----------------------------- *
+ * 00              4               magic bytes ("STGD")          *
+ * 04              4               carrier byte stride of a run  *
+ * 08              8               size of the carrier (bytes)   *
+ * 10              4               number of runs                *
+ * 14              ...             runs                          *
+ *                                                               *
+ * each run is a varint gap (from the last byte of the previous  *
+ * run, or from 0), a varint count of carrier bytes spaced       *
+ * 'stride' apart, then count bits of new lsb values, msb first. *
+ *                                                               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define DELTA_MAGIC       "STGD"
+#define DELTA_HEADER_SIZE 0x14
+
+// changed bytes at most this many strides apart share a run; one bit per
+// absorbed unchanged byte is cheaper than the few bytes a new run costs
+#define DELTA_MAX_GAP 16
+
+static void put_varint(FILE *out, uint64_t v)
+{
+    while ( v >= 0x80 )
+    {
+        fputc( (v & 0x7F) | 0x80, out );
+        v >>= 7;
+    }
+
+    fputc( v, out );
+}
+
+static uint64_t get_varint(const unsigned char **p, const unsigned char *end)
+{
+    uint64_t v = 0;
+    int shift = 0;
+
+    while ( *p < end )
+    {
+        unsigned char b = *(*p)++;
+
+        v |= (uint64_t)(b & 0x7F) << shift;
+
+        if ( !(b & 0x80) )
+            return v;
+
+        shift += 7;
+    }
+
+    fprintf( stderr, "[ERROR] delta file is truncated, aborting.\n" );
+    exit( EXIT_FAILURE );
+}
+
+/*
+ * append one run (carrier bytes first, first + stride, ..., last) to the
+ * delta, taking the new lsb values from the already-updated span buffer
+ */
+static int put_run(FILE *out, unsigned char *buf, long base, long prev, long first, long last, int stride)
+{
+    long n, count = (last - first) / stride + 1;
+    unsigned char bits = 0;
+
+    put_varint( out, first - prev );
+    put_varint( out, count );
+
+    for ( n = 0; n < count; n++ )
+    {
+        bits = (bits << 1) | (buf[first + n * stride - base] & 1);
+
+        if ( (n % 8) == 7 )
+        {
+            fputc( bits, out );
+            bits = 0;
+        }
+    }
+
+    if ( count % 8 )
+        fputc( bits << (8 - count % 8), out );
+
+    return 1;
+}
+
+/*
+ * hide 'p' in 'c' on paper: work out which carrier bytes would change and
+ * write just those (with their new lsb values) to 'out'.  like an update,
+ * only the carrier span that holds the payload is read.
+ *
+ * returns the number of carrier bytes that change
+ */
+int write_delta(FILE *out, struct container *c, struct payload *p)
+{
+    int k, stride, changed = 0;
+    uint32_t runs = 0;
+    int64_t filesize;
+    long base, bit, off, prev = 0, run_start = -1, run_end = -1;
+    unsigned char *buf, want;
+
+    stride = (c->type == wavfile) ? c->w->sample_size : 1;
+
+    fseek( c->fp, 0, SEEK_END );
+    filesize = ftell( c->fp );
+
+    // header; the run count is patched in at the end
+    fwrite( DELTA_MAGIC, 4, 1, out );
+    fwrite( &stride, 4, 1, out );
+    fwrite( &filesize, 8, 1, out );
+    fwrite( &runs, 4, 1, out );
+
+    buf = read_carrier_span( c, 8L * p->offset, 8L * p->size, &base );
+    bit = 8L * p->offset;
+
+    for ( k = 0; k < p->size * 8; k++, bit++ )
+    {
+        off  = carrier_offset( c, bit );
+        want = 1 & (p->bytes[k / 8] >> (7 - (k % 8)));
+
+        if ( (buf[off - base] & 1) == want )
+            continue;
+
+        buf[off - base] ^= 1;
+        changed++;
+
+        // bitmap pad bytes sit in the span too, so stride-1 runs can
+        // cross row boundaries; their lsbs are carried through unchanged
+        if ( run_start >= 0 && (off - run_end) % stride == 0 && (off - run_end) / stride <= DELTA_MAX_GAP )
+        {
+            run_end = off;
+        }
+        else
+        {
+            if ( run_start >= 0 )
+            {
+                runs += put_run( out, buf, base, prev, run_start, run_end, stride );
+                prev  = run_end;
+            }
+
+            run_start = run_end = off;
+        }
+    }
+
+    if ( run_start >= 0 )
+        runs += put_run( out, buf, base, prev, run_start, run_end, stride );
+
+    fseek( out, 0x10, SEEK_SET );
+    fwrite( &runs, 4, 1, out );
+    fseek( out, 0, SEEK_END );
+
+    return changed;
+}
+
+/*
+ * spread[s][v]: the 64-bit word whose bytes at 0, s, 2s, ... carry the bits
+ * of v (msb first) in their lsbs; lets apply_delta() set 8/s carrier bytes
+ * with one load, mask and store
+ */
+static uint64_t spread[5][256];
+
+static void init_spread(void)
+{
+    int s, v, k;
+
+    for ( s = 1; s <= 4; s *= 2 )
+    {
+        int units = 8 / s;
+
+        for ( v = 0; v < (1 << units); v++ )
+        {
+            spread[s][v] = 0;
+
+            for ( k = 0; k < units; k++ )
+                if ( v & (1 << (units - 1 - k)) )
+                    spread[s][v] |= (uint64_t)1 << (8 * k * s);
+        }
+    }
+}
+
+static inline int get_bit(const unsigned char *bits, long n)
+{
+    return 1 & (bits[n / 8] >> (7 - (n % 8)));
+}
+
+/*
+ * write 'count' lsbs into carrier bytes dst[0], dst[stride], ...
+ */
+static void apply_run(unsigned char *dst, const unsigned char *bits, long count, int stride)
+{
+    long n = 0;
+
+    // word at a time for the common strides
+    if ( stride == 1 || stride == 2 || stride == 4 )
+    {
+        int units = 8 / stride;
+        uint64_t lsbs = spread[stride][(1 << units) - 1];
+
+        for ( ; n + units <= count; n += units, dst += 8 )
+        {
+            uint64_t word;
+            unsigned v = 0;
+            int k;
+
+            // the next 'units' bits, msb first
+            if ( units == 8 && (n % 8) == 0 )
+                v = bits[n / 8];
+            else
+                for ( k = 0; k < units; k++ )
+                    v = (v << 1) | get_bit( bits, n + k );
+
+            memcpy( &word, dst, 8 );
+            word = (word & ~lsbs) | spread[stride][v];
+            memcpy( dst, &word, 8 );
+        }
+    }
+
+    for ( ; n < count; n++, dst += stride )
+        *dst = (*dst & ~1) | get_bit( bits, n );
+}
+
+/*
+ * patch the carrier file 'name' in place with the delta file 'deltaname';
+ * both are memory-mapped, and only the pages holding changed bytes are
+ * touched.  returns the number of runs applied
+ */
+int apply_delta(const char *name, const char *deltaname)
+{
+    int fd, dfd;
+    uint32_t stride, runs, r;
+    int64_t filesize;
+    long off = 0;
+    struct stat st, dst;
+    unsigned char *map;
+    const unsigned char *delta, *p, *end;
+
+    fd  = open( name, O_RDWR );
+    dfd = open( deltaname, O_RDONLY );
+
+    if ( fd < 0 || dfd < 0 )
+    {
+        fprintf( stderr, "[ERROR] could not open %s: %s\nAborting.\n",
+                 (fd < 0) ? name : deltaname, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    fstat( fd, &st );
+    fstat( dfd, &dst );
+
+    if ( dst.st_size < DELTA_HEADER_SIZE )
+    {
+        fprintf( stderr, "[ERROR] %s is not a delta file, aborting.\n", deltaname );
+        exit( EXIT_FAILURE );
+    }
+
+    delta = mmap( NULL, dst.st_size, PROT_READ, MAP_PRIVATE, dfd, 0 );
+    map   = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+
+    if ( delta == MAP_FAILED || map == MAP_FAILED )
+    {
+        fprintf( stderr, "[ERROR] apply_delta: mmap failed: %s\n", strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    memcpy( &stride, delta + 0x04, 4 );
+    memcpy( &filesize, delta + 0x08, 8 );
+    memcpy( &runs, delta + 0x10, 4 );
+
+    if ( memcmp(delta, DELTA_MAGIC, 4) != 0 || stride == 0 )
+    {
+        fprintf( stderr, "[ERROR] %s is not a delta file, aborting.\n", deltaname );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( filesize != st.st_size )
+    {
+        fprintf( stderr, "[ERROR] %s is %ld bytes but the delta was made for a %ld-byte carrier, aborting.\n",
+                 name, (long)st.st_size, (long)filesize );
+        exit( EXIT_FAILURE );
+    }
+
+    init_spread();
+
+    p   = delta + DELTA_HEADER_SIZE;
+    end = delta + dst.st_size;
+
+    for ( r = 0; r < runs; r++ )
+    {
+        long count;
+
+        off  += get_varint( &p, end );
+        count = get_varint( &p, end );
+
+        if ( count <= 0 || off + (count - 1) * stride >= st.st_size
+          || (count + 7) / 8 > end - p )
+        {
+            fprintf( stderr, "[ERROR] %s: run %u is out of bounds, aborting.\n", deltaname, r );
+            exit( EXIT_FAILURE );
+        }
+
+        apply_run( map + off, p, count, stride );
+
+        p   += (count + 7) / 8;
+        off += (count - 1) * stride;
+    }
+
+    munmap( map, st.st_size );
+    munmap( (void *)delta, dst.st_size );
+    close( fd );
+    close( dfd );
+
+    return runs;
+}
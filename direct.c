@@ -0,0 +1,166 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, direct.c
+ *
+ * direct (O_DIRECT) carrier input and output
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#define _GNU_SOURCE          // for O_DIRECT
+#include "steganographer.h"
+#include <fcntl.h>
+#include <unistd.h>          // for pread(), pwrite(), ftruncate()
+
+/*
+ * stdio reads the camouflage file and writes the output through the page
+ * cache, so a 20 GB carrier pushes 40 GB of somebody else's hot pages out of
+ * memory.  with --direct the file is read and the output written with
+ * O_DIRECT instead, in direct_request-byte requests, never touching the cache.
+ *
+ * O_DIRECT wants the buffer, the file offset and the length of every request
+ * aligned to the device block.  the header bytes and the pixel or sample data
+ * are read together as one image of the file, from offset 0, into an aligned
+ * buffer, and the pixel rows or sample stream point into it.  the output is
+ * the same image written back from offset 0; the last request is rounded up
+ * to a whole block and the file is truncated to its real length afterwards.
+ * filesystems that refuse O_DIRECT get ordinary i/o, followed by
+ * POSIX_FADV_DONTNEED so the pages don't linger.
+ */
+
+#define DIRECT_ALIGN    4096          // covers 512-byte and 4k-sector devices
+#define DIRECT_REQUEST  (8L << 20)    // bytes per read or write, unless tuned
+
+long direct_request = DIRECT_REQUEST;
+
+static long round_up(long n)
+{
+    return (n + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+}
+
+/*
+ * open 'name' with O_DIRECT, falling back to plain i/o if the filesystem
+ * won't have it; '*direct' says which we got
+ */
+static int open_direct(const char *name, int flags, int *direct)
+{
+    int fd = open( name, flags | O_DIRECT, 0644 );
+
+    *direct = 1;
+
+    if ( fd < 0 && errno == EINVAL )
+    {
+        fprintf( stderr, "[WARNING] %s: no O_DIRECT on this filesystem, using uncached i/o instead.\n", name );
+
+        fd = open( name, flags, 0644 );
+        *direct = 0;
+    }
+
+    if ( fd < 0 )
+    {
+        fprintf( stderr, "[ERROR] could not open %s: %s\n", name, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    return fd;
+}
+
+/*
+ * init_data_storage() and get_data() in one, for --direct: read the file
+ * image up to the end of the pixel or sample data and point the container
+ * into it.  returns the number of data bytes read
+ */
+int direct_load(struct container *c)
+{
+    long end = carrier_data_end( c ), len = round_up( end ), pos, n = 0;
+    unsigned char *image;
+    int fd, direct, i;
+
+    image = arena_alloc( &job_arena, len + DIRECT_ALIGN );
+    image = (unsigned char *)(uintptr_t)round_up( (long)(uintptr_t)image );
+
+    fd = open_direct( c->filename, O_RDONLY, &direct );
+
+    // requests past the end of the file just come back short
+    for ( pos = 0; pos < len; pos += n )
+    {
+        n = pread( fd, image + pos, (len - pos < direct_request) ? len - pos : direct_request, pos );
+
+        if ( n <= 0 )
+            break;
+    }
+
+    if ( pos < end )
+    {
+        fprintf( stderr, "[ERROR] %s: short read (%ld of %ld bytes): %s\n", c->filename, pos, end,
+                 (n < 0) ? strerror(errno) : "truncated file" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( !direct )
+        posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+
+    close( fd );
+
+    c->image = image;
+
+    if ( c->type == bitmap )
+    {
+        c->b->pixel = arena_alloc( &job_arena, c->b->height * sizeof(unsigned char *) );
+
+        for ( i = 0; i < c->b->height; i++ )
+            c->b->pixel[i] = image + c->b->start + (long)i * c->b->rowlen;
+    }
+    else
+    {
+        c->w->samples = image + c->w->data_offset;
+    }
+
+    return end - c->layout.offset;
+}
+
+/*
+ * write_header() and write_data() in one, for --direct: write the file image
+ * direct_load() read, now carrying the payload.  returns the bytes written
+ */
+int direct_write(struct container *c, const char *name)
+{
+    long end = carrier_data_end( c ), len = round_up( end ), pos, n;
+    int fd, direct;
+
+    // the rounded-up tail goes out too; it's cut off again below
+    memset( c->image + end, 0, len - end );
+
+    fd = open_direct( name, O_WRONLY | O_CREAT | O_TRUNC, &direct );
+
+    for ( pos = 0; pos < len; pos += n )
+    {
+        PROBE1( write_start, pos );
+
+        n = pwrite( fd, c->image + pos, (len - pos < direct_request) ? len - pos : direct_request, pos );
+
+        if ( n <= 0 )
+        {
+            fprintf( stderr, "[ERROR] could not write %s: %s\n", name, strerror(errno) );
+            exit( EXIT_FAILURE );
+        }
+
+        PROBE2( write_done, pos, n );
+    }
+
+    if ( ftruncate(fd, end) )
+    {
+        fprintf( stderr, "[ERROR] could not truncate %s: %s\n", name, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( !direct )
+    {
+        fdatasync( fd );
+        posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+    }
+
+    close( fd );
+
+    return end;
+}
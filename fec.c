@@ -0,0 +1,554 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, fec.c
+ *
+ * Reed-Solomon forward error correction for hidden payloads
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <stdint.h>
+#include <immintrin.h>
+
+/*
+ * the payload is protected with RS(255, 255 - nsym) codewords over GF(2^8).
+ * we use the AES field polynomial x^8 + x^4 + x^3 + x + 1 (0x11B), with 3 as
+ * the primitive element, because that is the field the GFNI instructions
+ * multiply in.
+ *
+ * codewords are interleaved: with 'ncw' codewords, payload byte t is data
+ * symbol t / ncw of codeword t % ncw, and parity symbol r of codeword j is
+ * stored after the payload at r * ncw + j.  the hidden stream is therefore
+ * the untouched payload followed by its parity, and a burst of damaged
+ * carrier bytes is spread thinly over many codewords.  (the last data row
+ * of a short payload is padded with virtual zeros, never stored.)
+ *
+ * the interleaving also makes the heavy lifting vectorizable: encoding and
+ * syndrome computation run one symbol row at a time across all codewords,
+ * and each step is "multiply a row of bytes by a constant", which is a pair
+ * of PSHUFB lookups (4-bit split tables) or a single GF2P8MULB.
+ */
+
+#define FEC_N     255
+#define FEC_POLY  0x11B
+#define FEC_TILE  4096    // codewords processed together; keeps registers in L2
+
+static unsigned char gf_exp[2 * FEC_N];
+static unsigned char gf_log[256];
+
+static unsigned char gf_mul(unsigned char a, unsigned char b)
+{
+    if ( a == 0 || b == 0 )
+        return 0;
+
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static unsigned char gf_div(unsigned char a, unsigned char b)
+{
+    if ( a == 0 )
+        return 0;
+
+    return gf_exp[(gf_log[a] + FEC_N - gf_log[b]) % FEC_N];
+}
+
+static unsigned char gf_pow_alpha(int e)
+{
+    e %= FEC_N;
+
+    return gf_exp[(e < 0) ? e + FEC_N : e];
+}
+
+/* * * row kernels: dst[i] = c * dst[i] ^ src[i] (horner), or
+ * * *              dst[i] ^= c * src[i]        (mul_add)       */
+
+static void horner_scalar(unsigned char *dst, const unsigned char *src, unsigned char c, int n)
+{
+    int i;
+
+    for ( i = 0; i < n; i++ )
+        dst[i] = gf_mul( dst[i], c ) ^ src[i];
+}
+
+static void mul_add_scalar(unsigned char *dst, const unsigned char *src, unsigned char c, int n)
+{
+    int i;
+
+    if ( c == 0 )
+        return;
+
+    for ( i = 0; i < n; i++ )
+        dst[i] ^= gf_mul( src[i], c );
+}
+
+/*
+ * split tables: c * x == lo[x & 15] ^ hi[x >> 4]
+ */
+__attribute__((target("ssse3")))
+static inline __m128i mul_ssse3(__m128i x, __m128i lo, __m128i hi)
+{
+    __m128i mask = _mm_set1_epi8( 0x0F );
+    __m128i l = _mm_shuffle_epi8( lo, _mm_and_si128(x, mask) );
+    __m128i h = _mm_shuffle_epi8( hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask) );
+
+    return _mm_xor_si128( l, h );
+}
+
+static void split_tables(unsigned char c, unsigned char *lo, unsigned char *hi)
+{
+    int x;
+
+    for ( x = 0; x < 16; x++ )
+    {
+        lo[x] = gf_mul( c, x );
+        hi[x] = gf_mul( c, x << 4 );
+    }
+}
+
+__attribute__((target("ssse3")))
+static void horner_ssse3(unsigned char *dst, const unsigned char *src, unsigned char c, int n)
+{
+    unsigned char lo[16], hi[16];
+    __m128i vlo, vhi;
+    int i = 0;
+
+    split_tables( c, lo, hi );
+    vlo = _mm_loadu_si128( (__m128i *)lo );
+    vhi = _mm_loadu_si128( (__m128i *)hi );
+
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m128i d = _mm_loadu_si128( (__m128i *)(dst + i) );
+        __m128i s = _mm_loadu_si128( (__m128i *)(src + i) );
+
+        _mm_storeu_si128( (__m128i *)(dst + i), _mm_xor_si128(mul_ssse3(d, vlo, vhi), s) );
+    }
+
+    horner_scalar( dst + i, src + i, c, n - i );
+}
+
+__attribute__((target("ssse3")))
+static void mul_add_ssse3(unsigned char *dst, const unsigned char *src, unsigned char c, int n)
+{
+    unsigned char lo[16], hi[16];
+    __m128i vlo, vhi;
+    int i = 0;
+
+    if ( c == 0 )
+        return;
+
+    split_tables( c, lo, hi );
+    vlo = _mm_loadu_si128( (__m128i *)lo );
+    vhi = _mm_loadu_si128( (__m128i *)hi );
+
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m128i d = _mm_loadu_si128( (__m128i *)(dst + i) );
+        __m128i s = _mm_loadu_si128( (__m128i *)(src + i) );
+
+        _mm_storeu_si128( (__m128i *)(dst + i), _mm_xor_si128(d, mul_ssse3(s, vlo, vhi)) );
+    }
+
+    mul_add_scalar( dst + i, src + i, c, n - i );
+}
+
+__attribute__((target("gfni")))
+static void horner_gfni(unsigned char *dst, const unsigned char *src, unsigned char c, int n)
+{
+    __m128i vc = _mm_set1_epi8( c );
+    int i = 0;
+
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m128i d = _mm_loadu_si128( (__m128i *)(dst + i) );
+        __m128i s = _mm_loadu_si128( (__m128i *)(src + i) );
+
+        _mm_storeu_si128( (__m128i *)(dst + i), _mm_xor_si128(_mm_gf2p8mul_epi8(d, vc), s) );
+    }
+
+    horner_scalar( dst + i, src + i, c, n - i );
+}
+
+__attribute__((target("gfni")))
+static void mul_add_gfni(unsigned char *dst, const unsigned char *src, unsigned char c, int n)
+{
+    __m128i vc = _mm_set1_epi8( c );
+    int i = 0;
+
+    if ( c == 0 )
+        return;
+
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m128i d = _mm_loadu_si128( (__m128i *)(dst + i) );
+        __m128i s = _mm_loadu_si128( (__m128i *)(src + i) );
+
+        _mm_storeu_si128( (__m128i *)(dst + i), _mm_xor_si128(d, _mm_gf2p8mul_epi8(s, vc)) );
+    }
+
+    mul_add_scalar( dst + i, src + i, c, n - i );
+}
+
+// the best kernels this cpu supports; chosen by fec_init()
+static void (*horner)(unsigned char *, const unsigned char *, unsigned char, int);
+static void (*mul_add)(unsigned char *, const unsigned char *, unsigned char, int);
+
+static unsigned char generator[FEC_N + 1];  // g(x), highest degree first
+static int generator_nsym;
+
+/*
+ * build the log tables, pick the row kernels, and the generator polynomial
+ * g(x) = (x - a^0)(x - a^1)...(x - a^(nsym-1)) for 'nsym' parity symbols
+ */
+static void fec_init(int nsym)
+{
+    int i, j;
+    unsigned x = 1;
+
+    if ( horner == NULL )
+    {
+        for ( i = 0; i < FEC_N; i++ )
+        {
+            gf_exp[i] = gf_exp[i + FEC_N] = x;
+            gf_log[x] = i;
+
+            // multiply by the primitive element 3 = x + 1
+            x ^= x << 1;
+
+            if ( x & 0x100 )
+                x ^= FEC_POLY;
+        }
+
+        __builtin_cpu_init();
+
+        if ( __builtin_cpu_supports("gfni") )
+        {
+            horner  = horner_gfni;
+            mul_add = mul_add_gfni;
+        }
+        else if ( __builtin_cpu_supports("ssse3") )
+        {
+            horner  = horner_ssse3;
+            mul_add = mul_add_ssse3;
+        }
+        else
+        {
+            horner  = horner_scalar;
+            mul_add = mul_add_scalar;
+        }
+    }
+
+    if ( generator_nsym == nsym )
+        return;
+
+    memset( generator, 0, sizeof(generator) );
+    generator[0] = 1;
+
+    for ( i = 0; i < nsym; i++ )
+    {
+        unsigned char root = gf_pow_alpha( i );
+
+        // multiply by (x - root); subtraction is addition in GF(2^8)
+        for ( j = i + 1; j > 0; j-- )
+            generator[j] ^= gf_mul( generator[j - 1], root );
+    }
+
+    generator_nsym = nsym;
+}
+
+/*
+ * number of codewords needed for 'size' payload bytes
+ */
+static int codewords(int size, int nsym)
+{
+    int k = FEC_N - nsym;
+
+    return (size + k - 1) / k;
+}
+
+/*
+ * size of the hidden stream once 'nsym' parity symbols per codeword have been
+ * appended to 'size' payload bytes
+ */
+int fec_encoded_size(int size, int nsym)
+{
+    if ( nsym == 0 )
+        return size;
+
+    return size + nsym * codewords( size, nsym );
+}
+
+/*
+ * data row 'i' of the interleaved payload, columns [j0, j0 + n); rows running
+ * past the end of the payload are zero-padded into 'scratch'
+ */
+static const unsigned char *data_row(const unsigned char *data, int size, int ncw, int i, int j0, int n,
+                                     unsigned char *scratch)
+{
+    long start = (long)i * ncw + j0;
+
+    if ( start + n <= size )
+        return data + start;
+
+    memset( scratch, 0, n );
+
+    if ( start < size )
+        memcpy( scratch, data + start, size - start );
+
+    return scratch;
+}
+
+/*
+ * append parity to the payload: p->bytes holds p->datasize payload bytes and
+ * has room for fec_encoded_size() bytes, which becomes the new p->size
+ */
+void fec_encode(struct payload *p)
+{
+    int nsym = p->fec, k = FEC_N - nsym;
+    int ncw, j0, n, i, r, head;
+    unsigned char *reg, *fb, *scratch, *parity;
+
+    if ( nsym == 0 )
+        return;
+
+    fec_init( nsym );
+
+    ncw    = codewords( p->datasize, nsym );
+    parity = p->bytes + p->datasize;
+
+    reg     = arena_alloc( &job_arena, (size_t)nsym * FEC_TILE );
+    fb      = arena_alloc( &job_arena, FEC_TILE );
+    scratch = arena_alloc( &job_arena, FEC_TILE );
+
+    for ( j0 = 0; j0 < ncw; j0 += FEC_TILE )
+    {
+        n = (ncw - j0 < FEC_TILE) ? ncw - j0 : FEC_TILE;
+        memset( reg, 0, (size_t)nsym * n );
+        head = 0;
+
+        // the division LFSR, run across n codewords at once.  the nsym
+        // register rows rotate instead of shifting: 'head' is register 0
+        for ( i = 0; i < k; i++ )
+        {
+            const unsigned char *row = data_row( p->bytes, p->datasize, ncw, i, j0, n, scratch );
+            unsigned char *r0 = reg + (size_t)head * n;
+
+            for ( r = 0; r < n; r++ )
+                fb[r] = row[r] ^ r0[r];
+
+            for ( r = 1; r < nsym; r++ )
+                mul_add( reg + (size_t)((head + r) % nsym) * n, fb, generator[r], n );
+
+            // register 0 is shifted out; its slot becomes the last register
+            memset( r0, 0, n );
+            mul_add( r0, fb, generator[nsym], n );
+
+            head = (head + 1) % nsym;
+        }
+
+        for ( r = 0; r < nsym; r++ )
+            memcpy( parity + (size_t)r * ncw + j0, reg + (size_t)((head + r) % nsym) * n, n );
+    }
+
+    p->size = p->datasize + nsym * ncw;
+}
+
+/*
+ * evaluate the polynomial a[0] + a[1] x + ... + a[deg] x^deg at x
+ */
+static unsigned char poly_eval(const unsigned char *a, int deg, unsigned char x)
+{
+    unsigned char y = 0;
+
+    for ( ; deg >= 0; deg-- )
+        y = gf_mul( y, x ) ^ a[deg];
+
+    return y;
+}
+
+/*
+ * correct one codeword (FEC_N symbols, highest degree first) given its
+ * syndromes.  symbols [pad, FEC_N - nsym) are zero padding that was never
+ * stored, so an "error" there means the decoder got lost.  returns the number
+ * of symbols corrected, or -1 if there are more errors than the code can fix
+ */
+static int correct_codeword(unsigned char *cw, const unsigned char *synd, int nsym, int pad)
+{
+    unsigned char lambda[FEC_N + 1], prev[FEC_N + 1], tmp[FEC_N + 1];
+    unsigned char omega[FEC_N], deriv[FEC_N];
+    unsigned char delta, b = 1, xinv;
+    int L = 0, m = 1, i, j, t, found = 0;
+
+    memset( lambda, 0, sizeof(lambda) );
+    memset( prev, 0, sizeof(prev) );
+    lambda[0] = prev[0] = 1;
+
+    // berlekamp-massey: shortest LFSR (the error locator) generating the syndromes
+    for ( i = 0; i < nsym; i++ )
+    {
+        delta = synd[i];
+
+        for ( j = 1; j <= L; j++ )
+            delta ^= gf_mul( lambda[j], synd[i - j] );
+
+        if ( delta == 0 )
+        {
+            m++;
+            continue;
+        }
+
+        memcpy( tmp, lambda, sizeof(tmp) );
+
+        for ( j = m; j <= nsym; j++ )
+            lambda[j] ^= gf_mul( gf_div(delta, b), prev[j - m] );
+
+        if ( 2 * L <= i )
+        {
+            L = i + 1 - L;
+            memcpy( prev, tmp, sizeof(prev) );
+            b = delta;
+            m = 1;
+        }
+        else
+        {
+            m++;
+        }
+    }
+
+    if ( 2 * L > nsym )
+        return -1;
+
+    // error evaluator omega(x) = S(x) lambda(x) mod x^nsym, and lambda'(x);
+    // in characteristic 2 only the odd terms of the derivative survive
+    for ( i = 0; i < nsym; i++ )
+    {
+        omega[i] = 0;
+
+        for ( j = 0; j <= i && j <= L; j++ )
+            omega[i] ^= gf_mul( synd[i - j], lambda[j] );
+    }
+
+    for ( j = 0; j < L; j++ )
+        deriv[j] = (j & 1) ? 0 : lambda[j + 1];
+
+    // chien search over every symbol, forney for the magnitudes
+    for ( t = 0; t < FEC_N; t++ )
+    {
+        int e = FEC_N - 1 - t;  // symbol t is the coefficient of x^e
+
+        xinv = gf_pow_alpha( -e );
+
+        if ( poly_eval(lambda, L, xinv) != 0 )
+            continue;
+
+        if ( (t >= pad && t < FEC_N - nsym) || L == 0 )
+            return -1;
+
+        cw[t] ^= gf_mul( gf_pow_alpha(e),
+                         gf_div(poly_eval(omega, nsym - 1, xinv), poly_eval(deriv, L - 1, xinv)) );
+        found++;
+    }
+
+    return (found == L) ? found : -1;
+}
+
+/*
+ * check and repair a recovered stream: p->bytes holds p->size bytes of
+ * payload plus parity.  on return p->size is the payload size again.
+ * returns the number of symbols corrected, or -1 if any codeword was beyond
+ * repair (its data is left as recovered)
+ */
+int fec_decode(struct payload *p)
+{
+    int nsym = p->fec, k = FEC_N - nsym;
+    int ncw, j0, n, i, j, r, m, size = p->datasize, corrected = 0, failed = 0;
+    unsigned char *synd, *scratch, *parity;
+    unsigned char cw[FEC_N], s[FEC_N];
+
+    if ( nsym == 0 )
+        return 0;
+
+    fec_init( nsym );
+
+    ncw    = codewords( size, nsym );
+    parity = p->bytes + size;
+
+    synd    = arena_alloc( &job_arena, (size_t)nsym * FEC_TILE );
+    scratch = arena_alloc( &job_arena, FEC_TILE );
+
+    for ( j0 = 0; j0 < ncw; j0 += FEC_TILE )
+    {
+        n = (ncw - j0 < FEC_TILE) ? ncw - j0 : FEC_TILE;
+        memset( synd, 0, (size_t)nsym * n );
+
+        // S_m = r(a^m), by horner's rule over the symbol rows, all codewords
+        // of the tile at once
+        for ( i = 0; i < FEC_N; i++ )
+        {
+            const unsigned char *row = (i < k) ? data_row( p->bytes, size, ncw, i, j0, n, scratch )
+                                               : parity + (size_t)(i - k) * ncw + j0;
+
+            for ( m = 0; m < nsym; m++ )
+                horner( synd + (size_t)m * n, row, gf_pow_alpha(m), n );
+        }
+
+        for ( j = 0; j < n; j++ )
+        {
+            int clean = 1, pad, fixed;
+
+            for ( m = 0; m < nsym; m++ )
+            {
+                s[m] = synd[(size_t)m * n + j];
+                clean &= (s[m] == 0);
+            }
+
+            if ( clean )
+                continue;
+
+            // gather the codeword, noting where its stored data ends
+            pad = k;
+
+            for ( i = 0; i < k; i++ )
+            {
+                long t = (long)i * ncw + j0 + j;
+
+                cw[i] = (t < size) ? p->bytes[t] : 0;
+
+                if ( t >= size && pad == k )
+                    pad = i;
+            }
+
+            for ( r = 0; r < nsym; r++ )
+                cw[k + r] = parity[(size_t)r * ncw + j0 + j];
+
+            fixed = correct_codeword( cw, s, nsym, pad );
+
+            if ( fixed < 0 )
+            {
+                failed++;
+                continue;
+            }
+
+            corrected += fixed;
+
+            for ( i = 0; i < k; i++ )
+            {
+                long t = (long)i * ncw + j0 + j;
+
+                if ( t < size )
+                    p->bytes[t] = cw[i];
+            }
+        }
+    }
+
+    p->size = size;
+
+    if ( failed )
+    {
+        fprintf( stderr, "[WARNING] %d of %d codewords had too many errors to correct.\n", failed, ncw );
+        return -1;
+    }
+
+    return corrected;
+}
@@ -28,13 +28,20 @@ FILE *open_file(const char *name, char (*ptr)[256])
 }
 
 /*
- * load entire payload file
+ * load entire payload file (room for any FEC parity is left after it)
  */
 int get_payload(struct payload *p)
 {
+    int n;
+
+    PROBE2( payload_start, p->filename, (long)p->datasize );
+
     rewind( p->fp );
+    n = fread( p->bytes, 1, p->datasize, p->fp );
 
-    return fread( p->bytes, 1, p->size, p->fp );
+    PROBE2( payload_done, p->filename, (long)n );
+
+    return n;
 }
 
 
@@ -46,7 +53,7 @@ int block_copy(FILE *in, FILE *out, int size)
     int w;
     unsigned char *buf;
 
-    buf = malloc( size );
+    buf = arena_alloc( &job_arena, size );
 
     rewind( in );
     rewind( out );
@@ -54,8 +61,6 @@ int block_copy(FILE *in, FILE *out, int size)
     fread( buf, 1, size, in );
     w = fwrite( buf, 1, size, out );
 
-    free( buf );
-
     return w;
 }
 
@@ -8,7 +8,34 @@
  */
 
 #include "steganographer.h"
-#include <unistd.h>  // for getopt()
+#include <getopt.h>  // for getopt_long()
+
+/*
+ * identify a camouflage type from the first 12 bytes of a file ("magic
+ * bytes"); returns -1 if we don't know the format
+ */
+int magic_type(const unsigned char *b)
+{
+    // bitmap: look for "BM" magic bytes
+    // wavfile: look for "RIFF" and "WAVE" magic bytes
+    // pngfile: look for the PNG signature
+    // jpegfile: look for the SOI marker and the start of another
+    if ( (b[0] == 'B') && (b[1] == 'M') )
+        return bitmap;
+
+    if ( (b[0] == 'R') && (b[1] == 'I') && (b[2] == 'F') && (b[3] == 'F')
+      && (b[8] == 'W') && (b[9] == 'A') && (b[10] == 'V') && (b[11] == 'E') )
+        return wavfile;
+
+    if ( (b[0] == 0x89) && (b[1] == 'P') && (b[2] == 'N') && (b[3] == 'G')
+      && (b[4] == '\r') && (b[5] == '\n') && (b[6] == 0x1A) && (b[7] == '\n') )
+        return pngfile;
+
+    if ( (b[0] == 0xFF) && (b[1] == 0xD8) && (b[2] == 0xFF) )
+        return jpegfile;
+
+    return -1;
+}
 
 /*
  * this tries to detect file type by looking for "magic bytes" at the beginning
@@ -17,7 +44,7 @@
 int find_type(const char *name)
 {
     unsigned char b[12]; // 12 is the minimum number of bytes required to find the WAVE tag
-    int type = -1;
+    int type;
     FILE *f = fopen( name, "rb" ); // 'b' in case we're compiled on windoze
 
     if ( !f )
@@ -28,28 +55,146 @@ int find_type(const char *name)
 
     printf( "reading %s.... ", name );
 
+    memset( b, 0, sizeof(b) );
     fread( b, sizeof(b), 1, f );
     fclose( f );
 
-    // bitmap: look for "BM" magic bytes
-    // wavfile: look for "RIFF" and "WAVE" magic bytes
-    if ( (b[0] == 'B') && (b[1] == 'M') )
-    {
-        type = bitmap;
+    type = magic_type( b );
+
+    if ( type == bitmap )
         printf( "detected bitmap." );
-    }
-    else if ( (b[0] == 'R') && (b[1] == 'I') && (b[2] == 'F') && (b[3] == 'F')
-           && (b[8] == 'W') && (b[9] == 'A') && (b[10] == 'V') && (b[11] == 'E') )
-    {
-        type = wavfile;
+    else if ( type == wavfile )
         printf( "detected PCM WAV file." );
-    }
+    else if ( type == pngfile )
+        printf( "detected PNG image." );
+    else if ( type == jpegfile )
+        printf( "detected JPEG image." );
 
     puts("");
 
     return type;
 }
 
+/*
+ * point the format callbacks at the carrier's type and allocate its format
+ * data; 'channels' are the image colors to embed in and 'wav_channels' the
+ * WAV channels, 0 for all.  the action is the cover routine, or in recover
+ * and update modes the uncover one
+ */
+void bind_carrier(struct container *c, unsigned char channels, uint64_t wav_channels)
+{
+    int uncover = (mode == recover || mode == update);
+
+    if ( c->type == bitmap )
+    {
+        c->b = arena_alloc( &job_arena, sizeof(*c->b) );
+        memset( c->b, 0, sizeof(*c->b) );
+
+        c->b->channel_mask = channels;
+
+        get_data          = &get_bitmap;
+        get_info          = &get_bitmap_info;
+        show_info         = &show_bitmap_info;
+        write_data        = &write_bitmap;
+        write_header      = &write_bitmap_header;
+        validate_data     = &validate_bitmap;
+        init_data_storage = &init_pixel_matrix;
+        mode_action       = uncover ? &bitmap_uncover : &bitmap_cover;
+    }
+    else if ( c->type == pngfile )
+    {
+        c->b   = arena_alloc( &job_arena, sizeof(*c->b) );
+        c->png = arena_alloc( &job_arena, sizeof(*c->png) );
+        memset( c->b, 0, sizeof(*c->b) );
+        memset( c->png, 0, sizeof(*c->png) );
+
+        c->b->channel_mask = channels;
+
+        get_data          = &get_png;
+        get_info          = &get_png_info;
+        show_info         = &show_png_info;
+        write_data        = &write_png;
+        write_header      = &write_png_header;
+        validate_data     = &validate_png;
+        init_data_storage = &init_pixel_matrix;
+        mode_action       = uncover ? &bitmap_uncover : &bitmap_cover;
+    }
+    else if ( c->type == jpegfile )
+    {
+        c->jpg = arena_alloc( &job_arena, sizeof(*c->jpg) );
+        memset( c->jpg, 0, sizeof(*c->jpg) );
+
+        get_data          = &get_jpeg;
+        get_info          = &get_jpeg_info;
+        show_info         = &show_jpeg_info;
+        write_data        = &write_jpeg;
+        write_header      = &write_jpeg_header;
+        validate_data     = &validate_jpeg;
+        init_data_storage = &init_jpeg_storage;
+        mode_action       = uncover ? &jpeg_uncover : &jpeg_cover;
+    }
+    else if ( c->type == wavfile )
+    {
+        c->w = arena_alloc( &job_arena, sizeof(*c->w) );
+        memset( c->w, 0, sizeof(*c->w) );
+
+        c->w->channel_mask = wav_channels;
+
+        get_data          = &get_samples;
+        get_info          = &get_pcm_info;
+        show_info         = &show_pcm_info;
+        write_data        = &write_samples;
+        write_header      = &write_pcm_header;
+        validate_data     = &validate_wavfile;
+        init_data_storage = &init_sample_storage;
+        mode_action       = uncover ? &pcm_uncover : &pcm_cover;
+
+        // the lanes of a channel mask are their own split of the payload
+        if ( wav_channels )
+            mode_action = uncover ? &pcm_lane_uncover : &pcm_lane_cover;
+    }
+    else
+    {
+        fprintf( stderr, "[ERROR] unknown data type, aborting.\n" );
+        exit( EXIT_FAILURE );
+    }
+}
+
+/*
+ * WAV channel numbers for --channels, like 0,2-5; returns them as a bit mask
+ */
+static uint64_t parse_channel_list(const char *s)
+{
+    uint64_t mask = 0;
+    long a, b;
+    char *end;
+
+    while ( 1 )
+    {
+        a = b = strtol( s, &end, 10 );
+
+        if ( end != s && *end == '-' )
+        {
+            s = end + 1;
+            b = strtol( s, &end, 10 );
+        }
+
+        if ( end == s || a < 0 || b < a || b > 63 || (*end && *end != ',') )
+        {
+            fprintf( stderr, "[ERROR] --channels expects WAV channel numbers from 0 to 63, like 0,2-5, aborting.\n" );
+            exit( EXIT_FAILURE );
+        }
+
+        for ( ; a <= b; a++ )
+            mask |= 1ULL << a;
+
+        if ( !*end )
+            return mask;
+
+        s = end + 1;
+    }
+}
+
 /*
  * parse command-line arguments
  */
@@ -63,13 +208,78 @@ void parse_args(int argc, char **argv, struct user_input *u)
     short outputfile_set = 0;
     short size_set = 0;
 
+    // long-only options get values above the char range
+    enum { OPT_RANGE = 256, OPT_OFFSET, OPT_DELTA, OPT_FEC, OPT_MATRIX, OPT_ADAPTIVE,
+           OPT_CHECKPOINT, OPT_RESUME, OPT_CHANNELS, OPT_DIRECT, OPT_NO_PROFILE,
+           OPT_TO, OPT_PERIOD, OPT_MERKLE, OPT_LEASE, OPT_DRAIN };
+    const char *ch;
+
+    static struct option long_opts[] =
+    {
+        { "help",    no_argument,       NULL, 'h' },
+        { "hide",    no_argument,       NULL, 'H' },
+        { "recover", no_argument,       NULL, 'R' },
+        { "update",  no_argument,       NULL, 'U' },
+        { "apply",   no_argument,       NULL, 'A' },
+        { "analyze", no_argument,       NULL, 'X' },
+        { "pack",    no_argument,       NULL, 'P' },
+        { "autotune", no_argument,      NULL, 'T' },
+        { "migrate", no_argument,       NULL, 'M' },
+        { "live",    no_argument,       NULL, 'L' },
+        { "period",  required_argument, NULL, OPT_PERIOD },
+        { "verify",  no_argument,       NULL, 'V' },
+        { "merkle",  no_argument,       NULL, OPT_MERKLE },
+        { "worker",  no_argument,       NULL, 'W' },
+        { "lease",   required_argument, NULL, OPT_LEASE },
+        { "drain",   no_argument,       NULL, OPT_DRAIN },
+        { "to",      required_argument, NULL, OPT_TO },
+        { "no-profile", no_argument,    NULL, OPT_NO_PROFILE },
+        { "threads", required_argument, NULL, 'j' },
+        { "payload", required_argument, NULL, 'p' },
+        { "base",    required_argument, NULL, 'b' },
+        { "output",  required_argument, NULL, 'o' },
+        { "size",    required_argument, NULL, 's' },
+        { "range",   required_argument, NULL, OPT_RANGE },
+        { "offset",  required_argument, NULL, OPT_OFFSET },
+        { "delta",   required_argument, NULL, OPT_DELTA },
+        { "fec",     required_argument, NULL, OPT_FEC },
+        { "matrix",  required_argument, NULL, OPT_MATRIX },
+        { "adaptive", required_argument, NULL, OPT_ADAPTIVE },
+        { "checkpoint", no_argument,    NULL, OPT_CHECKPOINT },
+        { "resume",  no_argument,       NULL, OPT_RESUME },
+        { "channels", required_argument, NULL, OPT_CHANNELS },
+        { "direct",  no_argument,       NULL, OPT_DIRECT },
+        { NULL, 0, NULL, 0 }
+    };
+
+    u->range_set = 0;
+    u->update_offset = 0;
+    u->deltafile[0] = '\0';
+    u->destfile[0] = '\0';
+    u->period = 0;
+    u->lease = 0;
+    u->drain = 0;
+    u->threads = 0;
+    u->fec = 0;
+    u->matrix = 0;
+    u->adaptive = 0;
+    u->checkpoint = 0;
+    u->resume = 0;
+    u->channels = 0;
+    u->wav_channels = 0;
+    u->direct = 0;
+    u->profile = 1;
+    u->merkle = 0;
+    u->packfiles = NULL;
+    u->npackfiles = 0;
+
 	if ( argc == 1 )
 	{
         show_usage();
 		exit( EXIT_FAILURE );
 	}
 
-	while ( (opt = getopt(argc, argv, "hHRp:b:o:s:")) != -1 )
+	while ( (opt = getopt_long(argc, argv, "hHRUAXPTMLVWp:b:o:s:j:", long_opts, NULL)) != -1 )
 	{
 		switch (opt)
 		{
@@ -81,6 +291,50 @@ void parse_args(int argc, char **argv, struct user_input *u)
 			    mode = recover;
                 mode_set = 1;
 			    break;
+		    case 'U':
+			    mode = update;
+                mode_set = 1;
+			    break;
+		    case 'A':
+			    mode = apply;
+                mode_set = 1;
+			    break;
+		    case 'X':
+			    mode = analysis;
+                mode_set = 1;
+			    break;
+		    case 'P':
+			    mode = pack;
+                mode_set = 1;
+			    break;
+		    case 'T':
+			    mode = tune;
+                mode_set = 1;
+			    break;
+		    case 'M':
+			    mode = migration;
+                mode_set = 1;
+			    break;
+		    case 'L':
+			    mode = live;
+                mode_set = 1;
+			    break;
+		    case 'V':
+			    mode = verification;
+                mode_set = 1;
+			    break;
+		    case 'W':
+			    mode = worker;
+                mode_set = 1;
+			    break;
+            case 'j':
+                u->threads = atoi( optarg );
+                if ( u->threads < 0 )
+                {
+                    fprintf( stderr, "[ERROR] -j expects a number of threads, aborting.\n" );
+                    exit( EXIT_FAILURE );
+                }
+                break;
 		    case 'p':
                 if ( strlen(optarg) > MAX_FILENAME_LENGTH )
                 {
@@ -121,6 +375,121 @@ void parse_args(int argc, char **argv, struct user_input *u)
 			    u->payload_size = atoi( optarg );
                 size_set = 1;
 			    break;
+            case OPT_DELTA:
+                if ( strlen(optarg) > MAX_FILENAME_LENGTH )
+                {
+                    printf( "[ERROR] filename must be less than %d characters, aborting.\n", MAX_FILENAME_LENGTH );
+                    exit( EXIT_FAILURE );
+                }
+                strncpy( u->deltafile, optarg, MAX_FILENAME_LENGTH );
+                break;
+            case OPT_TO:
+                if ( strlen(optarg) > MAX_FILENAME_LENGTH )
+                {
+                    printf( "[ERROR] filename must be less than %d characters, aborting.\n", MAX_FILENAME_LENGTH );
+                    exit( EXIT_FAILURE );
+                }
+                strncpy( u->destfile, optarg, MAX_FILENAME_LENGTH );
+                break;
+            case OPT_CHANNELS:
+                // numbers pick the channels of a WAV file, letters the colors of an image
+                if ( *optarg >= '0' && *optarg <= '9' )
+                {
+                    u->wav_channels = parse_channel_list( optarg );
+                    break;
+                }
+
+                for ( ch = optarg; *ch; ch++ )
+                {
+                    if ( *ch == 'r' || *ch == 'R' )
+                        u->channels |= CHANNEL_RED;
+                    else if ( *ch == 'g' || *ch == 'G' )
+                        u->channels |= CHANNEL_GREEN;
+                    else if ( *ch == 'b' || *ch == 'B' )
+                        u->channels |= CHANNEL_BLUE;
+                    else
+                    {
+                        fprintf( stderr, "[ERROR] --channels expects some of the letters r, g and b, aborting.\n" );
+                        exit( EXIT_FAILURE );
+                    }
+                }
+                break;
+            case OPT_DIRECT:
+                u->direct = 1;
+                break;
+            case OPT_PERIOD:
+                u->period = atoi( optarg );
+                if ( u->period < 1 )
+                {
+                    fprintf( stderr, "[ERROR] --period expects a number of frames, aborting.\n" );
+                    exit( EXIT_FAILURE );
+                }
+                break;
+            case OPT_MERKLE:
+                u->merkle = 1;
+                break;
+            case OPT_LEASE:
+                u->lease = atoi( optarg );
+                if ( u->lease < 3 )
+                {
+                    fprintf( stderr, "[ERROR] --lease expects a number of seconds, at least 3, aborting.\n" );
+                    exit( EXIT_FAILURE );
+                }
+                break;
+            case OPT_DRAIN:
+                u->drain = 1;
+                break;
+            case OPT_NO_PROFILE:
+                u->profile = 0;
+                break;
+            case OPT_RESUME:
+                u->resume = 1;
+                u->checkpoint = 1;
+                break;
+            case OPT_CHECKPOINT:
+                u->checkpoint = 1;
+                break;
+            case OPT_ADAPTIVE:
+                u->adaptive = atof( optarg );
+                if ( u->adaptive <= 0 )
+                {
+                    fprintf( stderr, "[ERROR] --adaptive expects a positive texture threshold, aborting.\n" );
+                    exit( EXIT_FAILURE );
+                }
+                break;
+            case OPT_MATRIX:
+                u->matrix = atoi( optarg );
+                if ( u->matrix < 1 || u->matrix > MATRIX_MAX_K )
+                {
+                    fprintf( stderr, "[ERROR] --matrix expects 1 to %d bits per block, aborting.\n", MATRIX_MAX_K );
+                    exit( EXIT_FAILURE );
+                }
+                break;
+            case OPT_FEC:
+                u->fec = atoi( optarg );
+                if ( u->fec < 1 || u->fec > 254 )
+                {
+                    fprintf( stderr, "[ERROR] --fec expects 1 to 254 parity bytes per 255-byte codeword, aborting.\n" );
+                    exit( EXIT_FAILURE );
+                }
+                break;
+            case OPT_OFFSET:
+                u->update_offset = atoi( optarg );
+                if ( u->update_offset < 0 )
+                {
+                    fprintf( stderr, "[ERROR] --offset must not be negative, aborting.\n" );
+                    exit( EXIT_FAILURE );
+                }
+                break;
+            case OPT_RANGE:
+                if ( sscanf(optarg, "%d:%d", &u->range_start, &u->range_end) != 2
+                  || u->range_start < 0 || u->range_end <= u->range_start )
+                {
+                    fprintf( stderr, "[ERROR] --range expects a:b with 0 <= a < b, aborting.\n" );
+                    exit( EXIT_FAILURE );
+                }
+                u->range_set = 1;
+                break;
             case 'h':
 		    case '?':
 		    default:
@@ -132,30 +501,253 @@ void parse_args(int argc, char **argv, struct user_input *u)
     // make sure we have everything we need from the user
     if ( !mode_set )
     {
-        fprintf( stderr, "[ERROR] missing mode flag (-H or -R). Use -h for help.\n" );
+        fprintf( stderr, "[ERROR] missing mode flag (-H, -R, -U, -A, -X, -P, -T, -M, -L, -V or -W). Use -h for help.\n" );
         exit( EXIT_FAILURE );
     }
 
-    if ( (mode == hide) && (!basefile_set || !outputfile_set || !payload_set) )
+    if ( (mode == hide) && (!basefile_set || !(outputfile_set || u->deltafile[0]) || !payload_set) )
     {
         fprintf( stderr, "[ERROR] missing arguments: hide mode requires -b, -p, and "
                          "-o parameters.\nUse -h for help.\n" );
         exit( EXIT_FAILURE );
     }
-    else if ( (mode == recover) && (!basefile_set || !outputfile_set || !size_set) )
+    else if ( (mode == recover) && (!basefile_set || !outputfile_set || !(size_set || u->range_set)) )
     {
-        fprintf( stderr, "[ERROR] missing arguments: recover mode requires -b, -s, "
+        fprintf( stderr, "[ERROR] missing arguments: recover mode requires -b, -s (or --range), "
                          "and -o parameters.\nUse -h for help.\n" );
         exit( EXIT_FAILURE );
     }
+
+    else if ( (mode == update) && (!basefile_set || !payload_set) )
+    {
+        fprintf( stderr, "[ERROR] missing arguments: update mode requires -b and -p parameters.\n"
+                         "Use -h for help.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    else if ( (mode == apply) && (!basefile_set || !u->deltafile[0]) )
+    {
+        fprintf( stderr, "[ERROR] missing arguments: apply mode requires -b and --delta parameters.\n"
+                         "Use -h for help.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    else if ( (mode == verification) && !basefile_set )
+    {
+        fprintf( stderr, "[ERROR] missing arguments: verify mode requires -b.\nUse -h for help.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    else if ( mode == worker )
+    {
+        if ( !basefile_set )
+        {
+            fprintf( stderr, "[ERROR] missing arguments: worker mode requires -b.\nUse -h for help.\n" );
+            exit( EXIT_FAILURE );
+        }
+
+        if ( u->lease == 0 )
+            u->lease = 60;
+    }
+
+    else if ( (mode == analysis) && !basefile_set )
+    {
+        fprintf( stderr, "[ERROR] missing arguments: analyze mode requires -b.\nUse -h for help.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    else if ( mode == pack )
+    {
+        // the payloads are whatever follows the options
+        u->packfiles  = argv + optind;
+        u->npackfiles = argc - optind;
+
+        if ( !basefile_set || !outputfile_set || u->npackfiles == 0 )
+        {
+            fprintf( stderr, "[ERROR] missing arguments: pack mode requires -b, -o and at least one payload.\n"
+                             "Use -h for help.\n" );
+            exit( EXIT_FAILURE );
+        }
+
+        if ( u->threads > 1 )
+        {
+            fprintf( stderr, "[ERROR] -j is not supported in pack mode.\n" );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    else if ( (mode == migration) && (!basefile_set || !u->destfile[0] || !outputfile_set || !size_set) )
+    {
+        fprintf( stderr, "[ERROR] missing arguments: migrate mode requires -b, -s, --to and -o parameters.\n"
+                         "Use -h for help.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    else if ( mode == live )
+    {
+        // a live stream comes in on stdin and goes out on stdout by default
+        if ( !payload_set )
+        {
+            fprintf( stderr, "[ERROR] missing arguments: live mode requires -p.\nUse -h for help.\n" );
+            exit( EXIT_FAILURE );
+        }
+
+        if ( !basefile_set )
+            strcpy( u->basefile, "-" );
+
+        if ( !outputfile_set )
+            strcpy( u->outputfile, "-" );
+
+        if ( u->period == 0 )
+            u->period = 512;
+
+        if ( u->threads > 1 )
+        {
+            fprintf( stderr, "[ERROR] -j is not supported in live mode.\n" );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    else if ( mode == tune )
+    {
+        // scratch carriers go in the directory being tuned for; -o names
+        // the profile, if not the default one
+        if ( !basefile_set )
+            strcpy( u->basefile, "." );
+
+        if ( !outputfile_set )
+            u->outputfile[0] = '\0';
+    }
+
+    if ( u->deltafile[0] && mode != hide && mode != apply )
+    {
+        fprintf( stderr, "[ERROR] --delta is only meaningful in hide and apply modes.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( u->fec && ((mode != hide && mode != recover && mode != migration) || u->range_set) )
+    {
+        fprintf( stderr, "[ERROR] --fec only applies to whole-payload hide, recover and migrate jobs.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( u->matrix && ((mode != hide && mode != recover) || u->range_set || u->deltafile[0]) )
+    {
+        fprintf( stderr, "[ERROR] --matrix only applies to whole-payload hide and recover jobs.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( u->adaptive && ((mode != hide && mode != recover) || u->range_set || u->deltafile[0] || u->matrix) )
+    {
+        fprintf( stderr, "[ERROR] --adaptive only applies to whole-payload hide and recover jobs,\n"
+                         "and can't be combined with --matrix.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( u->checkpoint && ((mode != hide && mode != recover) || u->range_set || u->deltafile[0]
+                          || u->matrix || u->adaptive) )
+    {
+        fprintf( stderr, "[ERROR] --checkpoint and --resume only apply to whole-payload hide and recover jobs,\n"
+                         "and can't be combined with --matrix or --adaptive.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( u->direct && ((mode != hide && mode != recover) || u->range_set || u->deltafile[0]
+                      || u->checkpoint || u->threads > 1) )
+    {
+        fprintf( stderr, "[ERROR] --direct only applies to whole-payload hide and recover jobs,\n"
+                         "and can't be combined with --checkpoint or -j.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( u->merkle && ((mode != hide && mode != recover && mode != migration) || u->deltafile[0]) )
+    {
+        fprintf( stderr, "[ERROR] --merkle only applies to hide, recover and migrate jobs with an output file.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( u->wav_channels && mode != hide && mode != recover )
+    {
+        fprintf( stderr, "[ERROR] WAV channel numbers for --channels only apply to hide and recover jobs.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( u->period && mode != live )
+    {
+        fprintf( stderr, "[ERROR] --period is only meaningful in live mode.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( (u->lease || u->drain) && mode != worker )
+    {
+        fprintf( stderr, "[ERROR] --lease and --drain are only meaningful in worker mode.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( u->destfile[0] && mode != migration )
+    {
+        fprintf( stderr, "[ERROR] --to is only meaningful in migrate mode.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( mode == migration && u->threads > 1 )
+    {
+        fprintf( stderr, "[ERROR] -j is not supported in migrate mode.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( u->range_set && mode != recover )
+    {
+        fprintf( stderr, "[ERROR] --range is only meaningful in recover mode.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( u->range_set && size_set && u->range_end > u->payload_size )
+    {
+        fprintf( stderr, "[ERROR] --range %d:%d runs past the end of a %d-byte payload.\n",
+                 u->range_start, u->range_end, u->payload_size );
+        exit( EXIT_FAILURE );
+    }
 }
 
 void show_status(struct user_input *u)
 {
-    if ( mode == hide )
+    if ( mode == hide && u->deltafile[0] )
+    {
+        printf( "attempting to hide %s in %s; changes will be saved as %s\n\n", u->hidefile, u->basefile, u->deltafile );
+    }
+    else if ( mode == hide )
     {
         printf( "attempting to hide %s in %s; output will be saved as %s\n\n", u->hidefile, u->basefile, u->outputfile );
     }
+    else if ( mode == apply )
+    {
+        printf( "attempting to apply %s to %s...\n\n", u->deltafile, u->basefile );
+    }
+    else if ( mode == update )
+    {
+        printf( "attempting to update the data hidden in %s with %s at byte %d...\n\n",
+                u->basefile, u->hidefile, u->update_offset );
+    }
+    else if ( mode == recover && u->range_set )
+    {
+        printf( "attempting to recover bytes %d to %d from %s into %s...\n\n",
+                u->range_start, u->range_end, u->basefile, u->outputfile );
+    }
+    else if ( mode == pack )
+    {
+        printf( "attempting to pack %d payload%s into the carriers in %s; output will be saved in %s\n\n",
+                u->npackfiles, (u->npackfiles == 1) ? "" : "s", u->basefile, u->outputfile );
+    }
+    else if ( mode == migration )
+    {
+        printf( "attempting to move %d bytes hidden in %s into %s; output will be saved as %s\n\n",
+                u->payload_size, u->basefile, u->destfile, u->outputfile );
+    }
+    else if ( mode == tune )
+    {
+        printf( "tuning this host (scratch files go in %s)\n\n", u->basefile );
+    }
     else if ( mode == recover )
     {
         printf( "attempting to recover %d bytes from %s into %s...\n\n", u->payload_size, u->basefile, u->outputfile );
@@ -174,19 +766,102 @@ void show_usage(void)
     fprintf( stderr,
             "steganographer v%0.1f -- a tool that hides data using LSB steganography\n"
             "Copyleft October 2015, Javier Lombillo, Miami-Dade College School of Engineering & Technology\n\n"
-            "steganographer has two modes of operation, one for hiding data and another for recovering\n"
+            "steganographer has two main modes of operation, one for hiding data and another for recovering\n"
             "previously hidden data.  HIDE mode is enabled with the -H flag; RECOVER mode with the -R flag.\n\n"
             "The following arguments are required in HIDE mode:\n"
             "\t-b <base filename>\t\tthe camouflage data, so to speak\n"
             "\t-p <payload filename>\t\tthe data you want to hide\n"
             "\t-o <output filename>\t\twhere you want to store this stuff\n\n"
+            "Optional arguments in HIDE mode:\n"
+            "\t--delta <delta filename>\tinstead of a full output file, write only the carrier\n"
+            "\t\t\t\t\tbytes that change (-o not required)\n"
+            "\t--fec <n>\t\t\tadd n Reed-Solomon parity bytes per 255-byte codeword;\n"
+            "\t\t\t\t\tcorrects up to n/2 damaged bytes per codeword\n"
+            "\t--matrix <k>\t\t\tmatrix embedding: k bits per 2^k-1 carrier bytes, changing\n"
+            "\t\t\t\t\tat most one of them (fewer changes, less capacity)\n"
+            "\t--adaptive <t>\t\t\tonly use blocks whose mean difference between neighboring\n"
+            "\t\t\t\t\tvalues is at least t (skips flat image areas and silence)\n"
+            "\t--channels <rgb>\t\timages: only embed in these color channels (default rgb);\n"
+            "\t\t\t\t\tthe alpha byte of 32-bit bitmaps and RGBA PNGs is never touched\n"
+            "\t--channels <list>\t\tWAV files: only embed in these channels, numbered from 0\n"
+            "\t\t\t\t\t(e.g. 0,2-5), splitting the payload between them; with -j,\n"
+            "\t\t\t\t\tthat many channels are embedded at once\n"
+            "\t-j <threads>\t\t\tload and embed with this many threads, spread over\n"
+            "\t\t\t\t\tthe machine's NUMA nodes (PNG, JPEG: code the image data\n"
+            "\t\t\t\t\twith this many threads, default one per cpu)\n"
+            "\t--direct\t\t\tread the base file and write the output with O_DIRECT,\n"
+            "\t\t\t\t\tkeeping them out of the page cache\n"
+            "\t--checkpoint\t\t\tstream the carrier and record progress in <output>.ckpt\n"
+            "\t--resume\t\t\tcontinue a checkpointed job that was interrupted\n"
+            "\t--merkle\t\t\thash the output in chunks as it's written, into <output>.merkle\n\n"
             "The following arguments are required in RECOVER mode:\n"
             "\t-b <base filename>\t\tthe file that contains the hidden data\n"
             "\t-s <size of payload>\t\tthe size in bytes of the hidden data\n"
             "\t-o <output filename>\t\twhere to write the hidden data\n\n"
+            "Optional arguments in RECOVER mode:\n"
+            "\t--range <a:b>\t\t\trecover only payload bytes a through b-1 (-s not required)\n"
+            "\t--fec <n>\t\t\tthe payload was hidden with --fec n; repair it\n"
+            "\t--matrix <k>\t\t\tthe payload was hidden with --matrix k\n"
+            "\t--adaptive <t>\t\t\tthe payload was hidden with --adaptive t\n"
+            "\t--channels <rgb|list>\t\tthe payload was hidden with these --channels\n"
+            "\t-j, --direct, --checkpoint,\n"
+            "\t--resume, --merkle\t\tas in HIDE mode\n\n"
+            "UPDATE mode (-U) rewrites part of a hidden payload in place, touching only the\n"
+            "carrier bytes whose lsb changes:\n"
+            "\t-b <stego filename>\t\tthe file that contains the hidden data (modified in place)\n"
+            "\t-p <payload filename>\t\tthe new bytes\n"
+            "\t--offset <n>\t\t\twhere the new bytes start in the hidden payload (default 0)\n\n"
+            "APPLY mode (-A) patches a copy of the original carrier with a delta, in place:\n"
+            "\t-b <carrier filename>\t\tcopy of the carrier the delta was made against\n"
+            "\t--delta <delta filename>\tthe changes written by HIDE mode\n\n"
+            "ANALYZE mode (-X) audits carriers for signs of LSB embedding (chi-square,\n"
+            "RS and sample pair analysis):\n"
+            "\t-b <file or directory>\t\ta carrier, or a directory tree of them\n"
+            "\t-j <threads>\t\t\tfiles analyzed in parallel (default: one per cpu)\n\n"
+            "PACK mode (-P) hides many payloads in a pool of carriers, one pass per carrier used,\n"
+            "and lists where each one went in <output directory>/slots.txt; recover any one of\n"
+            "them with -R --range:\n"
+            "\t-b <file or directory>\t\tthe carrier pool: a carrier, or a directory of them\n"
+            "\t-o <output directory>\t\twhere the carriers used and the slot table go\n"
+            "\t<payload> ...\t\t\tthe payloads, after the options\n"
+            "\t--channels <rgb>\t\tas in HIDE mode\n\n"
+            "MIGRATE mode (-M) moves a hidden payload straight into a fresh carrier, never\n"
+            "writing it out in between (bitmap or WAV, either way round):\n"
+            "\t-b <stego filename>\t\tthe file that contains the hidden data\n"
+            "\t-s <size of payload>\t\tthe size in bytes of the hidden data\n"
+            "\t--to <carrier filename>\t\tthe fresh carrier\n"
+            "\t-o <output filename>\t\twhere to save the new stego file\n"
+            "\t--fec <n>, --channels <rgb>\tthe payload was hidden with these (--channels applies\n"
+            "\t\t\t\t\tto both carriers); they carry over\n"
+            "\t--merkle\t\t\tas in HIDE mode\n\n"
+            "VERIFY mode (-V) checks a file against the <file>.merkle written with --merkle, on\n"
+            "every core, and lists the chunks that differ:\n"
+            "\t-b <filename>\t\t\tthe file to check\n"
+            "\t-j <threads>\t\t\tchunks hashed in parallel (default: one per cpu)\n\n"
+            "AUTOTUNE mode (-T) benchmarks the embedding kernels, -j and --direct on this host and\n"
+            "saves the fastest in ~/.steganographer-<hostname> ($STEGANOGRAPHER_PROFILE if set),\n"
+            "which later runs use for whatever -j and --direct aren't given:\n"
+            "\t-b <directory>\t\t\twhere to put the scratch carriers (default: .)\n"
+            "\t-o <profile filename>\t\tsave the profile somewhere else\n"
+            "\t--no-profile\t\t\t(any mode) ignore the saved profile\n\n"
+            "LIVE mode (-L) hides a payload in PCM audio as it streams past, a period at a time,\n"
+            "and reports the per-period latency and any missed deadlines on stderr:\n"
+            "\t-p <payload filename>\t\tthe data you want to hide\n"
+            "\t-b <WAV stream>\t\t\twhere the audio comes from (default: stdin)\n"
+            "\t-o <output filename>\t\twhere it goes (default: stdout)\n"
+            "\t--period <frames>\t\tframes per period (default 512)\n\n"
+            "WORKER mode (-W) runs the jobs in a spool directory shared by any number of workers\n"
+            "on any number of hosts.  Each file new/<name>.job holds one hide, recover or migrate\n"
+            "command line (without the program name, paths relative to the spool); it moves\n"
+            "through work/ to done/ or failed/, next to its <name>.log:\n"
+            "\t-b <spool directory>\t\tnew/, work/, done/ and failed/ are made if missing\n"
+            "\t-j <jobs>\t\t\tjobs run at once by this worker (default 1)\n"
+            "\t--lease <seconds>\t\thow long a job stays claimed without word from its\n"
+            "\t\t\t\t\tworker before another one takes it over (default 60)\n"
+            "\t--drain\t\t\t\texit once there's nothing left in new/\n\n"
             "Example:\n\n"
             "To hide main.c in the pixels of america.bmp, saving output as america2.bmp, run\n"
             "\tsteganographer -H -b america.bmp -p main.c -o america2.bmp\n\n"
             "NB: The camouflage data must be at least 8 times as large as the payload.\n"
-            "Currently supported camouflage: 24-bit bitmaps and WAV files.\n", VERSION );
+            "Currently supported camouflage: 24- and 32-bit bitmaps, 8-bit RGB(A) PNGs, baseline JPEGs and WAV files.\n", VERSION );
 }
@@ -0,0 +1,933 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, jpeg.c
+ *
+ * JPEG-specific functions
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <unistd.h>          // for sysconf()
+#include <pthread.h>
+
+/*
+ * a JPEG carries its payload in its quantized DCT coefficients, never in
+ * pixels: the entropy-coded scan is Huffman-decoded into coefficients, the
+ * payload goes into them, and they're Huffman-coded again with the file's own
+ * tables.  everything outside the scan is copied as it is.
+ *
+ * the units are the AC coefficients whose magnitude is at least 2, and a
+ * payload bit is the lsb of the magnitude; the sign stays.  2 <-> 3, -2 <-> -3
+ * and so on never make a coefficient 0 or +-1, so extraction finds the same
+ * units, and never change a coefficient's magnitude category, so every
+ * Huffman symbol stays the one the file's tables already code.  (JSteg's
+ * two's-complement lsb would turn -1 into -2, a symbol the tables may lack.)
+ *
+ * restart markers split the scan into intervals that decode on their own
+ * (the DC predictions reset at each), so decoding, embedding and re-encoding
+ * go one interval per task over a pool of threads.  without DRI the whole
+ * scan is one interval.  Huffman decoding looks up codes of up to
+ * JPEG_LOOKAHEAD bits in one table access, and encoding is a code and length
+ * per symbol.
+ *
+ * only baseline (and extended 8-bit Huffman) sequential JPEGs with a single
+ * scan holding every component are handled; that's what cameras and most
+ * encoders write.  progressive and arithmetic-coded files are turned away.
+ */
+
+#define M_SOF0  0xC0
+#define M_SOF1  0xC1
+#define M_DHT   0xC4
+#define M_RST0  0xD0
+#define M_SOI   0xD8
+#define M_EOI   0xD9
+#define M_SOS   0xDA
+#define M_DRI   0xDD
+
+// what a pool of coding threads works on, one restart interval at a time
+struct jpeg_job
+{
+    struct container *c;
+    struct payload *p;
+    void (*task)(struct jpeg_job *, int);
+    unsigned char **out;      // write_jpeg(): each interval's coded data
+    long *outlen;
+    int  next;                // next interval to hand out
+    long changed;             // carrier units changed, for jpeg_cover()
+    int  failed;              // interval that didn't decode or encode, +1
+};
+
+static int get16(const unsigned char *b)
+{
+    return b[0] << 8 | b[1];
+}
+
+static void bad_jpeg(struct container *c, const char *why)
+{
+    fprintf( stderr, "[ERROR] %s: %s, aborting.\n", c->filename, why );
+    exit( EXIT_FAILURE );
+}
+
+/*
+ * derive the decoding and encoding forms of a Huffman table from its counts
+ * and symbols (JPEG spec, annex C).  returns -1 if the counts are impossible
+ */
+static int build_huff(struct jpeg_huff *h)
+{
+    int l, i, k = 0, code = 0, fill;
+
+    memset( h->fast, 0, sizeof(h->fast) );
+    memset( h->size, 0, sizeof(h->size) );
+
+    for ( l = 1; l <= 16; l++ )
+    {
+        h->valptr[l]  = k;
+        h->mincode[l] = code;
+
+        for ( i = 0; i < h->bits[l]; i++, k++, code++ )
+        {
+            h->code[h->vals[k]] = code;
+            h->size[h->vals[k]] = l;
+
+            // every lookahead value starting with this code decodes to it
+            if ( l <= JPEG_LOOKAHEAD )
+                for ( fill = 0; fill < 1 << (JPEG_LOOKAHEAD - l); fill++ )
+                    h->fast[(code << (JPEG_LOOKAHEAD - l)) | fill] = h->vals[k] << 8 | l;
+        }
+
+        h->maxcode[l] = h->bits[l] ? code - 1 : -1;
+
+        if ( code > (1 << l) )
+            return -1;
+
+        code <<= 1;
+    }
+
+    return 0;
+}
+
+static int huff_present(const struct jpeg_huff *h)
+{
+    int l, n = 0;
+
+    for ( l = 1; l <= 16; l++ )
+        n += h->bits[l];
+
+    return n > 0;
+}
+
+/*
+ * parse the markers up to the scan: Huffman tables, the frame header, the
+ * restart interval and the scan header
+ */
+static void parse_markers(struct container *c)
+{
+    struct jpeg *j = c->jpg;
+    unsigned char *f = j->file, *s;
+    struct jpeg_component t;
+    long pos = 2, len, n;
+    int m, i, k, have_frame = 0;
+
+    for ( ;; )
+    {
+        if ( pos + 4 > c->filesize || f[pos] != 0xFF )
+            bad_jpeg( c, "corrupt marker structure" );
+
+        m = f[pos + 1];
+
+        // fill bytes, and markers without a segment
+        if ( m == 0xFF )
+        {
+            pos++;
+            continue;
+        }
+
+        if ( m == 0x01 || (m >= M_RST0 && m <= M_SOI) )
+        {
+            pos += 2;
+            continue;
+        }
+
+        len = get16( f + pos + 2 );
+        s   = f + pos + 4;
+
+        if ( len < 2 || pos + 2 + len > c->filesize )
+            bad_jpeg( c, "corrupt marker segment" );
+
+        if ( m == M_DHT )
+        {
+            for ( n = 0; n < len - 2; )
+            {
+                struct jpeg_huff *h;
+                int total = 0;
+
+                if ( (s[n] >> 4) > 1 || (s[n] & 15) > 3 )
+                    bad_jpeg( c, "bad Huffman table" );
+
+                h = &j->huff[(s[n] >> 4) * 4 + (s[n] & 15)];
+
+                for ( i = 1; i <= 16; i++ )
+                    total += h->bits[i] = s[n + i];
+
+                if ( total > 256 || n + 17 + total > len - 2 )
+                    bad_jpeg( c, "bad Huffman table" );
+
+                memcpy( h->vals, s + n + 17, total );
+
+                if ( build_huff(h) )
+                    bad_jpeg( c, "bad Huffman table" );
+
+                n += 17 + total;
+            }
+        }
+        else if ( m == M_SOF0 || m == M_SOF1 )
+        {
+            if ( s[0] != 8 )
+                bad_jpeg( c, "only 8-bit JPEGs are supported" );
+
+            j->height = get16( s + 1 );
+            j->width  = get16( s + 3 );
+            j->ncomps = s[5];
+
+            if ( j->ncomps < 1 || j->ncomps > 4 || len < 8 + 3 * j->ncomps )
+                bad_jpeg( c, "bad frame header" );
+
+            for ( i = 0; i < j->ncomps; i++ )
+            {
+                j->comp[i].id = s[6 + 3 * i];
+                j->comp[i].h  = s[7 + 3 * i] >> 4;
+                j->comp[i].v  = s[7 + 3 * i] & 15;
+
+                if ( j->comp[i].h < 1 || j->comp[i].h > 4 || j->comp[i].v < 1 || j->comp[i].v > 4 )
+                    bad_jpeg( c, "bad sampling factors" );
+            }
+
+            have_frame = 1;
+        }
+        else if ( (m >= 0xC2 && m <= 0xCF) && m != M_DHT && m != 0xC8 && m != 0xCC )
+        {
+            bad_jpeg( c, "only baseline Huffman-coded JPEGs are supported (this one is progressive, "
+                         "lossless or arithmetic-coded)" );
+        }
+        else if ( m == M_DRI )
+        {
+            j->restart = get16( s );
+        }
+        else if ( m == M_SOS )
+        {
+            if ( !have_frame || s[0] != j->ncomps || len < 6 + 2 * s[0] )
+                bad_jpeg( c, "only single-scan JPEGs are supported" );
+
+            // components may be listed in any order; the scan's order is the one that counts
+            for ( i = 0; i < s[0]; i++ )
+            {
+                for ( k = i; k < j->ncomps && j->comp[k].id != s[1 + 2 * i]; k++ )
+                    ;
+
+                if ( k == j->ncomps )
+                    bad_jpeg( c, "scan names an unknown component" );
+
+                t          = j->comp[i];
+                j->comp[i] = j->comp[k];
+                j->comp[k] = t;
+
+                j->comp[i].dc = s[2 + 2 * i] >> 4;
+                j->comp[i].ac = s[2 + 2 * i] & 15;
+
+                if ( j->comp[i].dc > 3 || j->comp[i].ac > 3 )
+                    bad_jpeg( c, "bad scan header" );
+            }
+
+            s += 1 + 2 * j->ncomps;
+
+            if ( s[0] != 0 || s[1] != 63 || s[2] != 0 )
+                bad_jpeg( c, "only sequential JPEGs are supported" );
+
+            j->scan_start = pos + 2 + len;
+
+            return;
+        }
+
+        pos += 2 + len;
+    }
+}
+
+/*
+ * split the scan at its restart markers and check that it ends the file
+ */
+static void find_intervals(struct container *c)
+{
+    struct jpeg *j = c->jpg;
+    unsigned char *f = j->file;
+    long pos = j->scan_start, start = pos, expect;
+    int n = 0;
+
+    expect = (j->mcus + j->restart - 1) / j->restart;
+
+    j->iv_start = arena_alloc( &job_arena, expect * sizeof(long) );
+    j->iv_len   = arena_alloc( &job_arena, expect * sizeof(long) );
+    j->iv_units = arena_alloc( &job_arena, (expect + 1) * sizeof(long) );
+
+    for ( ; pos + 1 < c->filesize; pos++ )
+    {
+        // plain data, stuffed zeros and fill bytes
+        if ( f[pos] != 0xFF || f[pos + 1] == 0xFF )
+            continue;
+
+        if ( f[pos + 1] == 0x00 )
+        {
+            pos++;
+            continue;
+        }
+
+        // a marker ends the interval; anything but RSTn ends the scan
+        if ( n == expect )
+            bad_jpeg( c, "more restart intervals than MCUs" );
+
+        j->iv_start[n] = start;
+        j->iv_len[n]   = pos - start;
+        n++;
+
+        if ( f[pos + 1] < M_RST0 || f[pos + 1] > M_RST0 + 7 )
+            break;
+
+        start = ++pos + 1;
+    }
+
+    if ( pos + 1 >= c->filesize || f[pos + 1] != M_EOI )
+        bad_jpeg( c, "only single-scan JPEGs are supported" );
+
+    if ( n != expect )
+        bad_jpeg( c, "restart markers don't match the restart interval" );
+
+    j->scan_end   = pos;
+    j->nintervals = n;
+}
+
+/*
+ * MCUs [*first, *end) make up restart interval k
+ */
+static void interval_mcus(struct jpeg *j, int k, long *first, long *end)
+{
+    *first = k * j->restart;
+    *end   = (*first + j->restart < j->mcus) ? *first + j->restart : j->mcus;
+}
+
+// bits still to be read from one restart interval; the next bit is acc's msb
+struct bitreader
+{
+    const unsigned char *p, *end;
+    uint64_t acc;
+    int n;
+};
+
+static inline void refill(struct bitreader *r)
+{
+    while ( r->n <= 56 )
+    {
+        unsigned b = 0;
+
+        if ( r->p < r->end )
+        {
+            b = *r->p++;
+            r->p += (b == 0xFF);      // the stuffed zero
+        }
+
+        r->acc |= (uint64_t)b << (56 - r->n);
+        r->n   += 8;
+    }
+}
+
+static inline unsigned getbits(struct bitreader *r, int k)
+{
+    unsigned v = k ? r->acc >> (64 - k) : 0;
+
+    r->acc <<= k;
+    r->n    -= k;
+
+    return v;
+}
+
+/*
+ * the next Huffman symbol, or -1 for a code the table doesn't have
+ */
+static inline int decode_symbol(struct bitreader *r, const struct jpeg_huff *h)
+{
+    unsigned f = h->fast[r->acc >> (64 - JPEG_LOOKAHEAD)];
+    int l;
+
+    if ( f )
+    {
+        getbits( r, f & 0xFF );
+        return f >> 8;
+    }
+
+    for ( l = JPEG_LOOKAHEAD + 1; l <= 16; l++ )
+    {
+        int32_t code = r->acc >> (64 - l);
+
+        if ( code <= h->maxcode[l] )
+        {
+            getbits( r, l );
+            return h->vals[h->valptr[l] + code - h->mincode[l]];
+        }
+    }
+
+    return -1;
+}
+
+// a k-bit magnitude as coded, and back
+static inline int extend(unsigned v, int k)
+{
+    return (k && v < (1u << (k - 1))) ? (int)v - (1 << k) + 1 : (int)v;
+}
+
+static inline int category(int v)
+{
+    v = abs( v );
+
+    return v ? 32 - __builtin_clz( v ) : 0;
+}
+
+/*
+ * decode restart interval k into its blocks' coefficients, counting the
+ * carrier units in it
+ */
+static void decode_interval(struct jpeg_job *job, int k)
+{
+    struct jpeg *j = job->c->jpg;
+    struct bitreader r = { j->file + j->iv_start[k], j->file + j->iv_start[k] + j->iv_len[k], 0, 0 };
+    long mcu, end, units = 0;
+    int pred[4] = { 0, 0, 0, 0 }, b, i, s, rs;
+    int16_t *blk;
+
+    interval_mcus( j, k, &mcu, &end );
+
+    for ( ; mcu < end; mcu++ )
+    {
+        for ( b = 0; b < j->mcu_blocks; b++ )
+        {
+            struct jpeg_component *comp = &j->comp[j->mcu_comp[b]];
+
+            blk = j->coef + (mcu * j->mcu_blocks + b) * 64;
+            memset( blk, 0, 64 * sizeof(*blk) );
+
+            refill( &r );
+
+            if ( (s = decode_symbol(&r, &j->huff[comp->dc])) < 0 || s > 11 )
+                goto CORRUPT;
+
+            pred[j->mcu_comp[b]] += extend( getbits(&r, s), s );
+            blk[0] = pred[j->mcu_comp[b]];
+
+            for ( i = 1; i < 64; )
+            {
+                refill( &r );
+
+                if ( (rs = decode_symbol(&r, &j->huff[4 + comp->ac])) < 0 )
+                    goto CORRUPT;
+
+                s = rs & 15;
+
+                if ( s == 0 )
+                {
+                    if ( rs != 0xF0 )      // end of block
+                        break;
+
+                    i += 16;
+                    continue;
+                }
+
+                i += rs >> 4;
+
+                if ( i > 63 )
+                    goto CORRUPT;
+
+                blk[i] = extend( getbits(&r, s), s );
+                units += (s > 1);
+                i++;
+            }
+
+            if ( i > 64 )
+                goto CORRUPT;
+        }
+    }
+
+    j->iv_units[k + 1] = units;
+
+    return;
+
+CORRUPT:
+    job->failed = k + 1;
+}
+
+/*
+ * put payload bits [0, 8 * p->size) into units [8 * p->offset, ...) of
+ * interval k; the bit goes in the lsb of the coefficient's magnitude
+ */
+static void cover_interval(struct jpeg_job *job, int k)
+{
+    struct jpeg *j = job->c->jpg;
+    struct payload *p = job->p;
+    long u0 = 8L * p->offset, u1 = u0 + 8L * p->size, changed = 0, u = j->iv_units[k], n, mcu, end;
+    int16_t *v, *vend;
+    int mag, bit;
+
+    if ( u >= u1 || j->iv_units[k + 1] <= u0 )
+        return;
+
+    PROBE2( cover_start, j->iv_units[k], j->iv_units[k + 1] );
+
+    interval_mcus( j, k, &mcu, &end );
+
+    for ( v = j->coef + mcu * j->mcu_blocks * 64, vend = j->coef + end * j->mcu_blocks * 64; v < vend; v++ )
+    {
+        // DC coefficients, zeros and +-1 aren't units
+        if ( !((v - j->coef) & 63) || (*v >= -1 && *v <= 1) )
+            continue;
+
+        if ( (n = u++ - u0) < 0 || n >= u1 - u0 )
+            continue;
+
+        bit = 1 & (p->bytes[n / 8] >> (7 - n % 8));
+        mag = abs( *v );
+
+        if ( (mag & 1) != bit )
+        {
+            mag ^= 1;
+            *v   = (*v < 0) ? -mag : mag;
+            changed++;
+        }
+    }
+
+    __sync_fetch_and_add( &job->changed, changed );
+
+    PROBE3( cover_done, j->iv_units[k], j->iv_units[k + 1], changed );
+}
+
+/*
+ * the inverse: OR the units' magnitude lsbs into the payload.  intervals
+ * don't start on payload bytes, so neighbors can share one
+ */
+static void uncover_interval(struct jpeg_job *job, int k)
+{
+    struct jpeg *j = job->c->jpg;
+    struct payload *p = job->p;
+    long u0 = 8L * p->offset, u1 = u0 + 8L * p->size, byte = -1, u = j->iv_units[k], n, mcu, end;
+    unsigned char acc = 0;
+    int16_t *v, *vend;
+
+    if ( u >= u1 || j->iv_units[k + 1] <= u0 )
+        return;
+
+    PROBE2( uncover_start, j->iv_units[k], j->iv_units[k + 1] );
+
+    interval_mcus( j, k, &mcu, &end );
+
+    for ( v = j->coef + mcu * j->mcu_blocks * 64, vend = j->coef + end * j->mcu_blocks * 64; v < vend; v++ )
+    {
+        if ( !((v - j->coef) & 63) || (*v >= -1 && *v <= 1) )
+            continue;
+
+        if ( (n = u++ - u0) < 0 || n >= u1 - u0 )
+            continue;
+
+        if ( n / 8 != byte )
+        {
+            if ( byte >= 0 )
+                __sync_fetch_and_or( &p->bytes[byte], acc );
+
+            byte = n / 8;
+            acc  = 0;
+        }
+
+        acc |= (abs(*v) & 1) << (7 - n % 8);
+    }
+
+    if ( byte >= 0 )
+        __sync_fetch_and_or( &p->bytes[byte], acc );
+
+    PROBE2( uncover_done, j->iv_units[k], j->iv_units[k + 1] );
+}
+
+// coded bits on their way out; the last n bits of acc are pending
+struct bitwriter
+{
+    unsigned char *p;
+    uint64_t acc;
+    int n;
+};
+
+static inline void putbits(struct bitwriter *w, unsigned v, int k)
+{
+    w->acc = (w->acc << k) | v;
+    w->n  += k;
+
+    while ( w->n >= 8 )
+    {
+        unsigned char b = w->acc >> (w->n -= 8);
+
+        *w->p++ = b;
+
+        if ( b == 0xFF )
+            *w->p++ = 0x00;
+    }
+}
+
+/*
+ * Huffman-code restart interval k into job->out[k], with the file's tables
+ */
+static void encode_interval(struct jpeg_job *job, int k)
+{
+    struct jpeg *j = job->c->jpg;
+    struct bitwriter w = { job->out[k], 0, 0 };
+    long mcu, end;
+    int pred[4] = { 0, 0, 0, 0 }, b, i, s, run, last;
+    const struct jpeg_huff *dc, *ac;
+    int16_t *blk;
+
+    interval_mcus( j, k, &mcu, &end );
+
+    for ( ; mcu < end; mcu++ )
+    {
+        for ( b = 0; b < j->mcu_blocks; b++ )
+        {
+            dc  = &j->huff[j->comp[j->mcu_comp[b]].dc];
+            ac  = &j->huff[4 + j->comp[j->mcu_comp[b]].ac];
+            blk = j->coef + (mcu * j->mcu_blocks + b) * 64;
+
+            s = blk[0] - pred[j->mcu_comp[b]];
+            pred[j->mcu_comp[b]] = blk[0];
+
+            last = category( s );
+
+            if ( !dc->size[last] )
+                goto MISSING;
+
+            putbits( &w, dc->code[last], dc->size[last] );
+            putbits( &w, (s < 0 ? s - 1 : s) & ((1 << last) - 1), last );
+
+            for ( i = 1, run = 0; i < 64; i++ )
+            {
+                if ( blk[i] == 0 )
+                {
+                    run++;
+                    continue;
+                }
+
+                for ( ; run > 15; run -= 16 )
+                {
+                    if ( !ac->size[0xF0] )
+                        goto MISSING;
+
+                    putbits( &w, ac->code[0xF0], ac->size[0xF0] );
+                }
+
+                s = category( blk[i] );
+
+                if ( !ac->size[run << 4 | s] )
+                    goto MISSING;
+
+                putbits( &w, ac->code[run << 4 | s], ac->size[run << 4 | s] );
+                putbits( &w, (blk[i] < 0 ? blk[i] - 1 : blk[i]) & ((1 << s) - 1), s );
+                run = 0;
+            }
+
+            if ( run )
+            {
+                if ( !ac->size[0x00] )
+                    goto MISSING;
+
+                putbits( &w, ac->code[0x00], ac->size[0x00] );
+            }
+        }
+    }
+
+    // pad the last byte with 1 bits
+    if ( w.n )
+        putbits( &w, (1 << (8 - w.n)) - 1, 8 - w.n );
+
+    job->outlen[k] = w.p - job->out[k];
+
+    return;
+
+MISSING:
+    job->failed = k + 1;
+}
+
+static void *jpeg_worker(void *arg)
+{
+    struct jpeg_job *job = arg;
+    int k;
+
+    while ( (k = __sync_fetch_and_add(&job->next, 1)) < job->c->jpg->nintervals )
+        job->task( job, k );
+
+    return NULL;
+}
+
+/*
+ * run 'task' on every restart interval over a pool of threads
+ */
+static void run_intervals(struct jpeg_job *job)
+{
+    int threads = job->c->jpg->threads, i;
+    pthread_t *tid;
+
+    if ( threads <= 0 )
+        threads = sysconf( _SC_NPROCESSORS_ONLN );
+
+    if ( threads > job->c->jpg->nintervals )
+        threads = job->c->jpg->nintervals;
+
+    job->next = 0;
+
+    if ( threads <= 1 )
+    {
+        jpeg_worker( job );
+        return;
+    }
+
+    tid = arena_alloc( &job_arena, threads * sizeof(*tid) );
+
+    for ( i = 0; i < threads; i++ )
+        pthread_create( &tid[i], NULL, jpeg_worker, job );
+
+    for ( i = 0; i < threads; i++ )
+        pthread_join( tid[i], NULL );
+}
+
+/*
+ * load a JPEG: its markers and, since how much it can hold depends on its
+ * coefficients, the decoded coefficients too
+ */
+void get_jpeg_info(struct container *c)
+{
+    struct jpeg *j = c->jpg;
+    struct jpeg_job job;
+    int i, hmax = 1, vmax = 1, h;
+    long k;
+
+    fseek( c->fp, 0, SEEK_END );
+    c->filesize = ftell( c->fp );
+    rewind( c->fp );
+
+    j->file = arena_alloc( &job_arena, c->filesize );
+
+    if ( (long)fread(j->file, 1, c->filesize, c->fp) != c->filesize || get16(j->file) != (0xFF00 | M_SOI) )
+        bad_jpeg( c, "not a JPEG file" );
+
+    parse_markers( c );
+
+    if ( j->width <= 0 || j->height <= 0 )
+        bad_jpeg( c, "image size missing from the frame header" );
+
+    for ( i = 0; i < j->ncomps; i++ )
+    {
+        hmax = (j->comp[i].h > hmax) ? j->comp[i].h : hmax;
+        vmax = (j->comp[i].v > vmax) ? j->comp[i].v : vmax;
+    }
+
+    // one component alone is coded a block at a time, whatever its sampling
+    if ( j->ncomps == 1 )
+    {
+        j->mcus        = (long)((j->width + 7) / 8) * ((j->height + 7) / 8);
+        j->mcu_blocks  = 1;
+        j->mcu_comp[0] = 0;
+    }
+    else
+    {
+        j->mcus       = (long)((j->width + 8 * hmax - 1) / (8 * hmax)) * ((j->height + 8 * vmax - 1) / (8 * vmax));
+        j->mcu_blocks = 0;
+
+        for ( i = 0; i < j->ncomps; i++ )
+            for ( h = 0; h < j->comp[i].h * j->comp[i].v; h++ )
+            {
+                if ( j->mcu_blocks == 10 )
+                    bad_jpeg( c, "too many blocks per MCU" );
+
+                j->mcu_comp[j->mcu_blocks++] = i;
+            }
+    }
+
+    if ( j->restart <= 0 )
+        j->restart = j->mcus;
+
+    find_intervals( c );
+
+    // every table the scan uses has to be there
+    for ( i = 0; i < j->ncomps; i++ )
+        if ( !huff_present(&j->huff[j->comp[i].dc]) || !huff_present(&j->huff[4 + j->comp[i].ac]) )
+            bad_jpeg( c, "scan uses a missing Huffman table" );
+
+    j->coef = arena_alloc( &job_arena, j->mcus * j->mcu_blocks * 64 * sizeof(int16_t) );
+
+    memset( &job, 0, sizeof(job) );
+    job.c    = c;
+    job.task = decode_interval;
+
+    run_intervals( &job );
+
+    if ( job.failed )
+    {
+        fprintf( stderr, "[ERROR] %s: corrupt data in restart interval %d, aborting.\n", c->filename, job.failed - 1 );
+        exit( EXIT_FAILURE );
+    }
+
+    for ( j->iv_units[0] = 0, k = 0; k < j->nintervals; k++ )
+        j->iv_units[k + 1] += j->iv_units[k];
+
+    // the units, to the rest of the program, are one long run
+    c->layout.offset     = 0;
+    c->layout.runs       = 1;
+    c->layout.run_stride = 0;
+    c->layout.groups     = j->iv_units[j->nintervals];
+    c->layout.stride     = 1;
+    c->layout.lane_mask  = 1;
+
+    set_layout( &c->layout );
+}
+
+/*
+ * get_jpeg_info() already decoded the coefficients
+ */
+void init_jpeg_storage(struct container *c)
+{
+    (void)c;
+}
+
+int get_jpeg(struct container *c)
+{
+    return c->jpg->mcus * c->jpg->mcu_blocks * 64 * sizeof(int16_t);
+}
+
+int jpeg_cover(struct container *c, struct payload *p)
+{
+    struct jpeg_job job;
+
+    printf( "mixing bits from %s into DCT coefficients from %s...\n", p->filename, c->filename );
+
+    memset( &job, 0, sizeof(job) );
+    job.c    = c;
+    job.p    = p;
+    job.task = cover_interval;
+
+    run_intervals( &job );
+    show_quality( c, job.changed );
+
+    return 0;
+}
+
+int jpeg_uncover(struct container *c, struct payload *p)
+{
+    struct jpeg_job job;
+
+    memset( &job, 0, sizeof(job) );
+    job.c    = c;
+    job.p    = p;
+    job.task = uncover_interval;
+
+    run_intervals( &job );
+
+    return 0;
+}
+
+/*
+ * Huffman-code the coefficients again and write the scan, its restart
+ * markers and whatever followed it in the base file
+ */
+int write_jpeg(FILE *out, struct container *c)
+{
+    struct jpeg *j = c->jpg;
+    struct jpeg_job job;
+    unsigned char rst[2] = { 0xFF, M_RST0 };
+    long written = 0;
+    int k;
+
+    memset( &job, 0, sizeof(job) );
+    job.c      = c;
+    job.task   = encode_interval;
+    job.out    = arena_alloc( &job_arena, j->nintervals * sizeof(*job.out) );
+    job.outlen = arena_alloc( &job_arena, j->nintervals * sizeof(*job.outlen) );
+
+    // every block codes to the same number of bits it did; only the byte
+    // stuffing can differ, and it at most doubles an interval
+    for ( k = 0; k < j->nintervals; k++ )
+        job.out[k] = arena_alloc( &job_arena, 2 * j->iv_len[k] + 16 );
+
+    run_intervals( &job );
+
+    if ( job.failed )
+    {
+        fprintf( stderr, "[ERROR] %s: restart interval %d needs a code its Huffman tables lack, aborting.\n",
+                 c->filename, job.failed - 1 );
+        exit( EXIT_FAILURE );
+    }
+
+    fseek( out, j->scan_start, SEEK_SET );
+
+    for ( k = 0; k < j->nintervals; k++ )
+    {
+        written += fwrite( job.out[k], 1, job.outlen[k], out );
+
+        if ( k < j->nintervals - 1 )
+        {
+            rst[1]   = M_RST0 + (k & 7);
+            written += fwrite( rst, 1, 2, out );
+        }
+    }
+
+    written += fwrite( j->file + j->scan_end, 1, c->filesize - j->scan_end, out );
+
+    return written;
+}
+
+/*
+ * wrapper function to copy everything before the scan (tables, headers,
+ * metadata) to "target"
+ */
+int write_jpeg_header(FILE *target, struct container *c)
+{
+    return fwrite( c->jpg->file, 1, c->jpg->scan_start, target );
+}
+
+/*
+ * ensure the coefficients have room for the payload
+ */
+void validate_jpeg(struct container *c, struct payload *p)
+{
+    if ( carrier_capacity(c) < p->size )
+    {
+        fprintf( stderr,
+                "[ERROR] %s has room for %d bytes in its DCT coefficients; %s is %d bytes.\n",
+                c->filename, carrier_capacity(c), p->filename, p->size );
+        exit( EXIT_FAILURE );
+    }
+}
+
+/*
+ * pretty-print some info for the user
+ */
+void show_jpeg_info(struct container *c, struct payload *p)
+{
+    struct jpeg *j = c->jpg;
+
+    printf( "--[base file]------------------\n"
+            "file name   : %s\n"
+            "file size   : %d bytes\n"
+            "scan data   : %d bytes\n"
+            "JPEG width  : %d pixels\n"
+            "JPEG height : %d pixels\n"
+            "components  : %d\n"
+            "restarts    : %d interval%s\n"
+            "capacity    : %d bytes (%ld usable coefficients)\n",
+            c->filename, c->filesize, j->scan_end - j->scan_start, j->width, j->height, j->ncomps,
+            j->nintervals, (j->nintervals == 1) ? "" : "s", carrier_capacity(c), carrier_units(c) );
+
+    printf( "\n--[hide file]------------------\n"
+            "file name: %s\n"
+            "file size: %d bytes (IMPORTANT: this number is required to recover the file)\n", p->filename, p->datasize );
+
+    puts( "-------------------------------\n" );
+}
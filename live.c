@@ -0,0 +1,362 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, live.c
+ *
+ * real-time embedding in a PCM stream
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <fcntl.h>
+#include <unistd.h>          // for read() and write()
+#include <time.h>            // for clock_gettime()
+
+/*
+ * every other mode loads the whole carrier before it touches a sample, which
+ * rules out audio that's still being recorded.  live mode reads a WAV stream
+ * (a pipe from arecord, say) a period at a time: once a period of frames has
+ * arrived, its samples get the next payload bits through cover_units() and
+ * the period goes straight back out.  the header is passed through as it's
+ * parsed, without seeking, so the output is as good a WAV file as the input
+ * and -R recovers the payload from a saved copy.
+ *
+ * everything the loop needs is allocated and touched up front; per period it
+ * makes one read() (or a few, as the data trickles in), one cover_units()
+ * over a stand-in container for the period buffer and one write().  the time
+ * from the last byte of a period arriving to it having been written is the
+ * period's latency, and a period whose latency exceeds its own duration has
+ * missed its deadline.  latencies go in a histogram of LIVE_BUCKETS one-
+ * microsecond buckets, reported as percentiles at the end.
+ */
+
+#define LIVE_HEADER_MAX  65536  // header bytes before the data chunk, at most
+#define LIVE_BUCKETS     10000  // latency histogram: 0 to 9999 us, then overflow
+#define LIVE_UNBOUNDED   0x7FFFF000u  // data sizes from here up mean "until EOF"
+
+// where an open stream stands
+struct live_stream
+{
+    struct container c;       // stand-in for one period; only its samples move
+    struct pcm w;
+    unsigned char *buf;       // the period, with room for 7 samples in front
+    unsigned char *hdr;       // the header, as read
+    int  hlen;
+    long remaining;           // data bytes left, or -1 to read until EOF
+    int  in, out;
+};
+
+/*
+ * read() until 'len' bytes are in or the input ends; returns what came in
+ */
+static long read_full(int fd, unsigned char *buf, long len)
+{
+    long got = 0, n;
+
+    while ( got < len )
+    {
+        n = read( fd, buf + got, len - got );
+
+        if ( n == 0 )
+            break;
+
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            fprintf( stderr, "[ERROR] reading the stream: %s, aborting.\n", strerror(errno) );
+            exit( EXIT_FAILURE );
+        }
+
+        got += n;
+    }
+
+    return got;
+}
+
+static void write_full(int fd, const unsigned char *buf, long len)
+{
+    long n;
+
+    while ( len > 0 )
+    {
+        n = write( fd, buf, len );
+
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            fprintf( stderr, "[ERROR] writing the stream: %s, aborting.\n", strerror(errno) );
+            exit( EXIT_FAILURE );
+        }
+
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * append the next 'len' bytes of the stream to the header, returning where
+ * they went
+ */
+static unsigned char *take(struct live_stream *s, int len)
+{
+    unsigned char *at = s->hdr + s->hlen;
+
+    if ( s->hlen + len > LIVE_HEADER_MAX )
+    {
+        fprintf( stderr, "[ERROR] no data chunk in the first %d bytes of the stream, aborting.\n", LIVE_HEADER_MAX );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( read_full(s->in, at, len) != len )
+    {
+        fprintf( stderr, "[ERROR] the stream ended inside its WAV header, aborting.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    s->hlen += len;
+
+    return at;
+}
+
+static uint32_t le32(const unsigned char *b)
+{
+    return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static uint16_t le16(const unsigned char *b)
+{
+    return b[0] | b[1] << 8;
+}
+
+/*
+ * walk the RIFF chunks up to "data", keeping everything read in s->hdr; the
+ * stream is left at the first sample
+ */
+static void parse_header(struct live_stream *s)
+{
+    struct pcm *w = &s->w;
+    unsigned char *b;
+    uint32_t size;
+    int fmt = 0;
+
+    b = take( s, 12 );
+
+    if ( memcmp(b, "RIFF", 4) != 0 || memcmp(b + 8, "WAVE", 4) != 0 )
+    {
+        fprintf( stderr, "[ERROR] the stream isn't a WAV file, aborting.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    while ( 1 )
+    {
+        b    = take( s, 8 );
+        size = le32( b + 4 );
+
+        if ( memcmp(b, "data", 4) == 0 )
+            break;
+
+        // chunks are padded to an even length
+        b = take( s, size + (size & 1) );
+
+        if ( memcmp(b - 8, "fmt ", 4) == 0 && size >= 16 )
+        {
+            w->audioformat = le16( b );
+            w->channels    = le16( b + 2 );
+            w->rate        = le32( b + 4 );
+            w->block_align = le16( b + 12 );
+            w->depth       = le16( b + 14 );
+            fmt = 1;
+        }
+    }
+
+    if ( !fmt || w->audioformat != 1 )
+    {
+        fprintf( stderr, "[ERROR] the stream isn't PCM audio, aborting.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( w->depth < 16 || w->depth % 8 || w->channels < 1 || w->block_align != w->channels * w->depth / 8 )
+    {
+        fprintf( stderr, "[ERROR] unsupported sample format (%d-bit, %d channels, %d-byte frames), aborting.\n",
+                 w->depth, w->channels, w->block_align );
+        exit( EXIT_FAILURE );
+    }
+
+    w->sample_size   = w->depth / 8;
+    w->subchunk2size = size;
+    w->data_offset   = s->hlen;
+
+    // recorders that don't know the length yet leave 0 or "as big as can be"
+    s->remaining = (size == 0 || size >= LIVE_UNBOUNDED) ? -1L : (long)size;
+}
+
+/*
+ * time since 'then' in microseconds
+ */
+static long elapsed_us(const struct timespec *then)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (ts.tv_sec - then->tv_sec) * 1000000L + (ts.tv_nsec - then->tv_nsec) / 1000;
+}
+
+/*
+ * smallest latency at or below which 'q' of the periods fell
+ */
+static long percentile(const long *hist, long periods, double q)
+{
+    long seen = 0, i;
+
+    for ( i = 0; i <= LIVE_BUCKETS; i++ )
+    {
+        seen += hist[i];
+
+        if ( seen >= q * periods )
+            break;
+    }
+
+    return i;
+}
+
+/*
+ * hide the payload in the WAV stream on u->basefile ("-" for stdin) as it
+ * plays, writing it to u->outputfile ("-" for stdout) a period of
+ * u->period frames at a time.  returns the number of periods
+ */
+long live_embed(struct user_input *u)
+{
+    struct live_stream s;
+    struct payload p, rest;
+    struct layout *l = &s.c.layout;
+    struct timespec arrived;
+    long *hist, units, bit = 0, total, len, got, us, max = 0, misses = 0, periods = 0, changed = 0;
+    int  k, ss;
+    double deadline;
+
+    memset( &s, 0, sizeof(s) );
+
+    s.in  = strcmp( u->basefile, "-" ) ? open( u->basefile, O_RDONLY ) : STDIN_FILENO;
+    s.out = strcmp( u->outputfile, "-" ) ? open( u->outputfile, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) : STDOUT_FILENO;
+
+    if ( s.in < 0 || s.out < 0 )
+    {
+        fprintf( stderr, "[ERROR] could not open %s: %s\nAborting.\n",
+                 (s.in < 0) ? u->basefile : u->outputfile, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    // the payload is small next to the stream, so it's read in one go
+    p.fp = open_file( u->hidefile, &(p.filename) );
+    fseek( p.fp, 0, SEEK_END );
+    p.datasize = p.size = ftell( p.fp );
+    p.fec = p.matrix = p.offset = 0;
+    init_payload_storage( &p );
+    get_payload( &p );
+    fclose( p.fp );
+
+    total = 8L * p.size;
+
+    s.hdr = arena_alloc( &job_arena, LIVE_HEADER_MAX );
+    parse_header( &s );
+    write_full( s.out, s.hdr, s.hlen );
+
+    ss       = s.w.sample_size;
+    len      = (long)u->period * s.w.block_align;
+    units    = (long)u->period * s.w.channels;
+    deadline = 1e6 * u->period / s.w.rate;
+
+    // one run of samples, one bit per sample as in pcm_cover(), with 7 more
+    // in front of the period so unit 'bit % 8' can always be its first sample
+    s.buf = arena_alloc( &job_arena, len + 7 * ss );
+    hist  = arena_alloc( &job_arena, (LIVE_BUCKETS + 1) * sizeof(*hist) );
+
+    memset( s.buf, 0, len + 7 * ss );
+    memset( hist, 0, (LIVE_BUCKETS + 1) * sizeof(*hist) );
+
+    s.c.type       = wavfile;
+    s.c.w          = &s.w;
+    l->offset      = 0;
+    l->runs        = 1;
+    l->run_stride  = len + 7 * ss;
+    l->groups      = units + 7;
+    l->stride      = ss;
+    l->lane_mask   = 1;
+    set_layout( l );
+
+    fprintf( stderr, "live: %d-bit, %d channel%s at %d Hz; %d-frame periods (%.0f us)\n"
+                     "live: hiding %d bytes from %s\n",
+             s.w.depth, s.w.channels, (s.w.channels == 1) ? "" : "s", s.w.rate,
+             u->period, deadline, p.size, p.filename );
+
+    while ( s.remaining != 0 )
+    {
+        got = read_full( s.in, s.buf + 7 * ss,
+                         (s.remaining >= 0 && s.remaining < len) ? s.remaining : len );
+
+        if ( got == 0 )
+            break;
+
+        clock_gettime( CLOCK_MONOTONIC, &arrived );
+
+        if ( s.remaining > 0 )
+            s.remaining -= got;
+
+        // whole samples only; a torn one at the very end passes through
+        if ( bit < total )
+        {
+            k = bit % 8;
+            s.w.samples = s.buf + (7 - k) * ss;
+
+            // the payload from the byte holding 'bit' on
+            rest        = p;
+            rest.bytes += bit / 8;
+            rest.size  -= bit / 8;
+
+            changed += cover_units( &s.c, &rest, k, k + ((got / ss < total - bit) ? got / ss : total - bit) );
+
+            bit += (got / ss < total - bit) ? got / ss : total - bit;
+        }
+
+        write_full( s.out, s.buf + 7 * ss, got );
+
+        us = elapsed_us( &arrived );
+        hist[(us < LIVE_BUCKETS) ? us : LIVE_BUCKETS]++;
+        max = (us > max) ? us : max;
+        misses += (us > deadline);
+        periods++;
+    }
+
+    // anything after the data chunk goes through as is
+    while ( (got = read_full(s.in, s.buf, len)) > 0 )
+        write_full( s.out, s.buf, got );
+
+    if ( s.in != STDIN_FILENO )
+        close( s.in );
+
+    if ( s.out != STDOUT_FILENO && close(s.out) != 0 )
+    {
+        fprintf( stderr, "[ERROR] writing %s: %s, aborting.\n", u->outputfile, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    fprintf( stderr, "live: %ld period%s, %ld samples changed\n"
+                     "latency: p50 %ld us, p99 %ld us, p99.9 %ld us, max %ld us\n"
+                     "deadline misses: %ld\n",
+             periods, (periods == 1) ? "" : "s", changed,
+             percentile(hist, periods, 0.5), percentile(hist, periods, 0.99),
+             percentile(hist, periods, 0.999), max, misses );
+
+    if ( bit < total )
+    {
+        fprintf( stderr, "[ERROR] the stream ended after %ld of the %d payload bytes, aborting.\n", bit / 8, p.size );
+        exit( EXIT_FAILURE );
+    }
+
+    return periods;
+}
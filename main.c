@@ -10,6 +10,9 @@
 
 #include "steganographer.h"
 
+// operational state
+enum MODE mode;
+
 // function pointers for the callbacks
 void (*get_info)(struct container *);
 int  (*get_data)(struct container *);
@@ -24,68 +27,206 @@ int (*mode_action)(struct container *, struct payload *);
 
 int main(int argc, char **argv)
 {
-    int  result;            // for various function return values
+    int  result = 0;        // for various function return values
+    int  written;           // bytes of output past the header
+    int  streamed;          // the payload goes through a pipeline (see pipeline.c)
+    int  direct_given;      // --direct was on the command line, not from the profile
     FILE *outfile;          // where we write what we've hidden or recovered
 
     struct payload pload;   // the thing we want to hide
     struct container data;  // the "camouflage"
     struct user_input user; // command-line args
 
+    data.numa    = NULL;
+    data.image   = NULL;
+
+    pload.offset = 0;
+    pload.fec    = 0;
+    pload.matrix = 0;
+
     // handle command-line arguments, store in the 'user' struct
     parse_args( argc, argv, &user );
 
-    // figure out what kind of file we're using as camouflage
-    data.type = find_type( user.basefile );
+    // benchmark this host, and otherwise run with what it found best
+    if ( mode == tune )
+    {
+        show_status( &user );
 
-    // now that we have a data type (e.g., bitmap or PCM wav), we can
-    // instantiate the appropriate data "object" by allocating memory
-    // for it and associating the appropriate callbacks
-    switch (data.type)
+        return autotune( user.basefile, user.outputfile );
+    }
+
+    // live streams own stdout, and take neither -j nor --direct
+    if ( mode == live )
     {
-        case bitmap:
+        live_embed( &user );
+        fprintf( stderr, "[COMPLETE] wrote the stream to %s.\n",
+                 strcmp(user.outputfile, "-") ? user.outputfile : "stdout" );
 
-            data.b = malloc( sizeof(*data.b) );
+        return 0;
+    }
 
-            get_data          = &get_bitmap;
-            get_info          = &get_bitmap_info;
-            show_info         = &show_bitmap_info;
-            write_data        = &write_bitmap;
-            write_header      = &write_bitmap_header;
-            validate_data     = &validate_bitmap;
-            init_data_storage = &init_pixel_matrix;
+    // workers run each job as a process of its own, which loads its own profile
+    if ( mode == worker )
+        return worker_run( &user ) ? EXIT_FAILURE : 0;
 
-            mode_action = (mode == hide ) ? &bitmap_cover
-                                          : &bitmap_uncover;
-            break;
+    // verification rehashes a file in chunks against its merkle sidecar
+    if ( mode == verification )
+    {
+        result = merkle_verify( user.basefile, user.threads );
 
-        case wavfile:
+        if ( result )
+        {
+            fprintf( stderr, "[ERROR] %d chunk%s of %s %s the merkle sidecar.\n", result,
+                     (result == 1) ? "" : "s", user.basefile, (result == 1) ? "differs from" : "differ from" );
+            return EXIT_FAILURE;
+        }
 
-            data.w = malloc( sizeof(*data.w) );
+        printf( "[COMPLETE] %s matches its merkle sidecar.\n", user.basefile );
 
-            get_data          = &get_samples;
-            get_info          = &get_pcm_info;
-            show_info         = &show_pcm_info;
-            write_data        = &write_samples;
-            write_header      = &write_pcm_header;
-            validate_data     = &validate_wavfile;
-            init_data_storage = &init_sample_storage;
+        return 0;
+    }
 
-            mode_action = (mode == hide ) ? &pcm_cover
-                                          : &pcm_uncover;
+    direct_given = user.direct;
 
-            break;
+    if ( user.profile )
+        load_profile( &user );
 
-        default:
+    // migrations stream two carriers at once
+    if ( mode == migration )
+    {
+        show_status( &user );
 
-            fprintf( stderr, "[ERROR] unknown data type, aborting.\n" );
-            exit( EXIT_FAILURE );
+        result = migrate( &user );
+
+        if ( user.merkle )
+            merkle_file( user.outputfile, 0 );
+
+        printf( "[COMPLETE] wrote %d bytes to %s.\n", result, user.outputfile );
+
+        return 0;
+    }
+
+    // a delta is format-agnostic, it's just carrier offsets and lsbs
+    if ( mode == apply )
+    {
+        show_status( &user );
+
+        result = apply_delta( user.basefile, user.deltafile );
+        printf( "[COMPLETE] applied %d run%s from %s to %s.\n", result, (result == 1) ? "" : "s",
+                user.deltafile, user.basefile );
+
+        return 0;
+    }
+
+    // analysis looks at many carriers, each on its own
+    if ( mode == analysis )
+    {
+        analyze( user.basefile, user.threads );
+
+        return 0;
+    }
+
+    // packing spreads many payloads over many carriers
+    if ( mode == pack )
+    {
+        show_status( &user );
+
+        result = pack_payloads( &user );
+        printf( "[COMPLETE] packed %d payload%s into %d carrier%s in %s.\n", user.npackfiles,
+                (user.npackfiles == 1) ? "" : "s", result, (result == 1) ? "" : "s", user.outputfile );
+
+        return 0;
+    }
+
+    // figure out what kind of file we're using as camouflage
+    data.type = find_type( user.basefile );
+
+    if ( user.wav_channels && data.type != wavfile )
+    {
+        fprintf( stderr, "[ERROR] channel numbers for --channels only apply to WAV files, aborting.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( data.type == wavfile && user.channels )
+    {
+        fprintf( stderr, "[ERROR] color channels only apply to images; WAV channels are numbers, aborting.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    // the lanes of a channel mask are their own split of the payload
+    if ( data.type == wavfile && user.wav_channels && (user.checkpoint || user.deltafile[0] || user.range_set
+                                                       || user.matrix || user.adaptive) )
+    {
+        fprintf( stderr, "[ERROR] --channels on WAV files can't be combined with --checkpoint, --delta,\n"
+                         "--range, --matrix or --adaptive, aborting.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    // these all work on carrier bytes at their file positions, and a PNG's
+    // pixels only exist once they're inflated
+    if ( data.type == pngfile && (user.checkpoint || user.deltafile[0] || mode == update) )
+    {
+        fprintf( stderr, "[ERROR] PNG carriers can't be updated, checkpointed or written as deltas, aborting.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    // there's no file image of the pixels to read around the page cache
+    if ( (data.type == pngfile || data.type == jpegfile) && direct_given )
+    {
+        fprintf( stderr, "[ERROR] --direct doesn't apply to %s carriers, aborting.\n",
+                 (data.type == pngfile) ? "PNG" : "JPEG" );
+        exit( EXIT_FAILURE );
+    }
+
+    // the units of a JPEG are coefficients, not carrier bytes
+    if ( data.type == jpegfile && (user.checkpoint || user.deltafile[0] || mode == update || user.matrix || user.adaptive) )
+    {
+        fprintf( stderr, "[ERROR] JPEG carriers can't be updated, checkpointed, written as deltas, "
+                         "or used with --matrix or --adaptive, aborting.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( data.type == jpegfile && user.channels )
+    {
+        fprintf( stderr, "[ERROR] --channels doesn't apply to JPEGs, aborting.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    // now that we have a data type (e.g., bitmap or PCM wav), we can
+    // instantiate the appropriate data "object" by allocating memory
+    // for it and associating the appropriate callbacks
+    bind_carrier( &data, user.channels, user.wav_channels );
+
+    // -j threads go where each format does its parallel work: PNGs deflate
+    // the output and JPEGs code restart intervals instead of loading the
+    // input, and a tuned profile's --direct is dropped for them; WAV lanes
+    // are embedded as many at a time
+    if ( data.type == pngfile )
+    {
+        data.png->threads = user.threads;
+        user.threads      = 1;
+        user.direct       = 0;
+    }
+    else if ( data.type == jpegfile )
+    {
+        data.jpg->threads = user.threads;
+        user.threads      = 1;
+        user.direct       = 0;
+    }
+    else if ( data.type == wavfile && data.w->channel_mask )
+    {
+        data.w->threads = user.threads;
+        user.threads    = 1;
     }
 
     show_status( &user );
 
     // open the camouflage file and load its header
     data.fp = open_file( user.basefile, &data.filename );
+
+    PROBE1( header_start, data.filename );
     get_info( &data );
+    PROBE2( header_done, data.filename, (long)data.filesize );
 
     // this next block represents payload management
     //
@@ -93,42 +234,254 @@ int main(int argc, char **argv)
     // associate the user's selection with the payload "object"
     //
     // in recover mode, the user supplies a payload size
-    if ( mode == hide )
+    if ( mode == hide || mode == update )
     {
         pload.fp = open_file( user.hidefile, &(pload.filename) );
 
-        // get payload size
+        // get payload size, and the size of the stream we'll hide once
+        // any error correction has been added
         fseek( pload.fp, 0, SEEK_END );
-        pload.size = ftell( pload.fp );
+        pload.datasize = ftell( pload.fp );
+        pload.fec      = user.fec;
+        pload.size     = fec_encoded_size( pload.datasize, pload.fec );
         rewind( pload.fp );
 
         // make sure everything is copacetic
         validate_data( &data, &pload );
+
+        // an update lands at a given offset of the hidden stream
+        if ( mode == update )
+        {
+            pload.offset = user.update_offset;
+
+            if ( pload.offset + pload.size > carrier_capacity(&data) )
+            {
+                fprintf( stderr, "[ERROR] %d bytes at offset %d run past the %d bytes %s can hold, aborting.\n",
+                         pload.size, pload.offset, carrier_capacity(&data), data.filename );
+                exit( EXIT_FAILURE );
+            }
+        }
+    }
+    else if ( user.range_set ) // a slice of the hidden stream
+    {
+        pload.offset = user.range_start;
+        pload.size   = user.range_end - user.range_start;
+        pload.datasize = pload.size;
+
+        if ( user.range_end > carrier_capacity(&data) )
+        {
+            fprintf( stderr, "[ERROR] --range %d:%d runs past the %d bytes %s can hold, aborting.\n",
+                     user.range_start, user.range_end, carrier_capacity(&data), data.filename );
+            exit( EXIT_FAILURE );
+        }
+
+        // the carrier bytes are read directly by uncover_range()
+        mode_action = &uncover_range;
     }
     else // just need the size in recover mode
     {
-        pload.size = user.payload_size;
+        pload.datasize = user.payload_size;
+        pload.fec      = user.fec;
+        pload.size     = fec_encoded_size( pload.datasize, pload.fec );
+    }
+
+    // matrix embedding has its own capacity, and one routine for all types
+    if ( user.matrix )
+    {
+        pload.matrix = user.matrix;
+
+        if ( matrix_units(pload.size, pload.matrix) > carrier_units(&data) )
+        {
+            fprintf( stderr, "[ERROR] %d bytes with --matrix %d need %ld carrier bytes; %s has %ld, aborting.\n",
+                     pload.size, pload.matrix, matrix_units(pload.size, pload.matrix),
+                     data.filename, carrier_units(&data) );
+            exit( EXIT_FAILURE );
+        }
+
+        mode_action = (mode == hide) ? &matrix_cover : &matrix_uncover;
     }
 
     // pre-production
-    init_data_storage( &data );
     init_payload_storage( &pload );
 
-    // grab the data bytes
-    result = get_data( &data );
+    // checkpointed jobs stream the carrier instead of loading it
+    if ( user.checkpoint )
+    {
+        if ( mode == hide )
+        {
+            show_info( &data, &pload );
+
+            get_payload( &pload );
+            fclose( pload.fp );
+            fec_encode( &pload );
+        }
+
+        result = checkpoint_run( &data, &pload, user.outputfile, user.resume );
+
+        // parity can only be checked once the whole stream is back
+        if ( mode == recover && pload.fec )
+        {
+            outfile = fopen( user.outputfile, "wb" );
+
+            if ( !outfile )
+            {
+                fprintf( stderr, "Error opening %s for writing: %s\n", user.outputfile, strerror(errno) );
+                exit( EXIT_FAILURE );
+            }
+
+            result = fec_decode( &pload );
+
+            if ( result >= 0 )
+                printf( "error correction: %d damaged byte%s repaired.\n", result, (result == 1) ? "" : "s" );
+
+            result = write_payload( outfile, &pload );
+            fclose( outfile );
+        }
+
+        if ( user.merkle )
+            merkle_file( user.outputfile, 0 );
+
+        printf( "[COMPLETE] wrote %d bytes to %s.\n", result, user.outputfile );
+
+        fclose( data.fp );
+        clean_up( &data, &pload );
+
+        return 0;
+    }
+
+    // grab the data bytes (ranged recoveries, updates and deltas read only
+    // what they need later on, except from a PNG or JPEG)
+    if ( (!user.range_set || data.type == pngfile || data.type == jpegfile) && mode != update && !user.deltafile[0] )
+    {
+        PROBE2( load_start, data.filename, data.layout.offset );
+
+        // with -j, threads on every NUMA node load their own slice;
+        // --direct reads the file image around the page cache
+        if ( user.direct )
+        {
+            result = direct_load( &data );
+        }
+        else
+        {
+            init_data_storage( &data );
+
+            result = (user.threads > 1) ? numa_load( &data, user.threads )
+                                        : get_data( &data );
+        }
+
+        PROBE2( load_done, data.filename, (long)result );
+    }
+
+    if ( mode == update )
+    {
+        get_payload( &pload );
+        fclose( pload.fp );
+
+        result = update_in_place( &data, &pload );
+        printf( "[COMPLETE] %d carrier bytes changed in %s.\n", result, data.filename );
+
+        fclose( data.fp );
+        clean_up( &data, &pload );
+
+        return 0;
+    }
+
+    if ( mode == hide && user.deltafile[0] )
+    {
+        get_payload( &pload );
+        fclose( pload.fp );
+        fec_encode( &pload );
+
+        outfile = fopen( user.deltafile, "wb" );
+
+        if ( !outfile )
+        {
+            fprintf( stderr, "Error opening %s for writing: %s\n", user.deltafile, strerror(errno) );
+            exit( EXIT_FAILURE );
+        }
+
+        result = write_delta( outfile, &data, &pload );
+        printf( "[COMPLETE] %d carrier bytes change; wrote %ld-byte delta to %s.\n",
+                result, ftell(outfile), user.deltafile );
+
+        fclose( outfile );
+        fclose( data.fp );
+        clean_up( &data, &pload );
+
+        return 0;
+    }
+
+    // plain embeds and extractions stream the payload file block by block,
+    // overlapping its i/o with the kernels; error correction and adaptive
+    // embedding need the whole payload at once
+    streamed = (mode == hide || mode == recover) && !pload.fec && !user.adaptive && !data.numa &&
+               (mode_action == &bitmap_cover || mode_action == &pcm_cover ||
+                mode_action == &bitmap_uncover || mode_action == &pcm_uncover);
 
     if ( mode == hide )
     {
         show_info( &data, &pload );
         printf( "%s: read %d bytes of data.\n", data.filename, result );
+    }
 
+    if ( mode == hide && !streamed )
+    {
         result = get_payload( &pload );
         printf ( "%s: read %d bytes.\n\n", pload.filename, result );
 
         fclose( pload.fp ); // we're done with the payload file
+
+        if ( pload.fec )
+        {
+            fec_encode( &pload );
+            printf( "added %d bytes of Reed-Solomon parity (%d per codeword).\n\n",
+                    pload.size - pload.datasize, pload.fec );
+        }
+    }
+
+    // adaptive embedding picks its carrier units from the loaded data
+    if ( user.adaptive )
+    {
+        long units = adaptive_select( &data, user.adaptive, 8L * pload.size );
+
+        if ( units < 8L * pload.size )
+        {
+            fprintf( stderr, "[ERROR] only %ld bytes of %s are busy enough for --adaptive %g; %d needed, aborting.\n",
+                     units / 8, data.filename, user.adaptive, pload.size );
+            exit( EXIT_FAILURE );
+        }
+
+        mode_action = (mode == hide) ? &adaptive_cover : &adaptive_uncover;
+    }
+
+    // ... and embed into or extract from the slice they loaded
+    if ( data.numa && (mode_action == &bitmap_cover || mode_action == &pcm_cover) )
+        mode_action = &numa_cover;
+    else if ( data.numa && (mode_action == &bitmap_uncover || mode_action == &pcm_uncover) )
+        mode_action = &numa_uncover;
+    else if ( streamed )
+        mode_action = (mode == hide) ? &pipeline_cover : &pipeline_uncover;
+
+    // direct output is written in one go below
+    if ( user.direct && mode == hide )
+    {
+        mode_action( &data, &pload );
+
+        result = direct_write( &data, user.outputfile );
+
+        if ( user.merkle )
+            merkle_file( user.outputfile, 0 );
+
+        printf( "[COMPLETE] wrote %d bytes to %s.\n", result, user.outputfile );
+
+        fclose( data.fp );
+        clean_up( &data, &pload );
+
+        return 0;
     }
 
-    outfile = fopen( user.outputfile, "wb" );
+    // with --merkle, the output is hashed as it's written
+    outfile = user.merkle ? merkle_fopen( user.outputfile ) : fopen( user.outputfile, "wb" );
 
     if ( !outfile )
     {
@@ -136,20 +489,43 @@ int main(int argc, char **argv)
         exit( EXIT_FAILURE );
     }
 
-    // hide or recover data, as appropriate
-    mode_action( &data, &pload );
+    // hide or recover data, as appropriate; a streamed recovery writes the
+    // payload as it goes
+    if ( streamed && mode == recover )
+        pload.fp = outfile;
+
+    result = mode_action( &data, &pload );
 
     // we're finished; write to the output file and let the user know what happened
     if ( mode == hide )
     {
+        PROBE1( write_start, 0L );
         result = write_header( outfile, &data );
-        result += write_data( outfile, &data );
+        PROBE2( write_done, 0L, (long)result );
 
-        printf( "[COMPLETE] wrote %d bytes to %s.\n", result, user.outputfile );
+        PROBE1( write_start, (long)result );
+        written = write_data( outfile, &data );
+        PROBE2( write_done, (long)result, (long)written );
+
+        printf( "[COMPLETE] wrote %d bytes to %s.\n", result + written, user.outputfile );
     }
     else
     {
-        result = write_payload( outfile, &pload );
+        if ( pload.fec )
+        {
+            result = fec_decode( &pload );
+
+            if ( result >= 0 )
+                printf( "error correction: %d damaged byte%s repaired.\n", result, (result == 1) ? "" : "s" );
+        }
+
+        if ( !streamed )
+        {
+            PROBE1( write_start, 0L );
+            result = write_payload( outfile, &pload );
+            PROBE2( write_done, 0L, (long)result );
+        }
+
         printf( "[COMPLETE] recovered %d bytes to %s\n", result, user.outputfile );
     }
 
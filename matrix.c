@@ -0,0 +1,214 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, matrix.c
+ *
+ * matrix embedding with binary Hamming codes
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <stdint.h>
+
+/*
+ * plain lsb steganography spends one carrier byte per payload bit, and on
+ * average changes every other one of them.  matrix embedding (Crandall,
+ * Westfeld's F5) trades capacity for fewer changes: the carrier is split into
+ * blocks of n = 2^k - 1 bytes, and each block carries k payload bits as the
+ * syndrome of its lsbs under the (n, n - k) Hamming code,
+ *
+ *     syndrome = XOR of (i + 1) over every byte i of the block whose lsb is 1
+ *
+ * any syndrome can be turned into any other by flipping a single lsb (the
+ * one at index (syndrome ^ message) - 1), so each block costs at most one
+ * change, and none at all 1/2^k of the time.  with k = 3, for example, 3 bits
+ * ride on 7 carrier bytes with 7/8 of a change on average, instead of 1.5.
+ */
+
+// lsb masks for one block (n <= 255 bytes, so four words)
+struct block_lsbs
+{
+    uint64_t w[4];
+};
+
+// hamming[k]: the block positions whose index + 1 has bit k set
+static struct block_lsbs hamming[MATRIX_MAX_K];
+
+static void init_hamming(int k)
+{
+    int i, bit, n = (1 << k) - 1;
+
+    memset( hamming, 0, sizeof(hamming) );
+
+    for ( bit = 0; bit < k; bit++ )
+        for ( i = 0; i < n; i++ )
+            if ( ((i + 1) >> bit) & 1 )
+                hamming[bit].w[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+/*
+ * collect the lsbs of units [u0, u0 + n) into a bit mask.  contiguous bytes
+ * are packed eight at a time: masking each byte down to its lsb and
+ * multiplying by 0x0102040810204080 gathers byte i's lsb into bit 56 + i
+ */
+static void gather_lsbs(struct container *c, long u0, int n, struct block_lsbs *m)
+{
+    unsigned char *q;
+    long run;
+    int stride, i = 0;
+
+    memset( m, 0, sizeof(*m) );
+
+    while ( i < n )
+    {
+        q = carrier_unit( c, u0 + i, &run, &stride );
+
+        if ( run > n - i )
+            run = n - i;
+
+        if ( stride == 1 )
+        {
+            for ( ; run >= 8; run -= 8, q += 8, i += 8 )
+            {
+                uint64_t w, bits;
+
+                memcpy( &w, q, 8 );
+                bits = ((w & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+
+                m->w[i / 64] |= bits << (i % 64);
+
+                // a byte-aligned group can straddle two mask words
+                if ( (i % 64) > 56 )
+                    m->w[i / 64 + 1] |= bits >> (64 - i % 64);
+            }
+        }
+
+        for ( ; run > 0; run--, q += stride, i++ )
+            m->w[i / 64] |= (uint64_t)(*q & 1) << (i % 64);
+    }
+}
+
+/*
+ * one bit of the syndrome per hamming mask: the parity of the lsbs it selects
+ */
+static unsigned syndrome(const struct block_lsbs *m, int k)
+{
+    unsigned s = 0;
+    int bit;
+
+    for ( bit = 0; bit < k; bit++ )
+    {
+        const uint64_t *h = hamming[bit].w;
+        int ones = __builtin_popcountll( m->w[0] & h[0] ) + __builtin_popcountll( m->w[1] & h[1] )
+                 + __builtin_popcountll( m->w[2] & h[2] ) + __builtin_popcountll( m->w[3] & h[3] );
+
+        s |= (ones & 1) << bit;
+    }
+
+    return s;
+}
+
+/*
+ * 'k' payload bits starting at bit 'pos', msb first; zeros past the end
+ */
+static unsigned payload_bits(struct payload *p, long pos, int k)
+{
+    unsigned v = 0;
+    int i;
+
+    for ( i = 0; i < k; i++, pos++ )
+    {
+        v <<= 1;
+
+        if ( pos < 8L * p->size )
+            v |= 1 & (p->bytes[pos / 8] >> (7 - (pos % 8)));
+    }
+
+    return v;
+}
+
+/*
+ * carrier units a 'size'-byte payload needs with k-bit matrix embedding
+ */
+long matrix_units(int size, int k)
+{
+    long blocks = (8L * size + k - 1) / k;
+
+    return blocks * ((1 << k) - 1);
+}
+
+/*
+ * matrix-embedding equivalent of bitmap_cover() and pcm_cover(); works on
+ * either container type.  returns the number of carrier bytes changed
+ */
+int matrix_cover(struct container *c, struct payload *p)
+{
+    int k = p->matrix, n = (1 << k) - 1, changed = 0, stride;
+    long blk, blocks = (8L * p->size + k - 1) / k, run;
+    unsigned s, msg;
+    struct block_lsbs m;
+    unsigned char *q;
+
+    printf( "matrix-embedding bits from %s into %s, %d bits per %d bytes...\n",
+            p->filename, c->filename, k, n );
+
+    init_hamming( k );
+
+    PROBE2( cover_start, 0L, blocks * n );
+
+    for ( blk = 0; blk < blocks; blk++ )
+    {
+        gather_lsbs( c, blk * n, n, &m );
+
+        s   = syndrome( &m, k );
+        msg = payload_bits( p, blk * k, k );
+
+        // the block already says what we want; leave it untouched
+        if ( s == msg )
+            continue;
+
+        q = carrier_unit( c, blk * n + (s ^ msg) - 1, &run, &stride );
+        *q ^= 1;
+        changed++;
+    }
+
+    PROBE3( cover_done, 0L, blocks * n, (long)changed );
+
+    printf( "changed %d of %ld carrier bytes (%.2f payload bits per change).\n",
+            changed, blocks * n, changed ? 8.0 * p->size / changed : 0.0 );
+
+    show_quality( c, changed );
+
+    return changed;
+}
+
+/*
+ * recover a matrix-embedded payload: each block's syndrome is k more bits
+ */
+int matrix_uncover(struct container *c, struct payload *p)
+{
+    int k = p->matrix, n = (1 << k) - 1, i;
+    long blk, blocks = (8L * p->size + k - 1) / k, pos;
+    unsigned s;
+    struct block_lsbs m;
+
+    init_hamming( k );
+
+    memset( p->bytes, 0, p->size );
+
+    PROBE2( uncover_start, 0L, blocks * n );
+
+    for ( blk = 0; blk < blocks; blk++ )
+    {
+        gather_lsbs( c, blk * n, n, &m );
+        s = syndrome( &m, k );
+
+        for ( i = k - 1, pos = blk * k; i >= 0; i--, pos++ )
+            if ( pos < 8L * p->size && ((s >> i) & 1) )
+                p->bytes[pos / 8] |= 1 << (7 - (pos % 8));
+    }
+
+    PROBE2( uncover_done, 0L, blocks * n );
+
+    return 0;
+}
@@ -15,40 +15,20 @@
  *
  * the data structure itself is an array of pointers, each of which
  * points to an array of unsigned chars. thus pixel[i][j] points to the
- * jth byte in the ith row.
+ * jth byte in the ith row.  the rows themselves are carved out of one
+ * contiguous block, laid out exactly as they are in the file.
  */
 void init_pixel_matrix(struct container *c)
 {
     int i;
+    unsigned char *rows;
 
-    // derive a few essential values; see 'bitmap' declaration in steganographer.h
-    c->b->pad    = calculate_padding( c->b->width, c->b->depth );
-    c->b->size   = c->b->depth / 8;
-    c->b->start  = c->b->data_offset;
-    c->b->rowlen = c->b->size * c->b->width + c->b->pad;
+    // storage for each row of pointers, then for all of the rows' elements
+    c->b->pixel = arena_alloc( &job_arena, c->b->height * sizeof(unsigned char *) );
+    rows        = arena_alloc( &job_arena, (size_t)c->b->height * c->b->rowlen );
 
-    // allocate storage for each row of pointers
-    c->b->pixel = malloc( c->b->height * sizeof(unsigned char *) );
-
-    if ( c->b->pixel == NULL )
-    {
-        fprintf( stderr, "[ERROR] init_pixel_matrix: memory allocation failed, aborting.\n" );
-        exit( EXIT_FAILURE );
-    }
-
-    // allocate storage for the elements in each row
-    // (this treats each pad byte as pixel-sized, which may
-    // over-allocate some memory)
     for ( i = 0; i < c->b->height; i++ )
-    {
-        c->b->pixel[i] = malloc( c->b->rowlen * sizeof(unsigned char *) );
-
-        if ( c->b->pixel[i] == NULL )
-        {
-            fprintf( stderr, "[ERROR] init_pixel_matrix: memory allocation failed, aborting.\n" );
-            exit( EXIT_FAILURE );
-        }
-    }
+        c->b->pixel[i] = rows + (size_t)i * c->b->rowlen;
 
     return;
 }
@@ -59,50 +39,34 @@ void init_pixel_matrix(struct container *c)
  */
 void init_sample_storage(struct container *c)
 {
-    c->w->samples = malloc( c->w->subchunk2size * sizeof(unsigned char *) );
-
-    if ( c->w->samples == NULL )
-    {
-        fprintf( stderr, "[ERROR] init_sample_storage: memory allocation failed, aborting.\n" );
-        exit( EXIT_FAILURE );
-    }
+    c->w->samples = arena_alloc( &job_arena, c->w->subchunk2size );
 
     return;
 }
 
+/*
+ * recovery ORs bits into the payload bytes, so they have to start out zeroed
+ * (arena memory is recycled between jobs)
+ */
 void init_payload_storage(struct payload *p)
 {
-    p->bytes = malloc( p->size );
-
-    if ( p->bytes == NULL )
-    {
-        fprintf( stderr, "[ERROR] init_payload_storage: memory allocation failed, aborting.\n" );
-        exit( EXIT_FAILURE );
-    }
+    p->bytes = arena_alloc( &job_arena, p->size );
+    memset( p->bytes, 0, p->size );
 
     return;
 }
 
 /*
  * if you love something, set it free . . .
+ *
+ * everything the job allocated came out of the job arena, so this is a
+ * single reset; the mapping stays around for the next job
  */
 void clean_up(struct container *c, struct payload *p)
 {
-    if ( c->type == bitmap )
-    {
-        int i;
-
-        for ( i = 0; i < c->b->height; i++ )
-            free( c->b->pixel[i] );
-
-        free( c->b->pixel );
-        free( c->b );
-    }
-    else if ( c->type == wavfile )
-    {
-        free( c->w->samples );
-        free( c->w );
-    }
+    c->b = NULL;
+    c->w = NULL;
+    p->bytes = NULL;
 
-    free( p->bytes );
+    arena_reset( &job_arena );
 }
@@ -0,0 +1,680 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, merkle.c
+ *
+ * merkle trees over output files, and verifying against them
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#define _GNU_SOURCE          // for fopencookie()
+#include "steganographer.h"
+#include <fcntl.h>
+#include <unistd.h>          // for pread(), pwrite(), sysconf()
+#include <pthread.h>
+#include <time.h>            // for clock_gettime()
+#include <sys/stat.h>
+
+/*
+ * checking a multi-gigabyte carrier after a copy used to mean a sha256sum of
+ * the whole thing on one core, and a mismatch meant sending all of it again.
+ * with --merkle the output gets a sidecar, <output>.merkle, holding the
+ * SHA-256 of every MERKLE_CHUNK-byte chunk of it and the root of a merkle
+ * tree over them.  verify mode (-V) rehashes the chunks of a copy on every
+ * core and names the ones that differ, which are all that need resending.
+ *
+ * leaves are SHA-256(0x00 || chunk) and inner nodes SHA-256(0x01 || left ||
+ * right), so a leaf can't pass for a node; an odd node out moves up a level
+ * as is.  an empty file has one empty chunk.
+ *
+ * the ordinary hide and recover outputs are hashed as they're written: the
+ * FILE the writers get is a stream whose write function passes the bytes on
+ * to the file and, each time another whole chunk is on disk, hands it to a
+ * pool of hashing threads.  writers mostly go straight through the file, but
+ * a chunk that's written to again after being handed over is marked dirty
+ * and hashed again at the end.  outputs written some other way (--direct,
+ * --checkpoint, migrate) are hashed in parallel once they're complete.
+ */
+
+#define MERKLE_CHUNK  (4L << 20)      // bytes per leaf
+#define MERKLE_MAGIC  "steganographer merkle 1"
+
+/* * * SHA-256 (FIPS 180-4) * * */
+
+struct sha256
+{
+    uint32_t h[8];
+    uint64_t len;             // bytes hashed so far
+    unsigned char buf[64];
+    int  n;                   // bytes waiting in buf
+};
+
+static const uint32_t K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(struct sha256 *s, const unsigned char *b)
+{
+    uint32_t w[64], a, bb, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for ( i = 0; i < 16; i++ )
+        w[i] = (uint32_t)b[4 * i] << 24 | b[4 * i + 1] << 16 | b[4 * i + 2] << 8 | b[4 * i + 3];
+
+    for ( ; i < 64; i++ )
+        w[i] = w[i - 16] + (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3))
+             + w[i - 7]  + (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19)  ^ (w[i - 2] >> 10));
+
+    a = s->h[0]; bb = s->h[1]; c = s->h[2]; d = s->h[3];
+    e = s->h[4]; f  = s->h[5]; g = s->h[6]; h = s->h[7];
+
+    for ( i = 0; i < 64; i++ )
+    {
+        t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & bb) ^ (a & c) ^ (bb & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = bb; bb = a; a = t1 + t2;
+    }
+
+    s->h[0] += a; s->h[1] += bb; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f;  s->h[6] += g; s->h[7] += h;
+}
+
+static void sha256_init(struct sha256 *s)
+{
+    static const uint32_t h0[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+    memcpy( s->h, h0, sizeof(h0) );
+    s->len = 0;
+    s->n   = 0;
+}
+
+static void sha256_update(struct sha256 *s, const unsigned char *b, long len)
+{
+    s->len += len;
+
+    if ( s->n )
+    {
+        for ( ; len > 0 && s->n < 64; len-- )
+            s->buf[s->n++] = *b++;
+
+        if ( s->n < 64 )
+            return;
+
+        sha256_block( s, s->buf );
+        s->n = 0;
+    }
+
+    for ( ; len >= 64; len -= 64, b += 64 )
+        sha256_block( s, b );
+
+    memcpy( s->buf, b, len );
+    s->n = len;
+}
+
+static void sha256_final(struct sha256 *s, unsigned char *out)
+{
+    uint64_t bits = 8 * s->len;
+    int i;
+
+    s->buf[s->n++] = 0x80;
+
+    if ( s->n > 56 )
+    {
+        memset( s->buf + s->n, 0, 64 - s->n );
+        sha256_block( s, s->buf );
+        s->n = 0;
+    }
+
+    memset( s->buf + s->n, 0, 56 - s->n );
+
+    for ( i = 0; i < 8; i++ )
+        s->buf[56 + i] = bits >> (56 - 8 * i);
+
+    sha256_block( s, s->buf );
+
+    for ( i = 0; i < 32; i++ )
+        out[i] = s->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+/* * * the tree * * */
+
+/*
+ * leaf hash of chunk 'i' of the file on 'fd', read through 'buf'
+ */
+static void hash_chunk(int fd, long i, long chunk, unsigned char *buf, unsigned char *leaf)
+{
+    struct sha256 s;
+    unsigned char tag = 0x00;
+    long n, got = 0;
+
+    while ( got < chunk && (n = pread(fd, buf + got, chunk - got, i * chunk + got)) > 0 )
+        got += n;
+
+    sha256_init( &s );
+    sha256_update( &s, &tag, 1 );
+    sha256_update( &s, buf, got );
+    sha256_final( &s, leaf );
+}
+
+/*
+ * fold 'n' leaves into the root; 'scratch' has room for n hashes
+ */
+static void merkle_root(unsigned char (*leaf)[32], long n, unsigned char (*scratch)[32], unsigned char *root)
+{
+    struct sha256 s;
+    unsigned char tag = 0x01;
+    long i;
+
+    memcpy( scratch, leaf, n * 32 );
+
+    for ( ; n > 1; n = (n + 1) / 2 )
+    {
+        for ( i = 0; i < n / 2; i++ )
+        {
+            sha256_init( &s );
+            sha256_update( &s, &tag, 1 );
+            sha256_update( &s, scratch[2 * i], 64 );
+            sha256_final( &s, scratch[i] );
+        }
+
+        if ( n % 2 )
+            memcpy( scratch[n / 2], scratch[n - 1], 32 );
+    }
+
+    memcpy( root, scratch[0], 32 );
+}
+
+static void put_hex(FILE *f, const unsigned char *h)
+{
+    int i;
+
+    for ( i = 0; i < 32; i++ )
+        fprintf( f, "%02x", h[i] );
+
+    fputc( '\n', f );
+}
+
+static int get_hex(FILE *f, unsigned char *h)
+{
+    int i;
+    unsigned int x;
+
+    for ( i = 0; i < 32; i++ )
+        if ( fscanf(f, " %2x", &x) != 1 )
+            return 0;
+        else
+            h[i] = x;
+
+    return 1;
+}
+
+/*
+ * the sidecar: a few header lines, the root, then one leaf per line
+ */
+static void write_sidecar(const char *path, long size, long chunk, unsigned char (*leaf)[32], long n)
+{
+    char name[MAX_FILENAME_LENGTH + 16];
+    unsigned char root[32], (*scratch)[32] = malloc( n * 32 );
+    FILE *f;
+    long i;
+
+    snprintf( name, sizeof(name), "%s.merkle", path );
+
+    if ( !scratch || !(f = fopen(name, "w")) )
+    {
+        fprintf( stderr, "[ERROR] could not write %s: %s, aborting.\n", name, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    merkle_root( leaf, n, scratch, root );
+
+    fprintf( f, MERKLE_MAGIC "\nchunk %ld\nsize %ld\nroot ", chunk, size );
+    put_hex( f, root );
+
+    for ( i = 0; i < n; i++ )
+        put_hex( f, leaf[i] );
+
+    if ( fclose(f) != 0 )
+    {
+        fprintf( stderr, "[ERROR] could not write %s: %s, aborting.\n", name, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    printf( "merkle: %ld chunk%s of %s hashed into %s\n", n, (n == 1) ? "" : "s", path, name );
+
+    free( scratch );
+}
+
+static long chunks_in(long size, long chunk)
+{
+    return (size > 0) ? (size + chunk - 1) / chunk : 1;
+}
+
+/* * * hashing a whole file on every core * * */
+
+struct hash_job
+{
+    int  fd;
+    long chunk;
+    long n;                   // chunks
+    long next;                // next chunk to take
+    unsigned char (*leaf)[32];
+    unsigned char *buf;       // a chunk's worth per thread
+    int  nbuf;                // buffers handed out so far
+};
+
+static void *hash_worker(void *arg)
+{
+    struct hash_job *job = arg;
+    unsigned char *buf = job->buf + __sync_fetch_and_add( &job->nbuf, 1 ) * job->chunk;
+    long i;
+
+    while ( (i = __sync_fetch_and_add(&job->next, 1)) < job->n )
+        hash_chunk( job->fd, i, job->chunk, buf, job->leaf[i] );
+
+    return NULL;
+}
+
+/*
+ * leaf hashes of every chunk of 'fd', 'threads' at a time (0: one per cpu)
+ */
+static void hash_file(int fd, long n, long chunk, unsigned char (*leaf)[32], int threads)
+{
+    struct hash_job job = { fd, chunk, n, 0, leaf, NULL, 0 };
+    pthread_t *tid;
+    int i;
+
+    if ( threads <= 0 )
+        threads = sysconf( _SC_NPROCESSORS_ONLN );
+
+    if ( threads > n )
+        threads = n;
+
+    job.buf = arena_alloc( &job_arena, threads * chunk );
+
+    if ( threads <= 1 )
+    {
+        hash_worker( &job );
+        return;
+    }
+
+    tid = arena_alloc( &job_arena, threads * sizeof(*tid) );
+
+    for ( i = 0; i < threads; i++ )
+        pthread_create( &tid[i], NULL, hash_worker, &job );
+
+    for ( i = 0; i < threads; i++ )
+        pthread_join( tid[i], NULL );
+}
+
+static int open_or_die(const char *path, long *size)
+{
+    struct stat st;
+    int fd = open( path, O_RDONLY );
+
+    if ( fd < 0 || fstat(fd, &st) != 0 )
+    {
+        fprintf( stderr, "[ERROR] could not open %s: %s\nAborting.\n", path, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    *size = st.st_size;
+
+    return fd;
+}
+
+/*
+ * write <path>.merkle for a file that's already complete
+ */
+void merkle_file(const char *path, int threads)
+{
+    unsigned char (*leaf)[32];
+    long size, n;
+    int fd = open_or_die( path, &size );
+
+    n    = chunks_in( size, MERKLE_CHUNK );
+    leaf = arena_alloc( &job_arena, n * 32 );
+
+    hash_file( fd, n, MERKLE_CHUNK, leaf, threads );
+    close( fd );
+
+    write_sidecar( path, size, MERKLE_CHUNK, leaf, n );
+}
+
+/* * * hashing while writing * * */
+
+struct merkle_writer
+{
+    char path[MAX_FILENAME_LENGTH + 1];
+    int  fd;
+    long pos;                 // where the next write goes
+    long end;                 // file size so far
+    long queued;              // chunks handed to the hashing threads
+    long taken;               // ... and picked up by one
+    long cap;                 // room in leaf[] and dirty[]
+    unsigned char (*leaf)[32];
+    unsigned char *dirty;     // written to again after being queued
+    int  closing;
+    int  threads;
+    pthread_t *tid;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+};
+
+// make room for chunk n; called with the lock held
+static void grow(struct merkle_writer *m, long n)
+{
+    long cap = m->cap;
+
+    if ( n < cap )
+        return;
+
+    while ( cap <= n )
+        cap = cap ? 2 * cap : 64;
+
+    m->leaf  = realloc( m->leaf, cap * 32 );
+    m->dirty = realloc( m->dirty, cap );
+
+    if ( !m->leaf || !m->dirty )
+    {
+        fprintf( stderr, "[ERROR] out of memory hashing %s, aborting.\n", m->path );
+        exit( EXIT_FAILURE );
+    }
+
+    memset( m->dirty + m->cap, 0, cap - m->cap );
+    m->cap = cap;
+}
+
+static void *writer_worker(void *arg)
+{
+    struct merkle_writer *m = arg;
+    unsigned char *buf = malloc( MERKLE_CHUNK ), leaf[32];
+    long i;
+
+    if ( !buf )
+    {
+        fprintf( stderr, "[ERROR] out of memory hashing %s, aborting.\n", m->path );
+        exit( EXIT_FAILURE );
+    }
+
+    pthread_mutex_lock( &m->lock );
+
+    while ( 1 )
+    {
+        while ( m->taken == m->queued && !m->closing )
+            pthread_cond_wait( &m->work, &m->lock );
+
+        if ( m->taken == m->queued )
+            break;
+
+        i = m->taken++;
+        pthread_mutex_unlock( &m->lock );
+
+        hash_chunk( m->fd, i, MERKLE_CHUNK, buf, leaf );
+
+        pthread_mutex_lock( &m->lock );
+        memcpy( m->leaf[i], leaf, 32 );
+    }
+
+    pthread_mutex_unlock( &m->lock );
+    free( buf );
+
+    return NULL;
+}
+
+static ssize_t writer_write(void *cookie, const char *buf, size_t size)
+{
+    struct merkle_writer *m = cookie;
+    long n, done = 0, i;
+
+    while ( done < (long)size )
+    {
+        n = pwrite( m->fd, buf + done, size - done, m->pos + done );
+
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+
+            return (done > 0) ? done : -1;
+        }
+
+        done += n;
+    }
+
+    pthread_mutex_lock( &m->lock );
+
+    // queued chunks this write landed in have to be hashed again
+    for ( i = m->pos / MERKLE_CHUNK; i < m->queued && i * MERKLE_CHUNK < m->pos + done; i++ )
+        m->dirty[i] = 1;
+
+    m->pos += done;
+    m->end  = (m->pos > m->end) ? m->pos : m->end;
+
+    if ( m->end / MERKLE_CHUNK > m->queued )
+    {
+        grow( m, m->end / MERKLE_CHUNK );
+        m->queued = m->end / MERKLE_CHUNK;
+        pthread_cond_broadcast( &m->work );
+    }
+
+    pthread_mutex_unlock( &m->lock );
+
+    return done;
+}
+
+static int writer_seek(void *cookie, off64_t *offset, int whence)
+{
+    struct merkle_writer *m = cookie;
+    long base = (whence == SEEK_SET) ? 0 : (whence == SEEK_CUR) ? m->pos : m->end;
+
+    if ( base + *offset < 0 )
+        return -1;
+
+    m->pos  = base + *offset;
+    *offset = m->pos;
+
+    return 0;
+}
+
+/*
+ * queue the last, partial chunk, wait for the hashing threads, rehash any
+ * dirty chunks and write the sidecar
+ */
+static int writer_close(void *cookie)
+{
+    struct merkle_writer *m = cookie;
+    unsigned char *buf;
+    long n, i;
+    int t;
+
+    pthread_mutex_lock( &m->lock );
+
+    n = chunks_in( m->end, MERKLE_CHUNK );
+    grow( m, n );
+    m->queued  = n;
+    m->closing = 1;
+    pthread_cond_broadcast( &m->work );
+
+    pthread_mutex_unlock( &m->lock );
+
+    for ( t = 0; t < m->threads; t++ )
+        pthread_join( m->tid[t], NULL );
+
+    buf = malloc( MERKLE_CHUNK );
+
+    for ( i = 0; i < n; i++ )
+        if ( m->dirty[i] && buf )
+            hash_chunk( m->fd, i, MERKLE_CHUNK, buf, m->leaf[i] );
+
+    if ( !buf || close(m->fd) != 0 )
+    {
+        fprintf( stderr, "[ERROR] could not finish %s: %s, aborting.\n", m->path, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    write_sidecar( m->path, m->end, MERKLE_CHUNK, m->leaf, n );
+
+    pthread_mutex_destroy( &m->lock );
+    pthread_cond_destroy( &m->work );
+
+    free( buf );
+    free( m->leaf );
+    free( m->dirty );
+    free( m->tid );
+    free( m );
+
+    return 0;
+}
+
+/*
+ * fopen( path, "wb" ), except that the file is hashed as it's written and
+ * fclose() leaves a <path>.merkle beside it; NULL (with errno set) on failure
+ */
+FILE *merkle_fopen(const char *path)
+{
+    cookie_io_functions_t io = { NULL, writer_write, writer_seek, writer_close };
+    struct merkle_writer *m = calloc( 1, sizeof(*m) );
+    FILE *f;
+    int t;
+
+    if ( !m )
+        return NULL;
+
+    // the hashing threads read back what's been written
+    m->fd = open( path, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+
+    if ( m->fd < 0 )
+    {
+        free( m );
+        return NULL;
+    }
+
+    strncpy( m->path, path, MAX_FILENAME_LENGTH );
+
+    m->threads = sysconf( _SC_NPROCESSORS_ONLN );
+    m->threads = (m->threads > 1) ? m->threads : 1;
+    m->tid     = malloc( m->threads * sizeof(*m->tid) );
+
+    pthread_mutex_init( &m->lock, NULL );
+    pthread_cond_init( &m->work, NULL );
+
+    for ( t = 0; t < m->threads; t++ )
+        pthread_create( &m->tid[t], NULL, writer_worker, m );
+
+    f = fopencookie( m, "wb", io );
+
+    // whole chunks reach writer_write() in a few large pieces
+    if ( f )
+        setvbuf( f, NULL, _IOFBF, 1 << 20 );
+
+    return f;
+}
+
+/* * * verification * * */
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * check 'path' against <path>.merkle with 'threads' threads (0: one per
+ * cpu), listing the chunks that differ; returns how many do
+ */
+long merkle_verify(const char *path, int threads)
+{
+    char name[MAX_FILENAME_LENGTH + 16], magic[64];
+    unsigned char root[32], check[32], (*want)[32], (*have)[32], (*scratch)[32];
+    long size, want_size, chunk, n, m, i, bad = 0;
+    double t0;
+    FILE *f;
+    int fd;
+
+    snprintf( name, sizeof(name), "%s.merkle", path );
+
+    if ( !(f = fopen(name, "r")) )
+    {
+        fprintf( stderr, "[ERROR] could not open %s: %s\nAborting.\n", name, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( !fgets(magic, sizeof(magic), f) || strncmp(magic, MERKLE_MAGIC, strlen(MERKLE_MAGIC)) != 0
+      || fscanf(f, " chunk %ld size %ld root", &chunk, &want_size) != 2 || !get_hex(f, root)
+      || chunk <= 0 || want_size < 0 )
+    {
+        fprintf( stderr, "[ERROR] %s is not a merkle sidecar, aborting.\n", name );
+        exit( EXIT_FAILURE );
+    }
+
+    m       = chunks_in( want_size, chunk );
+    want    = arena_alloc( &job_arena, m * 32 );
+    scratch = arena_alloc( &job_arena, m * 32 );
+
+    for ( i = 0; i < m; i++ )
+    {
+        if ( !get_hex(f, want[i]) )
+        {
+            fprintf( stderr, "[ERROR] %s ends after %ld of its %ld chunk hashes, aborting.\n", name, i, m );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    fclose( f );
+
+    // a sidecar that's been damaged itself can't vouch for anything
+    merkle_root( want, m, scratch, check );
+
+    if ( memcmp(check, root, 32) != 0 )
+    {
+        fprintf( stderr, "[ERROR] the chunk hashes in %s don't match its root; the sidecar is damaged, aborting.\n", name );
+        exit( EXIT_FAILURE );
+    }
+
+    fd   = open_or_die( path, &size );
+    n    = chunks_in( size, chunk );
+    have = arena_alloc( &job_arena, n * 32 );
+
+    t0 = now();
+    hash_file( fd, n, chunk, have, threads );
+    t0 = now() - t0;
+
+    close( fd );
+
+    printf( "verified %ld MB of %s in %.2f s (%.0f MB/s)\n", size >> 20, path, t0,
+            (t0 > 0) ? size / t0 / (1 << 20) : 0.0 );
+
+    if ( size != want_size )
+        printf( "%s: %ld bytes, but %ld were hashed into %s\n", path, size, want_size, name );
+
+    size = (size > want_size) ? size : want_size;
+
+    for ( i = 0; i < ((n > m) ? n : m); i++ )
+    {
+        if ( i < n && i < m && memcmp(have[i], want[i], 32) == 0 )
+            continue;
+
+        printf( "chunk %ld (bytes %ld to %ld) %s\n", i, i * chunk,
+                (((i + 1) * chunk < size) ? (i + 1) * chunk : size) - 1,
+                (i >= n) ? "is missing" : (i >= m) ? "wasn't hashed" : "differs" );
+        bad++;
+    }
+
+    return bad;
+}
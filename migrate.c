@@ -0,0 +1,427 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, migrate.c
+ *
+ * move a hidden payload from one carrier to another
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <fcntl.h>
+#include <unistd.h>          // for pread()
+#include <pthread.h>
+#include <sys/stat.h>        // for fstat()
+
+/*
+ * moving hidden data to a fresh carrier used to take a recover into a file
+ * and a hide from it: the payload sat on disk in the clear in between, and
+ * both carriers were loaded whole.  migrate mode streams instead.  an
+ * extractor thread reads the old carrier MIGRATE_CHUNK bytes at a time and
+ * pulls the hidden bits out with uncover_units(), pushing payload bytes into
+ * a MIGRATE_FIFO-byte fifo; the main thread pops them as the new carrier
+ * streams past, embeds them with cover_units() and writes each chunk out.
+ * memory stays at a few chunks however big the carriers, and the payload
+ * never touches the disk.
+ *
+ * each chunk is handed to the engine as a window: a stand-in container whose
+ * layout covers just the units in the chunk and whose data is the chunk
+ * buffer.  windows start at a run (a bitmap row) or, for single-run carriers
+ * (WAV), at a group, and hold a multiple of 8 units, so they line up with
+ * payload bytes.  either carrier can be a bitmap or a WAV file.
+ */
+
+#define MIGRATE_CHUNK  (8L << 20)    // carrier bytes per chunk, roughly
+#define MIGRATE_FIFO   (1L << 20)    // payload bytes in flight between the threads
+
+// a chunk of a carrier, in a form the engine can work on
+struct window
+{
+    struct container c;       // layout restricted to the chunk's units
+    struct bitmap b;
+    struct pcm w;
+    unsigned char *row;       // carrier_base() for bitmaps is pixel[0]
+    long start, end;          // file bytes [start, end) the units lie in
+};
+
+// payload bytes on their way from the old carrier to the new one
+struct fifo
+{
+    unsigned char buf[MIGRATE_FIFO];
+    long head, tail;          // bytes pushed and popped so far
+    pthread_mutex_t lock;
+    pthread_cond_t  moved;
+};
+
+struct extractor
+{
+    struct container *c;
+    struct fifo *f;
+    long total;               // units (payload bits) to extract
+    int  fd;
+};
+
+/*
+ * units per chunk: a multiple of 8 runs, or with only one run, of 8 groups
+ */
+static long chunk_units(struct container *c)
+{
+    struct layout *l = &c->layout;
+    long n;
+
+    if ( l->runs > 1 )
+    {
+        n = MIGRATE_CHUNK / l->run_stride / 8 * 8;
+        return ((n > 8) ? n : 8) * l->run_units;
+    }
+
+    n = MIGRATE_CHUNK / l->stride / 8 * 8;
+
+    return ((n > 8) ? n : 8) * l->lanes;
+}
+
+/*
+ * set w up to stand in for units [u0, u1) of c; u0 has to be a multiple of
+ * chunk_units(c).  the chunk's data still has to be attached
+ */
+static void make_window(struct container *c, long u0, long u1, struct window *w)
+{
+    struct layout *l = &w->c.layout;
+
+    w->c = *c;
+
+    if ( c->layout.runs > 1 )
+    {
+        l->offset = c->layout.offset + (u0 / c->layout.run_units) * c->layout.run_stride;
+        l->runs   = (u1 - 1) / c->layout.run_units - u0 / c->layout.run_units + 1;
+        w->end    = l->offset + (l->runs - 1) * l->run_stride + l->groups * l->stride;
+    }
+    else
+    {
+        l->offset = c->layout.offset + (u0 / c->layout.lanes) * c->layout.stride;
+        l->groups = (u1 - u0 + c->layout.lanes - 1) / c->layout.lanes;
+        w->end    = l->offset + l->groups * l->stride;
+    }
+
+    w->start = l->offset;
+
+    set_layout( l );
+}
+
+static void attach(struct window *w, unsigned char *data)
+{
+    if ( w->c.type == bitmap )
+    {
+        w->b      = *w->c.b;
+        w->row    = data;
+        w->b.pixel = &w->row;
+        w->c.b    = &w->b;
+    }
+    else
+    {
+        w->w         = *w->c.w;
+        w->w.samples = data;
+        w->c.w       = &w->w;
+    }
+}
+
+static void fifo_push(struct fifo *f, const unsigned char *b, long n)
+{
+    pthread_mutex_lock( &f->lock );
+
+    while ( n > 0 )
+    {
+        while ( f->head - f->tail == MIGRATE_FIFO )
+            pthread_cond_wait( &f->moved, &f->lock );
+
+        for ( ; n > 0 && f->head - f->tail < MIGRATE_FIFO; n-- )
+            f->buf[f->head++ % MIGRATE_FIFO] = *b++;
+
+        pthread_cond_broadcast( &f->moved );
+    }
+
+    pthread_mutex_unlock( &f->lock );
+}
+
+static void fifo_pop(struct fifo *f, unsigned char *b, long n)
+{
+    pthread_mutex_lock( &f->lock );
+
+    while ( n > 0 )
+    {
+        while ( f->head == f->tail )
+            pthread_cond_wait( &f->moved, &f->lock );
+
+        for ( ; n > 0 && f->tail < f->head; n-- )
+            *b++ = f->buf[f->tail++ % MIGRATE_FIFO];
+
+        pthread_cond_broadcast( &f->moved );
+    }
+
+    pthread_mutex_unlock( &f->lock );
+}
+
+static void read_fully(int fd, unsigned char *buf, long len, long pos, const char *name)
+{
+    long n;
+
+    for ( ; len > 0; len -= n, buf += n, pos += n )
+    {
+        n = pread( fd, buf, len, pos );
+
+        if ( n <= 0 )
+        {
+            fprintf( stderr, "[ERROR] %s: short read at byte %ld, aborting.\n", name, pos );
+            exit( EXIT_FAILURE );
+        }
+    }
+}
+
+/*
+ * the first pipeline stage: pull the hidden stream out of the old carrier,
+ * chunk by chunk, into the fifo
+ */
+static void *extract(void *arg)
+{
+    struct extractor *x = arg;
+    struct window w;
+    struct payload p;
+    long step = chunk_units( x->c ), u0, u1;
+    unsigned char *data = NULL;
+    long alloc = 0;
+
+    memset( &p, 0, sizeof(p) );
+    p.bytes = malloc( step / 8 );
+
+    for ( u0 = 0; u0 < x->total; u0 = u1 )
+    {
+        u1 = (x->total - u0 < step) ? x->total : u0 + step;
+
+        make_window( x->c, u0, u1, &w );
+
+        if ( w.end - w.start > alloc )
+        {
+            alloc = w.end - w.start;
+            data  = realloc( data, alloc );
+        }
+
+        read_fully( x->fd, data, w.end - w.start, w.start, x->c->filename );
+        attach( &w, data );
+
+        p.size = (u1 - u0) / 8;
+        memset( p.bytes, 0, p.size );
+
+        uncover_units( &w.c, &p, 0, u1 - u0 );
+
+        fifo_push( x->f, p.bytes, p.size );
+    }
+
+    free( data );
+    free( p.bytes );
+
+    return NULL;
+}
+
+/*
+ * move the 'size'-byte stream hidden in 'from' into 'to', writing the result
+ * to 'outname'.  both containers have their headers loaded.  the output is
+ * written to <outname>.tmp and renamed into place once it's complete, so a
+ * failed job never leaves a half-written file where a good one was.  returns
+ * the number of bytes written
+ */
+static long stream(struct container *from, struct container *to, int size, const char *outname)
+{
+    struct extractor x;
+    struct fifo *f;
+    struct window w;
+    struct payload p;
+    pthread_t tid;
+    long step = chunk_units( to ), total = 8L * size, end = carrier_data_end( to ), pos = 0, u0, u1, len;
+    long changed = 0, alloc = MIGRATE_CHUNK;
+    unsigned char *data;
+    char tmp[MAX_FILENAME_LENGTH + 16];
+    int in, out;
+
+    snprintf( tmp, sizeof(tmp), "%s.tmp", outname );
+
+    in  = open( to->filename, O_RDONLY );
+    out = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+
+    if ( in < 0 || out < 0 )
+    {
+        fprintf( stderr, "[ERROR] could not open %s: %s\n", (in < 0) ? to->filename : tmp, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    f = malloc( sizeof(*f) );
+    f->head = f->tail = 0;
+    pthread_mutex_init( &f->lock, NULL );
+    pthread_cond_init( &f->moved, NULL );
+
+    x.c     = from;
+    x.f     = f;
+    x.total = total;
+    x.fd    = fileno( from->fp );
+
+    pthread_create( &tid, NULL, extract, &x );
+
+    memset( &p, 0, sizeof(p) );
+    p.bytes = malloc( step / 8 );
+    data    = malloc( alloc );
+
+    printf( "moving %d bytes hidden in %s into %s...\n", size, from->filename, to->filename );
+
+    // each chunk is read from where the last one ended, so the header and
+    // the bytes between units go through as they are
+    for ( u0 = 0; u0 < total; u0 = u1 )
+    {
+        u1 = (total - u0 < step) ? total : u0 + step;
+
+        make_window( to, u0, u1, &w );
+
+        len = w.end - pos;
+
+        if ( len > alloc )
+        {
+            alloc = len;
+            data  = realloc( data, alloc );
+        }
+
+        read_fully( in, data, len, pos, to->filename );
+        attach( &w, data + (w.start - pos) );
+
+        p.size = (u1 - u0) / 8;
+        fifo_pop( f, p.bytes, p.size );
+
+        changed += cover_units( &w.c, &p, 0, u1 - u0 );
+
+        PROBE1( write_start, pos );
+
+        if ( write(out, data, len) != len )
+            goto WRITE_ERROR;
+
+        PROBE2( write_done, pos, len );
+
+        pos = w.end;
+    }
+
+    pthread_join( tid, NULL );
+
+    // the rest of the new carrier, untouched
+    for ( ; pos < end; pos += len )
+    {
+        len = (end - pos < alloc) ? end - pos : alloc;
+
+        read_fully( in, data, len, pos, to->filename );
+
+        PROBE1( write_start, pos );
+
+        if ( write(out, data, len) != len )
+            goto WRITE_ERROR;
+
+        PROBE2( write_done, pos, len );
+    }
+
+    printf( "%ld carrier bytes changed.\n", changed );
+
+    close( in );
+
+    if ( close(out) != 0 || rename(tmp, outname) != 0 )
+        goto WRITE_ERROR;
+
+    pthread_mutex_destroy( &f->lock );
+    pthread_cond_destroy( &f->moved );
+
+    free( f );
+    free( p.bytes );
+    free( data );
+
+    return end;
+
+WRITE_ERROR:
+    fprintf( stderr, "[ERROR] could not write %s: %s\n", outname, strerror(errno) );
+    unlink( tmp );
+    exit( EXIT_FAILURE );
+}
+
+static int same_file(FILE *fp, const struct stat *st)
+{
+    struct stat fp_st;
+
+    return fstat( fileno(fp), &fp_st ) == 0 && fp_st.st_dev == st->st_dev && fp_st.st_ino == st->st_ino;
+}
+
+/*
+ * migrate mode: move the payload hidden in u->basefile into the fresh carrier
+ * u->destfile, saving the result as u->outputfile.  returns the number of
+ * bytes written
+ */
+long migrate(struct user_input *u)
+{
+    struct container from, to;
+    struct payload p;
+    struct stat out_st;
+    long result;
+
+    memset( &from, 0, sizeof(from) );
+    memset( &to, 0, sizeof(to) );
+    memset( &p, 0, sizeof(p) );
+
+    from.type = find_type( u->basefile );
+    to.type   = find_type( u->destfile );
+
+    if ( from.type < 0 || to.type < 0 )
+    {
+        fprintf( stderr, "[ERROR] unknown data type, aborting.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    // compressed carriers can't be worked on a chunk at a time
+    if ( from.type == pngfile || to.type == pngfile || from.type == jpegfile || to.type == jpegfile )
+    {
+        fprintf( stderr, "[ERROR] PNG and JPEG carriers can't be migrated, aborting.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    from.fp = open_file( u->basefile, &from.filename );
+    to.fp   = open_file( u->destfile, &to.filename );
+
+    // the output replaces its file only once it's complete, but writing over
+    // either carrier is still a mistake: the old one holds the only copy of
+    // the payload, and the new one would be gone for good
+    if ( stat(u->outputfile, &out_st) == 0 && (same_file(from.fp, &out_st) || same_file(to.fp, &out_st)) )
+    {
+        fprintf( stderr, "[ERROR] %s would overwrite a carrier it's made from, aborting.\n", u->outputfile );
+        exit( EXIT_FAILURE );
+    }
+
+    // the old carrier's callbacks are only needed for its header
+    bind_carrier( &from, u->channels, 0 );
+    get_info( &from );
+
+    bind_carrier( &to, u->channels, 0 );
+    get_info( &to );
+
+    // the hidden stream moves as it is, parity and all
+    strcpy( p.filename, from.filename );
+    p.datasize = u->payload_size;
+    p.size     = fec_encoded_size( p.datasize, u->fec );
+
+    if ( p.size > carrier_capacity(&from) )
+    {
+        fprintf( stderr, "[ERROR] %s can only hold %d bytes, not %d; check -s, aborting.\n",
+                 from.filename, carrier_capacity(&from), p.size );
+        exit( EXIT_FAILURE );
+    }
+
+    validate_data( &to, &p );
+
+    result = stream( &from, &to, p.size, u->outputfile );
+
+    fclose( from.fp );
+    fclose( to.fp );
+
+    clean_up( &to, &p );
+
+    return result;
+}
@@ -0,0 +1,355 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, numa.c
+ *
+ * NUMA-aware threaded loading and embedding of big carriers
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#define _GNU_SOURCE          // for CPU_SET(), pthread_setaffinity_np()
+#include "steganographer.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>          // for pread(), sysconf()
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>     // for SYS_move_pages
+
+/*
+ * linux places a page on the node of the cpu that first touches it, so a
+ * carrier read in by one thread ends up on one socket and every other socket
+ * works on it over the interconnect.  with -j, the carrier is split into one
+ * slice per thread, threads are pinned to the cpus of a node (slices are
+ * dealt out to nodes in order, so each node gets one contiguous stretch),
+ * and each thread reads its own slice from the file -- the first touch -- and
+ * later embeds into, or extracts from, that same slice.
+ *
+ * slices are cut at unit numbers that are multiples of 8 * lanes, so every
+ * slice starts a group (no two threads share carrier bytes) and a payload
+ * byte (no two threads share payload bytes).
+ *
+ * the nodes and their cpus come from sysfs; without it everything is one
+ * node.  placement is checked afterwards with move_pages(2) and reported.
+ */
+
+#define NUMA_MAX_NODES   64
+#define NUMA_MAX_SAMPLES 4096    // pages sampled per slice for the placement report
+
+struct numa_slice
+{
+    long u0, u1;              // carrier units [u0, u1)
+    long b0, b1;              // bytes [b0, b1) of the loaded carrier
+    int  node;
+};
+
+struct numa_plan
+{
+    int nodes;
+    cpu_set_t cpus[NUMA_MAX_NODES];
+
+    int nslices;
+    struct numa_slice *slice;
+};
+
+// what a worker thread is asked to do with its slice
+struct numa_task
+{
+    struct container *c;
+    struct payload *p;
+    struct numa_slice *s;
+    cpu_set_t *cpus;
+    int  fd;
+    enum { numa_load_slice, numa_cover_slice, numa_uncover_slice } job;
+    long done;
+};
+
+/*
+ * parse a sysfs cpu list ("0-7,16-23") into a cpu set
+ */
+static void parse_cpulist(const char *s, cpu_set_t *set)
+{
+    int a, b;
+    char *end;
+
+    CPU_ZERO( set );
+
+    while ( *s )
+    {
+        if ( !isdigit((unsigned char)*s) )
+        {
+            s++;
+            continue;
+        }
+
+        a = b = strtol( s, &end, 10 );
+        s = end;
+
+        if ( *s == '-' )
+        {
+            b = strtol( s + 1, &end, 10 );
+            s = end;
+        }
+
+        for ( ; a <= b && a < CPU_SETSIZE; a++ )
+            CPU_SET( a, set );
+    }
+}
+
+/*
+ * find the memory nodes and their cpus, restricted to the cpus we may run on
+ */
+static void find_nodes(struct numa_plan *plan)
+{
+    cpu_set_t allowed, set;
+    char path[64], line[4096];
+    FILE *f;
+    int n;
+
+    sched_getaffinity( 0, sizeof(allowed), &allowed );
+
+    plan->nodes = 0;
+
+    for ( n = 0; n < NUMA_MAX_NODES; n++ )
+    {
+        snprintf( path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n );
+
+        if ( (f = fopen(path, "r")) == NULL )
+            continue;
+
+        if ( fgets(line, sizeof(line), f) )
+        {
+            parse_cpulist( line, &set );
+            CPU_AND( &set, &set, &allowed );
+
+            // memory-only nodes have no cpus to run our threads
+            if ( CPU_COUNT(&set) > 0 )
+                plan->cpus[plan->nodes++] = set;
+        }
+
+        fclose( f );
+    }
+
+    if ( plan->nodes == 0 )
+    {
+        plan->cpus[0] = allowed;
+        plan->nodes   = 1;
+    }
+}
+
+static void *numa_worker(void *arg)
+{
+    struct numa_task *t = arg;
+    struct numa_slice *s = t->s;
+    unsigned char *base = (t->c->type == bitmap) ? t->c->b->pixel[0] : t->c->w->samples;
+    long u1 = s->u1, n;
+
+    pthread_setaffinity_np( pthread_self(), sizeof(*t->cpus), t->cpus );
+
+    switch ( t->job )
+    {
+        case numa_load_slice:
+
+            for ( t->done = 0; t->done < s->b1 - s->b0; t->done += n )
+            {
+                n = pread( t->fd, base + s->b0 + t->done, s->b1 - s->b0 - t->done,
+                           t->c->layout.offset + s->b0 + t->done );
+
+                if ( n <= 0 )
+                    break;
+            }
+            break;
+
+        case numa_cover_slice:
+        case numa_uncover_slice:
+
+            // the last slices can lie past the end of the payload
+            if ( u1 > 8L * t->p->size )
+                u1 = 8L * t->p->size;
+
+            if ( s->u0 >= u1 )
+                break;
+
+            if ( t->job == numa_cover_slice )
+                t->done = cover_units( t->c, t->p, s->u0, u1 );
+            else
+                uncover_units( t->c, t->p, s->u0, u1 );
+            break;
+    }
+
+    return NULL;
+}
+
+/*
+ * run 'job' on every slice, one pinned thread each; returns the sum of the
+ * threads' 'done' counts (bytes loaded, or lsbs flipped)
+ */
+static long run_slices(struct container *c, struct payload *p, int job)
+{
+    struct numa_plan *plan = c->numa;
+    struct numa_task *task;
+    pthread_t *tid;
+    long done = 0;
+    int i, fd = -1;
+
+    task = arena_alloc( &job_arena, plan->nslices * sizeof(*task) );
+    tid  = arena_alloc( &job_arena, plan->nslices * sizeof(*tid) );
+
+    if ( job == numa_load_slice )
+        fd = fileno( c->fp );
+
+    for ( i = 0; i < plan->nslices; i++ )
+    {
+        task[i].c    = c;
+        task[i].p    = p;
+        task[i].s    = &plan->slice[i];
+        task[i].cpus = &plan->cpus[plan->slice[i].node];
+        task[i].fd   = fd;
+        task[i].job  = job;
+        task[i].done = 0;
+
+        pthread_create( &tid[i], NULL, numa_worker, &task[i] );
+    }
+
+    for ( i = 0; i < plan->nslices; i++ )
+    {
+        pthread_join( tid[i], NULL );
+        done += task[i].done;
+    }
+
+    return done;
+}
+
+/*
+ * sample where the pages of each slice actually landed, and print the
+ * fraction of the carrier on each node
+ */
+static void show_placement(struct container *c)
+{
+    struct numa_plan *plan = c->numa;
+    unsigned char *base = (c->type == bitmap) ? c->b->pixel[0] : c->w->samples;
+    long pagesize = sysconf( _SC_PAGESIZE ), bytes[NUMA_MAX_NODES + 1], total = 0;
+    void *pages[NUMA_MAX_SAMPLES];
+    int status[NUMA_MAX_SAMPLES];
+    long step, npages, k, len;
+    int i, n, count;
+
+    memset( bytes, 0, sizeof(bytes) );
+
+    for ( i = 0; i < plan->nslices; i++ )
+    {
+        struct numa_slice *s = &plan->slice[i];
+
+        len = s->b1 - s->b0;
+
+        if ( len <= 0 )
+            continue;
+
+        npages = (len + pagesize - 1) / pagesize;
+        step   = (npages + NUMA_MAX_SAMPLES - 1) / NUMA_MAX_SAMPLES;
+
+        for ( k = 0, count = 0; k < npages && count < NUMA_MAX_SAMPLES; k += step )
+            pages[count++] = base + s->b0 + k * pagesize;
+
+        // with no target nodes, move_pages() just reports where pages are
+        if ( syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) != 0 )
+            return;
+
+        for ( k = 0; k < count; k++ )
+        {
+            n = (status[k] >= 0 && status[k] < NUMA_MAX_NODES) ? status[k] : NUMA_MAX_NODES;
+            bytes[n] += len / count;
+        }
+
+        total += (len / count) * count;
+    }
+
+    if ( total == 0 )
+        return;
+
+    printf( "carrier memory by node:" );
+
+    for ( n = 0; n < NUMA_MAX_NODES; n++ )
+        if ( bytes[n] )
+            printf( "  node %d %.1f%%", n, 100.0 * bytes[n] / total );
+
+    if ( bytes[NUMA_MAX_NODES] )
+        printf( "  unmapped %.1f%%", 100.0 * bytes[NUMA_MAX_NODES] / total );
+
+    puts( "" );
+}
+
+/*
+ * get_data() for -j: plan the slices, then load the carrier with one pinned
+ * thread per slice.  returns the number of bytes read
+ */
+int numa_load(struct container *c, int threads)
+{
+    struct numa_plan *plan;
+    struct layout *l = &c->layout;
+    long units = carrier_units( c ), align = 8L * l->lanes, bytes, u;
+    int i;
+
+    plan = arena_alloc( &job_arena, sizeof(*plan) );
+    find_nodes( plan );
+
+    plan->nslices = threads;
+    plan->slice   = arena_alloc( &job_arena, threads * sizeof(*plan->slice) );
+
+    bytes = carrier_data_end( c ) - l->offset;
+
+    for ( i = 0; i < threads; i++ )
+    {
+        struct numa_slice *s = &plan->slice[i];
+
+        u     = (units / threads) * i;
+        s->u0 = (i == 0) ? 0 : u - u % align;
+        s->b0 = (i == 0) ? 0 : carrier_offset( c, s->u0 ) - l->offset;
+
+        // slice i gets node i * nodes / threads: contiguous stretches per node
+        s->node = (int)((long)i * plan->nodes / threads);
+
+        if ( i > 0 )
+        {
+            plan->slice[i - 1].u1 = s->u0;
+            plan->slice[i - 1].b1 = s->b0;
+        }
+    }
+
+    plan->slice[threads - 1].u1 = units;
+    plan->slice[threads - 1].b1 = bytes;
+
+    c->numa = plan;
+
+    printf( "loading %s on %d thread%s across %d NUMA node%s.\n", c->filename, threads, (threads == 1) ? "" : "s",
+            plan->nodes, (plan->nodes == 1) ? "" : "s" );
+
+    bytes = run_slices( c, NULL, numa_load_slice );
+
+    show_placement( c );
+
+    return bytes;
+}
+
+/*
+ * threaded equivalents of bitmap_cover()/pcm_cover() and their uncovers,
+ * for carriers loaded by numa_load(); each slice is handled by the thread
+ * (and node) that loaded it
+ */
+int numa_cover(struct container *c, struct payload *p)
+{
+    printf( "mixing bits from %s into %s on %d threads...\n", p->filename, c->filename, c->numa->nslices );
+
+    show_quality( c, run_slices(c, p, numa_cover_slice) );
+
+    return 0;
+}
+
+int numa_uncover(struct container *c, struct payload *p)
+{
+    memset( p->bytes, 0, p->size );
+
+    run_slices( c, p, numa_uncover_slice );
+
+    return 0;
+}
@@ -0,0 +1,427 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, pack.c
+ *
+ * pack many small payloads into a pool of carriers
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <dirent.h>          // for opendir()
+#include <libgen.h>          // for basename()
+#include <sys/stat.h>        // for stat(), mkdir()
+
+/*
+ * hiding a few hundred keys one at a time costs a few hundred full reads and
+ * writes of a carrier, one per key.  pack mode takes all the payloads and a
+ * pool of carriers at once and assigns each payload a slot -- a stretch of
+ * bytes of some carrier's hidden stream -- best-fit decreasing: biggest
+ * payload first, each into the carrier with the least room left that still
+ * holds it.  that fills few carriers and leaves the rest of the pool alone.
+ *
+ * the slots of a carrier sit back to back in one stream, which is hidden with
+ * a single bitmap_cover() or pcm_cover() pass, so every carrier that gets a
+ * payload is read and written exactly once, and carriers that get none aren't
+ * read past their header.  the slots go into a table, PACK_TABLE in the output
+ * directory; any one payload comes back with a plain --range recovery.
+ */
+
+#define PACK_TABLE "slots.txt"
+
+struct pack_carrier
+{
+    char name[MAX_FILENAME_LENGTH + 1];
+    long capacity;            // payload bytes a plain hide would accept
+    long used;                // ... and bytes of it handed out as slots
+};
+
+struct pack_payload
+{
+    const char *name;
+    long size;
+    int  carrier;             // where its slot is
+    long offset;              // ... and where in that carrier's hidden stream
+};
+
+/*
+ * read the header of a pool member and work out how much it can take.  a
+ * plain hide is held to validate_bitmap()'s one byte per 8 pixels, which can
+ * be less than carrier_capacity(), so a slot table never promises more
+ */
+static long pool_capacity(const char *name, unsigned char channels)
+{
+    struct container c;
+    struct payload p;
+    long capacity;
+
+    memset( &c, 0, sizeof(c) );
+    memset( &p, 0, sizeof(p) );
+
+    c.type = find_type( name );
+    c.fp   = open_file( name, &c.filename );
+
+    bind_carrier( &c, channels, 0 );
+    get_info( &c );
+
+    capacity = carrier_capacity( &c );
+
+    if ( (c.type == bitmap || c.type == pngfile) && (long)c.b->width * c.b->height / 8 < capacity )
+        capacity = (long)c.b->width * c.b->height / 8;
+
+    // rejects carriers we can't embed in at all (depth, compression...)
+    strncpy( p.filename, "(pool check)", MAX_FILENAME_LENGTH );
+    p.size = 1;
+
+    if ( capacity > 0 )
+        validate_data( &c, &p );
+
+    fclose( c.fp );
+    clean_up( &c, &p );
+
+    return capacity;
+}
+
+static int by_name(const void *a, const void *b)
+{
+    return strcmp( *(char * const *)a, *(char * const *)b );
+}
+
+/*
+ * the carriers of the pool: 'path' itself, or the images and WAV files
+ * directly inside it, in name order.  returns how many there are
+ */
+static int find_pool(const char *path, char ***names)
+{
+    unsigned char magic[12];
+    char full[MAX_FILENAME_LENGTH + 1];
+    struct dirent *e;
+    struct stat st;
+    DIR *d;
+    FILE *f;
+    int n = 0, alloc = 0;
+
+    *names = NULL;
+
+    if ( stat(path, &st) != 0 )
+    {
+        fprintf( stderr, "[ERROR] could not open %s: %s\nAborting.\n", path, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( !S_ISDIR(st.st_mode) )
+    {
+        *names = malloc( sizeof(**names) );
+        (*names)[0] = strdup( path );
+
+        return 1;
+    }
+
+    if ( (d = opendir(path)) == NULL )
+    {
+        fprintf( stderr, "[ERROR] could not open %s: %s\nAborting.\n", path, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    while ( (e = readdir(d)) != NULL )
+    {
+        if ( snprintf(full, sizeof(full), "%s/%s", path, e->d_name) >= (int)sizeof(full)
+          || stat(full, &st) != 0 || !S_ISREG(st.st_mode) || (f = fopen(full, "rb")) == NULL )
+            continue;
+
+        memset( magic, 0, sizeof(magic) );
+        fread( magic, sizeof(magic), 1, f );
+        fclose( f );
+
+        if ( magic_type(magic) < 0 )
+            continue;
+
+        if ( n == alloc )
+        {
+            alloc  = alloc ? 2 * alloc : 64;
+            *names = realloc( *names, alloc * sizeof(**names) );
+
+            if ( *names == NULL )
+            {
+                fprintf( stderr, "[ERROR] pack: memory allocation failed, aborting.\n" );
+                exit( EXIT_FAILURE );
+            }
+        }
+
+        (*names)[n++] = strdup( full );
+    }
+
+    closedir( d );
+
+    qsort( *names, n, sizeof(**names), by_name );
+
+    return n;
+}
+
+static int by_size(const void *a, const void *b)
+{
+    const struct pack_payload *x = *(struct pack_payload * const *)a;
+    const struct pack_payload *y = *(struct pack_payload * const *)b;
+
+    // equal sizes keep their command-line order
+    if ( x->size != y->size )
+        return (x->size < y->size) - (x->size > y->size);
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * best-fit decreasing: every payload, biggest first, goes into the carrier
+ * with the least room that still holds it
+ */
+static void assign_slots(struct pack_carrier *pool, int ncarriers, struct pack_payload *pay, int npay)
+{
+    struct pack_payload **order = malloc( npay * sizeof(*order) );
+    long room, best_room, free_total = 0;
+    int i, k, best;
+
+    for ( i = 0; i < npay; i++ )
+        order[i] = &pay[i];
+
+    qsort( order, npay, sizeof(*order), by_size );
+
+    for ( i = 0; i < npay; i++ )
+    {
+        best = -1;
+        best_room = 0;
+
+        for ( k = 0; k < ncarriers; k++ )
+        {
+            room = pool[k].capacity - pool[k].used;
+
+            if ( room >= order[i]->size && (best < 0 || room < best_room) )
+            {
+                best = k;
+                best_room = room;
+            }
+        }
+
+        if ( best < 0 )
+        {
+            for ( k = 0; k < ncarriers; k++ )
+                free_total += pool[k].capacity - pool[k].used;
+
+            fprintf( stderr, "[ERROR] %s (%ld bytes) doesn't fit in any carrier of the pool "
+                             "(%ld bytes left in %d carriers), aborting.\n",
+                     order[i]->name, order[i]->size, free_total, ncarriers );
+            exit( EXIT_FAILURE );
+        }
+
+        order[i]->carrier = best;
+        order[i]->offset  = pool[best].used;
+        pool[best].used  += order[i]->size;
+    }
+
+    free( order );
+}
+
+/*
+ * hide every payload assigned to pool[k] in one pass, and write the result
+ * to 'outname'
+ */
+static void pack_carrier(struct pack_carrier *pool, int k, struct pack_payload *pay, int npay,
+                         const char *outname, unsigned char channels)
+{
+    struct container c;
+    struct payload p;
+    struct stat in_st, out_st;
+    FILE *in, *out;
+    int i, n = 0;
+    long written;
+
+    memset( &c, 0, sizeof(c) );
+    memset( &p, 0, sizeof(p) );
+
+    c.type = find_type( pool[k].name );
+    c.fp   = open_file( pool[k].name, &c.filename );
+
+    // writing over the carrier would clobber the header before it's copied
+    if ( stat(outname, &out_st) == 0 && fstat(fileno(c.fp), &in_st) == 0
+      && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino )
+    {
+        fprintf( stderr, "[ERROR] %s would overwrite the carrier it's made from; "
+                         "use another output directory.\n", outname );
+        exit( EXIT_FAILURE );
+    }
+
+    bind_carrier( &c, channels, 0 );
+    get_info( &c );
+
+    for ( i = 0; i < npay; i++ )
+        n += (pay[i].carrier == k);
+
+    snprintf( p.filename, sizeof(p.filename), "%d payload%s", n, (n == 1) ? "" : "s" );
+    p.size     = pool[k].used;
+    p.datasize = p.size;
+
+    validate_data( &c, &p );
+    init_payload_storage( &p );
+
+    // the slots, back to back
+    for ( i = 0; i < npay; i++ )
+    {
+        if ( pay[i].carrier != k )
+            continue;
+
+        in = fopen( pay[i].name, "rb" );
+
+        if ( !in || (long)fread(p.bytes + pay[i].offset, 1, pay[i].size, in) != pay[i].size )
+        {
+            fprintf( stderr, "[ERROR] could not read %s: %s\n", pay[i].name,
+                     in ? "file changed size" : strerror(errno) );
+            exit( EXIT_FAILURE );
+        }
+
+        fclose( in );
+    }
+
+    init_data_storage( &c );
+    get_data( &c );
+
+    mode_action( &c, &p );
+
+    out = fopen( outname, "wb" );
+
+    if ( !out )
+    {
+        fprintf( stderr, "Error opening %s for writing: %s\n", outname, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    PROBE1( write_start, 0L );
+    written  = write_header( out, &c );
+    written += write_data( out, &c );
+    PROBE2( write_done, 0L, written );
+
+    fclose( out );
+    fclose( c.fp );
+
+    clean_up( &c, &p );
+}
+
+/*
+ * pack the payloads named in 'u' into the carrier pool u->basefile, writing
+ * the carriers used and the slot table to the directory u->outputfile.
+ * returns the number of carriers written
+ */
+int pack_payloads(struct user_input *u)
+{
+    struct pack_carrier *pool;
+    struct pack_payload *pay;
+    struct stat st;
+    char **names, out[MAX_FILENAME_LENGTH + 1], tmp[MAX_FILENAME_LENGTH + 1], channels[16];
+    int ncarriers, npay = u->npackfiles, i, k, written = 0;
+    FILE *table;
+
+    ncarriers = find_pool( u->basefile, &names );
+
+    if ( ncarriers == 0 )
+    {
+        fprintf( stderr, "[ERROR] no images or WAV files in %s, aborting.\n", u->basefile );
+        exit( EXIT_FAILURE );
+    }
+
+    pool = calloc( ncarriers, sizeof(*pool) );
+    pay  = calloc( npay, sizeof(*pay) );
+
+    for ( k = 0; k < ncarriers; k++ )
+    {
+        strncpy( pool[k].name, names[k], MAX_FILENAME_LENGTH );
+        pool[k].capacity = pool_capacity( names[k], u->channels );
+
+        free( names[k] );
+    }
+
+    free( names );
+
+    for ( i = 0; i < npay; i++ )
+    {
+        if ( stat(u->packfiles[i], &st) != 0 )
+        {
+            fprintf( stderr, "[ERROR] could not open %s: %s\nAborting.\n", u->packfiles[i], strerror(errno) );
+            exit( EXIT_FAILURE );
+        }
+
+        if ( !S_ISREG(st.st_mode) )
+        {
+            fprintf( stderr, "[ERROR] %s is not a regular file, aborting.\n", u->packfiles[i] );
+            exit( EXIT_FAILURE );
+        }
+
+        if ( st.st_size == 0 )
+        {
+            fprintf( stderr, "[ERROR] %s is empty, nothing to hide.\n", u->packfiles[i] );
+            exit( EXIT_FAILURE );
+        }
+
+        pay[i].name = u->packfiles[i];
+        pay[i].size = st.st_size;
+    }
+
+    assign_slots( pool, ncarriers, pay, npay );
+
+    if ( mkdir(u->outputfile, 0755) != 0 && errno != EEXIST )
+    {
+        fprintf( stderr, "[ERROR] could not create %s: %s\n", u->outputfile, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    // carriers without a slot are neither loaded nor written
+    for ( k = 0; k < ncarriers; k++ )
+    {
+        if ( pool[k].used == 0 )
+            continue;
+
+        strcpy( tmp, pool[k].name );
+
+        if ( snprintf(out, sizeof(out), "%s/%s", u->outputfile, basename(tmp)) >= (int)sizeof(out) )
+        {
+            fprintf( stderr, "[ERROR] output filename must be less than %d characters, aborting.\n",
+                     MAX_FILENAME_LENGTH );
+            exit( EXIT_FAILURE );
+        }
+
+        printf( "\npacking %ld of %ld bytes into %s...\n", pool[k].used, pool[k].capacity, out );
+
+        pack_carrier( pool, k, pay, npay, out, u->channels );
+        written++;
+
+        // the table names the stego file, not the clean one
+        strcpy( pool[k].name, out );
+    }
+
+    if ( snprintf(out, sizeof(out), "%s/%s", u->outputfile, PACK_TABLE) >= (int)sizeof(out)
+      || (table = fopen(out, "w")) == NULL )
+    {
+        fprintf( stderr, "[ERROR] could not write the slot table to %s/%s\n", u->outputfile, PACK_TABLE );
+        exit( EXIT_FAILURE );
+    }
+
+    // bitmaps packed with --channels have to be recovered with it
+    channels[0] = '\0';
+
+    if ( u->channels )
+        snprintf( channels, sizeof(channels), " --channels %s%s%s", (u->channels & CHANNEL_RED) ? "r" : "",
+                  (u->channels & CHANNEL_GREEN) ? "g" : "", (u->channels & CHANNEL_BLUE) ? "b" : "" );
+
+    fprintf( table, "# payload\tstego file\tfirst byte\tsize\n"
+                    "# recover with: steganographer -R -b <stego file> --range <first byte>:<first byte + size>%s\n",
+             channels );
+
+    for ( i = 0; i < npay; i++ )
+        fprintf( table, "%s\t%s\t%ld\t%ld\n", pay[i].name, pool[pay[i].carrier].name, pay[i].offset, pay[i].size );
+
+    fclose( table );
+
+    printf( "\nslot table written to %s.\n", out );
+
+    free( pool );
+    free( pay );
+
+    return written;
+}
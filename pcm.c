@@ -8,6 +8,43 @@
  */
 
 #include "steganographer.h"
+#include <unistd.h>          // for sysconf()
+#include <pthread.h>
+
+/*
+ * with --channels, a WAV file's payload doesn't go sample by sample through
+ * every channel in turn.  each selected channel is a lane of its own: the
+ * payload is cut into one byte-aligned segment per lane, and lane j holds
+ * segment j in the lsbs of its channel's samples, frame after frame.  a lane
+ * is handed to the engine as a stand-in container whose only units are that
+ * channel's samples, a stride of one frame apart, so nothing gets
+ * deinterleaved.
+ *
+ * lanes share frames, and the vector kernels load and store 16 bytes at a
+ * time, other channels' samples included, so two threads must never work on
+ * the same frames.  the threads split the frames instead: each takes a range
+ * of them and runs every lane over it.  ranges are whole bytes of every
+ * lane's segment, so they keep their payload bytes apart when recovering too.
+ */
+
+// a channel of a WAV file, as the engine sees it
+struct lane
+{
+    struct container c;
+    struct pcm w;
+    struct payload p;         // the lane's segment of the payload
+};
+
+struct lane_job
+{
+    struct lane *lane;
+    int  n;                   // lanes
+    long frames;              // frames per range, a multiple of 8
+    int  ranges;
+    int  next;                // next range to take
+    int  hide;
+    long changed;
+};
 
 /*
  * load header data from a WAV file
@@ -53,6 +90,199 @@ void get_pcm_info(struct container *c)
     // nSamples = nFrames * nChannels
     c->w->total_samples = (c->w->subchunk2size / c->w->block_align) * c->w->channels;
 
+    // one run of samples; the first (least significant) byte of each holds a bit
+    c->layout.offset     = c->w->data_offset;
+    c->layout.runs       = 1;
+    c->layout.run_stride = c->w->subchunk2size;
+    c->layout.groups     = c->w->total_samples;
+    c->layout.stride     = c->w->sample_size;
+    c->layout.lane_mask  = 1;
+
+    set_layout( &c->layout );
+}
+
+/*
+ * payload bits per lane for a 'size'-byte payload over 'lanes' lanes:
+ * an even share, rounded up to whole bytes
+ */
+static long lane_bits(long size, int lanes)
+{
+    long bits = (8 * size + lanes - 1) / lanes;
+
+    return (bits + 7) / 8 * 8;
+}
+
+static int count_lanes(uint64_t mask)
+{
+    return __builtin_popcountll( mask );
+}
+
+static void *lane_worker(void *arg)
+{
+    struct lane_job *job = arg;
+    struct lane *l;
+    long f0, f1, changed = 0;
+    int i, k;
+
+    while ( (i = __sync_fetch_and_add(&job->next, 1)) < job->ranges )
+    {
+        f0 = i * job->frames;
+
+        for ( k = 0; k < job->n; k++ )
+        {
+            l = &job->lane[k];
+
+            // one unit per frame, and never past the lane's last one
+            f1 = f0 + job->frames;
+
+            if ( f1 > 8L * l->p.size )
+                f1 = 8L * l->p.size;
+
+            if ( f1 > carrier_units(&l->c) )
+                f1 = carrier_units( &l->c );
+
+            if ( f0 >= f1 )
+                continue;
+
+            if ( job->hide )
+                changed += cover_units( &l->c, &l->p, f0, f1 );
+            else
+                uncover_units( &l->c, &l->p, f0, f1 );
+        }
+    }
+
+    __sync_fetch_and_add( &job->changed, changed );
+
+    return NULL;
+}
+
+/*
+ * the channels in the mask must exist, and each lane's share of the payload
+ * must fit in one sample per frame; hide and recover alike
+ */
+static void check_lanes(struct container *c, struct payload *p)
+{
+    long frames = c->w->subchunk2size / c->w->block_align;
+    int lanes   = count_lanes( c->w->channel_mask );
+
+    if ( c->w->channels < 64 && c->w->channel_mask >> c->w->channels )
+    {
+        fprintf( stderr, "[ERROR] --channels names a channel %s doesn't have (it has %d, numbered from 0).\n",
+                 c->filename, c->w->channels );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( lane_bits(p->size, lanes) > frames )
+    {
+        fprintf( stderr, "[ERROR] %d bytes spread over %d channel%s need %ld frames each; %s has %ld.\n",
+                 p->size, lanes, (lanes == 1) ? "" : "s", lane_bits(p->size, lanes), c->filename, frames );
+        exit( EXIT_FAILURE );
+    }
+}
+
+/*
+ * set up a lane for every selected channel that gets part of the payload,
+ * and run them over ranges of frames, a thread per range up to
+ * c->w->threads (0: one per cpu)
+ */
+static long run_lanes(struct container *c, struct payload *p, int hide)
+{
+    struct pcm *w = c->w;
+    struct lane_job job;
+    pthread_t *tid;
+    long bits = lane_bits( p->size, count_lanes(w->channel_mask) ), seg;
+    int ch, i, threads = w->threads;
+
+    check_lanes( c, p );
+
+    job.lane = arena_alloc( &job_arena, count_lanes(w->channel_mask) * sizeof(*job.lane) );
+    job.n    = 0;
+    job.next = 0;
+    job.hide = hide;
+    job.changed = 0;
+
+    for ( ch = 0; ch < w->channels && ch < 64 && job.n * (bits / 8) < p->size; ch++ )
+    {
+        struct lane *l = &job.lane[job.n];
+
+        if ( !(w->channel_mask & (1ULL << ch)) )
+            continue;
+
+        seg = p->size - job.n * (bits / 8);
+
+        l->c         = *c;
+        l->w         = *w;
+        l->w.samples = w->samples + ch * w->sample_size;
+        l->c.w       = &l->w;
+        l->p         = *p;
+        l->p.bytes   = p->bytes + job.n * (bits / 8);
+        l->p.size    = (seg < bits / 8) ? seg : bits / 8;
+
+        // one unit per frame: the low byte of this channel's sample
+        l->c.layout.offset     = w->data_offset + ch * w->sample_size;
+        l->c.layout.runs       = 1;
+        l->c.layout.run_stride = w->subchunk2size;
+        l->c.layout.groups     = w->subchunk2size / w->block_align;
+        l->c.layout.stride     = w->block_align;
+        l->c.layout.lane_mask  = 1;
+        set_layout( &l->c.layout );
+
+        job.n++;
+    }
+
+    if ( threads <= 0 )
+        threads = sysconf( _SC_NPROCESSORS_ONLN );
+
+    // no range smaller than a byte of every lane
+    if ( threads > bits / 8 )
+        threads = bits / 8;
+
+    if ( threads < 1 )
+        threads = 1;
+
+    job.frames = ((bits + threads - 1) / threads + 7) / 8 * 8;
+    job.ranges = (bits + job.frames - 1) / job.frames;
+
+    if ( threads <= 1 )
+        lane_worker( &job );
+    else
+    {
+        tid = arena_alloc( &job_arena, threads * sizeof(*tid) );
+
+        for ( i = 0; i < threads; i++ )
+            pthread_create( &tid[i], NULL, lane_worker, &job );
+
+        for ( i = 0; i < threads; i++ )
+            pthread_join( tid[i], NULL );
+    }
+
+    return job.changed;
+}
+
+/*
+ * hide in the channels in c->w->channel_mask, a lane each
+ */
+int pcm_lane_cover(struct container *c, struct payload *p)
+{
+    int lanes = count_lanes( c->w->channel_mask );
+
+    printf( "mixing bits from %s into %d of the %d channels of %s...\n", p->filename,
+            lanes, c->w->channels, c->filename );
+
+    show_quality( c, run_lanes(c, p, 1) );
+
+    return 0;
+}
+
+/*
+ * recover what pcm_lane_cover() hid
+ */
+int pcm_lane_uncover(struct container *c, struct payload *p)
+{
+    memset( p->bytes, 0, p->size );
+    run_lanes( c, p, 0 );
+
+    return p->size;
 }
 
 /*
@@ -108,6 +338,13 @@ void validate_wavfile(struct container *c, struct payload *p)
         exit( EXIT_FAILURE );
     }
 
+    // with a channel mask, each lane holds its share in one sample per frame
+    if ( c->w->channel_mask )
+    {
+        check_lanes( c, p );
+        return;
+    }
+
     // ensure we have enough sample data for LSB stego
     if ( (c->w->total_samples / p->size) < 8 )
     {
@@ -169,7 +406,7 @@ void show_pcm_info(struct container *c, struct payload *p)
 
     printf( "--[hide file]------------------\n"
             "file name: %s\n"
-            "file size: %d bytes (IMPORTANT: this number is required to recover the file)\n", p->filename, p->size );
+            "file size: %d bytes (IMPORTANT: this number is required to recover the file)\n", p->filename, p->datasize );
 
     puts( "-------------------------------\n" );
 }
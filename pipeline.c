@@ -0,0 +1,338 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, pipeline.c
+ *
+ * streaming payload pipelines
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <pthread.h>
+
+/*
+ * a hide used to read the whole payload, then make a second pass over it to
+ * embed it; a recovery extracted everything, then wrote it out a byte at a
+ * time.  a pipeline streams instead: the payload moves through a chain of
+ * stages in blocks of about PIPE_BLOCK bytes, each stage working on block n
+ * while the one before it is already on block n + 1.
+ *
+ * stages are joined by rings of PIPE_SLOTS blocks.  a stage takes the next
+ * block from its input ring and an empty one from its output ring, runs its
+ * process() on the pair, and passes the output on; the first stage has no
+ * input and the last no output.  every block keeps its stream position and
+ * length from end to end.  a ring can be placed on a buffer holding the whole
+ * stream, p->bytes say, so that its block n simply is that buffer at block
+ * n's position; that's how the payload gets from the file to the cover
+ * kernel, or from the uncover kernel to the file, without being copied.
+ *
+ * with more than one block, every stage but the last gets a thread of its
+ * own, and the caller's thread runs the last.  a new transform is one more
+ * process() in the chain, and no extra pass over the data.
+ */
+
+#define PIPE_BLOCK  (1L << 20)        // bytes per block, before rounding to whole groups
+#define PIPE_SLOTS  4                 // blocks in flight between two stages
+
+// blocks on their way from one stage to the next
+struct pipe_ring
+{
+    unsigned char *place;     // the whole stream, if the ring is placed on it
+    unsigned char *slots;     // otherwise, PIPE_SLOTS blocks of storage
+    long head, tail;          // blocks pushed and popped so far
+    pthread_mutex_t lock;
+    pthread_cond_t  moved;
+};
+
+// what the kernel stages work on
+struct engine
+{
+    struct container *c;
+    struct payload *p;
+    long units;               // carrier_units(c): no block reaches past it
+};
+
+// a block's units, clamped to the carrier; returns how many there are
+static long block_units(struct engine *e, const struct pipe_block *b, long *u0, long *u1)
+{
+    *u0 = 8L * b->pos;
+    *u1 = 8L * (b->pos + b->len);
+
+    if ( *u1 > e->units )
+        *u1 = e->units;
+
+    return *u1 - *u0;
+}
+
+/*
+ * start an empty pipeline for 'total' bytes in blocks of 'block' bytes
+ */
+void pipe_init(struct pipeline *pl, long total, long block)
+{
+    memset( pl, 0, sizeof(*pl) );
+
+    pl->total = total;
+    pl->block = block;
+}
+
+/*
+ * append a stage; its output ring is placed on 'place' if that isn't NULL
+ */
+void pipe_add(struct pipeline *pl, const char *name,
+              long (*process)(struct pipe_stage *, const struct pipe_block *, struct pipe_block *),
+              void *arg, unsigned char *place)
+{
+    struct pipe_stage *s;
+
+    if ( pl->nstages == PIPE_MAX_STAGES )
+    {
+        fprintf( stderr, "[ERROR] too many pipeline stages (%s), aborting.\n", name );
+        exit( EXIT_FAILURE );
+    }
+
+    s = &pl->stage[pl->nstages++];
+
+    s->name    = name;
+    s->process = process;
+    s->arg     = arg;
+    s->count   = 0;
+
+    pl->place[pl->nstages - 1] = place;
+}
+
+static void wait_for(struct pipe_ring *r, int full, long n)
+{
+    pthread_mutex_lock( &r->lock );
+
+    // block n is full once pushed, and empty once block n - PIPE_SLOTS is popped
+    while ( full ? r->head <= n : n - r->tail >= PIPE_SLOTS )
+        pthread_cond_wait( &r->moved, &r->lock );
+
+    pthread_mutex_unlock( &r->lock );
+}
+
+static void moved(struct pipe_ring *r, long *count)
+{
+    pthread_mutex_lock( &r->lock );
+    (*count)++;
+    pthread_cond_broadcast( &r->moved );
+    pthread_mutex_unlock( &r->lock );
+}
+
+static unsigned char *block_data(struct pipe_ring *r, struct pipeline *pl, long n)
+{
+    return r->place ? r->place + n * pl->block : r->slots + (n % PIPE_SLOTS) * pl->block;
+}
+
+struct stage_run
+{
+    struct pipeline *pl;
+    int  k;                   // stage number
+};
+
+static void *run_stage(void *arg)
+{
+    struct stage_run *sr = arg;
+    struct pipeline *pl = sr->pl;
+    struct pipe_stage *s = &pl->stage[sr->k];
+    struct pipe_ring *in  = (sr->k > 0) ? pl->ring[sr->k - 1] : NULL;
+    struct pipe_ring *out = (sr->k < pl->nstages - 1) ? pl->ring[sr->k] : NULL;
+    struct pipe_block bi, bo;
+    long n, blocks = (pl->total + pl->block - 1) / pl->block;
+
+    for ( n = 0; n < blocks; n++ )
+    {
+        bi.pos  = bo.pos  = n * pl->block;
+        bi.len  = bo.len  = (pl->total - bi.pos < pl->block) ? pl->total - bi.pos : pl->block;
+        bi.last = bo.last = (n == blocks - 1);
+
+        if ( in )
+        {
+            wait_for( in, 1, n );
+            bi.data = block_data( in, pl, n );
+        }
+
+        if ( out )
+        {
+            wait_for( out, 0, n );
+            bo.data = block_data( out, pl, n );
+        }
+
+        s->count += s->process( s, in ? &bi : NULL, out ? &bo : NULL );
+
+        if ( out )
+            moved( out, &out->head );
+
+        if ( in )
+            moved( in, &in->tail );
+    }
+
+    return NULL;
+}
+
+/*
+ * push the whole stream through the stages
+ */
+void pipe_run(struct pipeline *pl)
+{
+    struct stage_run sr[PIPE_MAX_STAGES];
+    pthread_t tid[PIPE_MAX_STAGES];
+    int k, threaded = (pl->total > pl->block);
+
+    for ( k = 0; k < pl->nstages - 1; k++ )
+    {
+        pl->ring[k] = arena_alloc( &job_arena, sizeof(*pl->ring[k]) );
+        memset( pl->ring[k], 0, sizeof(*pl->ring[k]) );
+
+        pl->ring[k]->place = pl->place[k];
+
+        if ( !pl->ring[k]->place )
+            pl->ring[k]->slots = arena_alloc( &job_arena, PIPE_SLOTS * pl->block );
+
+        pthread_mutex_init( &pl->ring[k]->lock, NULL );
+        pthread_cond_init( &pl->ring[k]->moved, NULL );
+    }
+
+    for ( k = 0; k < pl->nstages; k++ )
+    {
+        sr[k].pl = pl;
+        sr[k].k  = k;
+    }
+
+    // a single block goes down the chain on this thread
+    if ( !threaded )
+    {
+        for ( k = 0; k < pl->nstages; k++ )
+            run_stage( &sr[k] );
+    }
+    else
+    {
+        for ( k = 0; k < pl->nstages - 1; k++ )
+            pthread_create( &tid[k], NULL, run_stage, &sr[k] );
+
+        run_stage( &sr[pl->nstages - 1] );
+
+        for ( k = 0; k < pl->nstages - 1; k++ )
+            pthread_join( tid[k], NULL );
+    }
+
+    for ( k = 0; k < pl->nstages - 1; k++ )
+    {
+        pthread_mutex_destroy( &pl->ring[k]->lock );
+        pthread_cond_destroy( &pl->ring[k]->moved );
+    }
+}
+
+/*
+ * bytes per block for carrier 'c': whole groups' worth of units, so every
+ * block starts the cover and uncover kernels on a group
+ */
+static long pipe_block(struct container *c)
+{
+    return PIPE_BLOCK / c->layout.lanes * c->layout.lanes;
+}
+
+// read the payload file
+static long read_stage(struct pipe_stage *s, const struct pipe_block *in, struct pipe_block *out)
+{
+    struct payload *p = s->arg;
+
+    (void)in;
+
+    if ( (long)fread(out->data, 1, out->len, p->fp) != out->len )
+    {
+        fprintf( stderr, "[ERROR] %s: short read at byte %ld, aborting.\n", p->filename, out->pos );
+        exit( EXIT_FAILURE );
+    }
+
+    return out->len;
+}
+
+// embed a block that's landed in p->bytes; counts the carrier bytes changed
+static long cover_stage(struct pipe_stage *s, const struct pipe_block *in, struct pipe_block *out)
+{
+    struct engine *e = s->arg;
+    long u0, u1;
+
+    (void)out;
+
+    return (block_units(e, in, &u0, &u1) > 0) ? cover_units( e->c, e->p, u0, u1 ) : 0;
+}
+
+// extract a block into p->bytes
+static long uncover_stage(struct pipe_stage *s, const struct pipe_block *in, struct pipe_block *out)
+{
+    struct engine *e = s->arg;
+    long u0, u1;
+
+    (void)in;
+
+    // past the end of the carrier, the payload stays zeroed
+    if ( block_units(e, out, &u0, &u1) > 0 )
+        uncover_units( e->c, e->p, u0, u1 );
+
+    return out->len;
+}
+
+// write the recovered payload file
+static long write_stage(struct pipe_stage *s, const struct pipe_block *in, struct pipe_block *out)
+{
+    struct payload *p = s->arg;
+    long w;
+
+    (void)out;
+
+    PROBE1( write_start, in->pos );
+
+    w = fwrite( in->data, 1, in->len, p->fp );
+
+    PROBE2( write_done, in->pos, w );
+
+    return w;
+}
+
+/*
+ * hide p->fp's payload in 'c' through a pipeline: the reader streams the
+ * file into p->bytes, and each block is embedded as soon as it's there
+ */
+int pipeline_cover(struct container *c, struct payload *p)
+{
+    struct pipeline pl;
+    struct engine e = { c, p, carrier_units(c) };
+
+    printf( "mixing bits from %s into %s from %s...\n", p->filename,
+            (c->type == wavfile) ? "sample data" : "image", c->filename );
+
+    PROBE2( payload_start, p->filename, (long)p->datasize );
+
+    pipe_init( &pl, p->size, pipe_block(c) );
+    pipe_add( &pl, "read", read_stage, p, p->bytes );
+    pipe_add( &pl, "cover", cover_stage, &e, NULL );
+    pipe_run( &pl );
+
+    PROBE2( payload_done, p->filename, pl.stage[0].count );
+
+    fclose( p->fp );
+
+    printf( "%s: read %ld bytes.\n", p->filename, pl.stage[0].count );
+    show_quality( c, pl.stage[1].count );
+
+    return 0;
+}
+
+/*
+ * recover the payload hidden in 'c' into p->fp through a pipeline: each
+ * block is written out as soon as it's extracted
+ */
+int pipeline_uncover(struct container *c, struct payload *p)
+{
+    struct pipeline pl;
+    struct engine e = { c, p, carrier_units(c) };
+
+    pipe_init( &pl, p->size, pipe_block(c) );
+    pipe_add( &pl, "uncover", uncover_stage, &e, p->bytes );
+    pipe_add( &pl, "write", write_stage, p, NULL );
+    pipe_run( &pl );
+
+    return pl.stage[1].count;
+}
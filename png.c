@@ -0,0 +1,612 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, png.c
+ *
+ * PNG-specific functions
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <unistd.h>          // for sysconf()
+#include <pthread.h>
+#include <zlib.h>
+
+/*
+ * a PNG keeps its pixels deflated in IDAT chunks, each row preceded by a
+ * filter byte.  loading a PNG inflates and unfilters the IDAT data into the
+ * same pixel rows a bitmap loads into (top row first, RGB or RGBA byte order
+ * instead of BGR), so the one embedding engine works on either.  everything
+ * but the IDAT chunks is copied to the output as it is.
+ *
+ * writing it back out is where the time goes, so it's done pigz-style: the
+ * rows are cut into blocks of about PNG_BLOCK bytes, and threads filter and
+ * deflate the blocks independently.  each block is deflated with the last
+ * 32K of the block before it as its dictionary, so matches reach across
+ * block boundaries as they would in one stream, and ends on a sync flush,
+ * so the compressed blocks simply concatenate into one zlib stream.  the
+ * Adler-32 check of the whole stream is combined from the blocks' own.
+ *
+ * the filter for each row is the one giving the smallest sum of absolute
+ * (signed) filtered bytes, the usual heuristic.  the row above's choice is
+ * tried first, and the other filters stop adding as soon as they can't win.
+ */
+
+#define PNG_BLOCK     (256L << 10)   // filtered bytes per deflate block
+#define PNG_IDAT_MAX  (1L << 20)     // largest IDAT chunk we write
+#define PNG_WINDOW    32768          // deflate dictionary size
+
+static const unsigned char png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+// per-block state for the deflate threads
+struct png_block
+{
+    long r0, r1;              // rows [r0, r1)
+    unsigned char *out;       // compressed block
+    long outlen;
+    uLong adler;              // Adler-32 of the block's filtered bytes
+};
+
+struct png_job
+{
+    struct container *c;
+    unsigned char *filtered;  // every row's filter byte and filtered bytes
+    long rawlen;              // bytes per filtered row, filter byte included
+    struct png_block *block;
+    int  nblocks;
+    int  next_filter, next_deflate;
+    pthread_barrier_t filtered_all;
+    int  failed;
+};
+
+static uint32_t get32(const unsigned char *b)
+{
+    return (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+static void put32(unsigned char *b, uint32_t v)
+{
+    b[0] = v >> 24;
+    b[1] = v >> 16;
+    b[2] = v >> 8;
+    b[3] = v;
+}
+
+/*
+ * load header data from a PNG file: the IHDR chunk, and where the (required
+ * to be consecutive) IDAT chunks start and end
+ */
+void get_png_info(struct container *c)
+{
+    unsigned char sig[8], head[8], ihdr[13];
+    struct bitmap *b = c->b;
+    struct png *g = c->png;
+    struct layout *l = &c->layout;
+    long pos = 8, len;
+    int k, seen_idat = 0, pos_rgb[3] = { 0, 1, 2 };
+
+    fseek( c->fp, 0, SEEK_END );
+    c->filesize = ftell( c->fp );
+    rewind( c->fp );
+
+    if ( fread(sig, 8, 1, c->fp) != 1 || memcmp(sig, png_signature, 8) )
+    {
+        fprintf( stderr, "[ERROR] %s: not a PNG file, aborting.\n", c->filename );
+        exit( EXIT_FAILURE );
+    }
+
+    g->idat_start = g->idat_end = 0;
+
+    // walk the chunks: length, type, data, crc
+    while ( fread(head, 8, 1, c->fp) == 1 )
+    {
+        len = get32( head );
+
+        if ( !memcmp(head + 4, "IHDR", 4) && len == 13 && fread(ihdr, 13, 1, c->fp) == 1 )
+        {
+            b->width          = get32( ihdr );
+            b->height         = get32( ihdr + 4 );
+            g->bit_depth      = ihdr[8];
+            g->color_type     = ihdr[9];
+            g->interlace      = ihdr[12];
+            b->compression    = ihdr[10] | ihdr[11];
+        }
+        else if ( !memcmp(head + 4, "IDAT", 4) )
+        {
+            if ( seen_idat == 2 )
+            {
+                fprintf( stderr, "[ERROR] %s: IDAT chunks aren't consecutive, aborting.\n", c->filename );
+                exit( EXIT_FAILURE );
+            }
+
+            if ( !seen_idat )
+                g->idat_start = pos;
+
+            seen_idat = 1;
+            g->idat_end = pos + 12 + len;
+        }
+        else if ( seen_idat )
+        {
+            seen_idat = 2;
+        }
+
+        if ( !memcmp(head + 4, "IEND", 4) )
+            break;
+
+        pos += 12 + len;
+        fseek( c->fp, pos, SEEK_SET );
+    }
+
+    if ( !g->idat_start || b->width <= 0 || b->height <= 0 )
+    {
+        fprintf( stderr, "[ERROR] %s: no image data found, aborting.\n", c->filename );
+        exit( EXIT_FAILURE );
+    }
+
+    // the pixels, laid out as bitmap rows without padding
+    b->size        = (g->color_type == 6) ? 4 : 3;
+    b->depth       = 8 * b->size;
+    b->pad         = 0;
+    b->rowlen      = b->size * b->width;
+    b->start       = 0;
+    b->data_offset = g->idat_start;
+
+    // a unit's file position means nothing once the data is deflated; the
+    // layout only describes the inflated rows
+    l->offset     = 0;
+    l->runs       = b->height;
+    l->run_stride = b->rowlen;
+
+    if ( b->size == 3 && (b->channel_mask == 0 || b->channel_mask == CHANNEL_ALL) )
+    {
+        l->groups    = b->rowlen;
+        l->stride    = 1;
+        l->lane_mask = 1;
+    }
+    else
+    {
+        l->groups    = b->width;
+        l->stride    = b->size;
+        l->lane_mask = 0;
+
+        // the alpha byte of RGBA (position 3) is never a unit
+        for ( k = 0; k < 3; k++ )
+            if ( (b->channel_mask == 0) || (b->channel_mask & (CHANNEL_RED >> k)) )
+                l->lane_mask |= 1 << pos_rgb[k];
+    }
+
+    set_layout( l );
+}
+
+static inline int paeth(int a, int b, int c)
+{
+    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+/*
+ * undo the filter on one row in place; 'prev' is the row above, unfiltered
+ */
+static int unfilter_row(int type, unsigned char *row, const unsigned char *prev, long len, int bpp)
+{
+    long i;
+
+    switch ( type )
+    {
+        case 0:
+            break;
+        case 1:
+            for ( i = bpp; i < len; i++ )
+                row[i] += row[i - bpp];
+            break;
+        case 2:
+            for ( i = 0; i < len; i++ )
+                row[i] += prev[i];
+            break;
+        case 3:
+            for ( i = 0; i < len; i++ )
+                row[i] += ((i >= bpp ? row[i - bpp] : 0) + prev[i]) / 2;
+            break;
+        case 4:
+            for ( i = 0; i < len; i++ )
+                row[i] += paeth( i >= bpp ? row[i - bpp] : 0, prev[i], i >= bpp ? prev[i - bpp] : 0 );
+            break;
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * inflate the IDAT data into the pixel matrix.  returns the number of pixel
+ * bytes loaded
+ */
+int get_png(struct container *c)
+{
+    struct bitmap *b = c->b;
+    struct png *g = c->png;
+    long rawlen = b->rowlen + 1, pos, len, n = 0, i;
+    unsigned char head[8], *z, *raw, *zero;
+    z_stream s;
+    int r;
+
+    // the IDAT payloads, back to back
+    z = arena_alloc( &job_arena, g->idat_end - g->idat_start );
+
+    for ( pos = g->idat_start; pos < g->idat_end; pos += 12 + len )
+    {
+        fseek( c->fp, pos, SEEK_SET );
+
+        if ( fread(head, 8, 1, c->fp) != 1 || (len = get32(head)) > g->idat_end - pos
+          || (long)fread(z + n, 1, len, c->fp) != len )
+        {
+            fprintf( stderr, "[ERROR] %s: truncated image data, aborting.\n", c->filename );
+            exit( EXIT_FAILURE );
+        }
+
+        n += len;
+    }
+
+    raw = arena_alloc( &job_arena, (size_t)b->height * rawlen );
+
+    memset( &s, 0, sizeof(s) );
+    inflateInit( &s );
+
+    s.next_in   = z;
+    s.avail_in  = n;
+    s.next_out  = raw;
+    s.avail_out = (size_t)b->height * rawlen;
+
+    r = inflate( &s, Z_FINISH );
+    inflateEnd( &s );
+
+    if ( r != Z_STREAM_END || s.total_out != (uLong)b->height * rawlen )
+    {
+        fprintf( stderr, "[ERROR] %s: corrupt image data (%s), aborting.\n", c->filename, s.msg ? s.msg : "short" );
+        exit( EXIT_FAILURE );
+    }
+
+    zero = arena_alloc( &job_arena, b->rowlen );
+    memset( zero, 0, b->rowlen );
+
+    for ( i = 0; i < b->height; i++ )
+    {
+        memcpy( b->pixel[i], raw + i * rawlen + 1, b->rowlen );
+
+        if ( unfilter_row(raw[i * rawlen], b->pixel[i], i ? b->pixel[i - 1] : zero, b->rowlen, b->size) )
+        {
+            fprintf( stderr, "[ERROR] %s: bad filter type %d in row %ld, aborting.\n",
+                     c->filename, raw[i * rawlen], i );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    return b->height * b->rowlen;
+}
+
+/*
+ * filter one row with filter 'type' into 'out', giving up (and returning
+ * -1) once the sum of absolute signed bytes reaches 'bound'; otherwise
+ * returns the sum
+ */
+static long try_filter(int type, const unsigned char *row, const unsigned char *prev, long len, int bpp,
+                       unsigned char *out, long bound)
+{
+    long i, sum = 0;
+    unsigned char v;
+
+    for ( i = 0; i < len; i++ )
+    {
+        int a = (i >= bpp) ? row[i - bpp] : 0, cc = (i >= bpp) ? prev[i - bpp] : 0;
+
+        switch ( type )
+        {
+            case 0:  v = row[i];                              break;
+            case 1:  v = row[i] - a;                          break;
+            case 2:  v = row[i] - prev[i];                    break;
+            case 3:  v = row[i] - (a + prev[i]) / 2;          break;
+            default: v = row[i] - paeth( a, prev[i], cc );    break;
+        }
+
+        out[i] = v;
+        sum   += (v < 128) ? v : 256 - v;
+
+        // check the bound now and then; the inner loop stays tight
+        if ( (i & 63) == 63 && sum >= bound )
+            return -1;
+    }
+
+    return sum;
+}
+
+/*
+ * filter rows [r0, r1) into the job's filtered buffer
+ */
+static void filter_rows(struct png_job *j, long r0, long r1, unsigned char *scratch)
+{
+    struct bitmap *b = j->c->b;
+    long r, sum, best_sum;
+    int t, best, last = 0, k;
+    unsigned char *dst, *zero = scratch + b->rowlen;
+
+    memset( zero, 0, b->rowlen );
+
+    for ( r = r0; r < r1; r++ )
+    {
+        const unsigned char *row = b->pixel[r], *prev = r ? b->pixel[r - 1] : zero;
+
+        dst = j->filtered + r * j->rawlen;
+
+        // the row above's filter first; it usually wins again
+        best     = last;
+        best_sum = try_filter( last, row, prev, b->rowlen, b->size, dst + 1, 0x7FFFFFFFFFFFL );
+
+        for ( k = 0; k < 5; k++ )
+        {
+            if ( (t = k) == last )
+                continue;
+
+            sum = try_filter( t, row, prev, b->rowlen, b->size, scratch, best_sum );
+
+            if ( sum >= 0 && sum < best_sum )
+            {
+                best     = t;
+                best_sum = sum;
+                memcpy( dst + 1, scratch, b->rowlen );
+            }
+        }
+
+        dst[0] = best;
+        last   = best;
+    }
+}
+
+/*
+ * raw-deflate one block, primed with the 32K of filtered data before it
+ */
+static int deflate_block(struct png_job *j, int k)
+{
+    struct png_block *blk = &j->block[k];
+    unsigned char *in = j->filtered + blk->r0 * j->rawlen;
+    long len = (blk->r1 - blk->r0) * j->rawlen, dict = blk->r0 * j->rawlen;
+    z_stream s;
+    int r;
+
+    memset( &s, 0, sizeof(s) );
+
+    if ( deflateInit2(&s, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_FILTERED) != Z_OK )
+        return -1;
+
+    if ( dict > PNG_WINDOW )
+        dict = PNG_WINDOW;
+
+    if ( dict > 0 )
+        deflateSetDictionary( &s, in - dict, dict );
+
+    s.next_in   = in;
+    s.avail_in  = len;
+    s.next_out  = blk->out;
+    s.avail_out = compressBound( len ) + 64;
+
+    // all but the last block end byte-aligned and open, to be followed by the next
+    r = deflate( &s, (k == j->nblocks - 1) ? Z_FINISH : Z_SYNC_FLUSH );
+
+    blk->outlen = s.total_out;
+    blk->adler  = adler32( 1L, in, len );
+
+    deflateEnd( &s );
+
+    return (r == Z_STREAM_END || (r == Z_OK && s.avail_in == 0)) ? 0 : -1;
+}
+
+static void *png_worker(void *arg)
+{
+    struct png_job *j = arg;
+    unsigned char *scratch = malloc( 2 * j->c->b->rowlen );
+    int k;
+
+    while ( (k = __sync_fetch_and_add(&j->next_filter, 1)) < j->nblocks )
+        filter_rows( j, j->block[k].r0, j->block[k].r1, scratch );
+
+    free( scratch );
+
+    // every block's dictionary is the tail of the block before it
+    pthread_barrier_wait( &j->filtered_all );
+
+    while ( (k = __sync_fetch_and_add(&j->next_deflate, 1)) < j->nblocks )
+        if ( deflate_block(j, k) )
+            j->failed = 1;
+
+    return NULL;
+}
+
+/*
+ * append 'n' bytes of zlib stream to the IDAT chunks being written, starting
+ * a new chunk every PNG_IDAT_MAX bytes ('n' == 0 flushes)
+ */
+static long put_idat(FILE *out, unsigned char *buf, long *fill, const unsigned char *p, long n)
+{
+    unsigned char head[8], crc[4];
+    long written = 0, k;
+
+    do
+    {
+        k = (n < PNG_IDAT_MAX - *fill) ? n : PNG_IDAT_MAX - *fill;
+
+        memcpy( buf + *fill, p, k );
+        *fill += k;
+        p     += k;
+        n     -= k;
+
+        if ( *fill == PNG_IDAT_MAX || (n == 0 && k == 0 && *fill > 0) )
+        {
+            put32( head, *fill );
+            memcpy( head + 4, "IDAT", 4 );
+            put32( crc, crc32(crc32(0L, head + 4, 4), buf, *fill) );
+
+            written += fwrite( head, 1, 8, out ) + fwrite( buf, 1, *fill, out ) + fwrite( crc, 1, 4, out );
+            *fill = 0;
+        }
+    }
+    while ( n > 0 );
+
+    return written;
+}
+
+/*
+ * write the pixel matrix out as freshly deflated IDAT chunks, followed by
+ * whatever came after the IDATs in the base file
+ */
+int write_png(FILE *out, struct container *c)
+{
+    struct bitmap *b = c->b;
+    struct png *g = c->png;
+    struct png_job j;
+    pthread_t *tid;
+    unsigned char zhead[2] = { 0x78, 0x9C }, adler[4], *buf;
+    long rows, len, w = 0, fill = 0;
+    int k, threads = g->threads;
+    uLong check;
+
+    if ( threads <= 0 )
+        threads = sysconf( _SC_NPROCESSORS_ONLN );
+
+    memset( &j, 0, sizeof(j) );
+    j.c        = c;
+    j.rawlen   = b->rowlen + 1;
+    j.filtered = arena_alloc( &job_arena, (size_t)b->height * j.rawlen );
+
+    rows      = (PNG_BLOCK / j.rawlen > 0) ? PNG_BLOCK / j.rawlen : 1;
+    j.nblocks = (b->height + rows - 1) / rows;
+    j.block   = arena_alloc( &job_arena, j.nblocks * sizeof(*j.block) );
+
+    // output space is set aside up front; the arena isn't for threads
+    for ( k = 0; k < j.nblocks; k++ )
+    {
+        j.block[k].r0  = k * rows;
+        j.block[k].r1  = (k * rows + rows < b->height) ? k * rows + rows : b->height;
+        j.block[k].out = arena_alloc( &job_arena, compressBound((j.block[k].r1 - j.block[k].r0) * j.rawlen) + 64 );
+    }
+
+    if ( threads > j.nblocks )
+        threads = j.nblocks;
+
+    pthread_barrier_init( &j.filtered_all, NULL, threads );
+    tid = arena_alloc( &job_arena, threads * sizeof(*tid) );
+
+    for ( k = 0; k < threads; k++ )
+        pthread_create( &tid[k], NULL, png_worker, &j );
+
+    for ( k = 0; k < threads; k++ )
+        pthread_join( tid[k], NULL );
+
+    pthread_barrier_destroy( &j.filtered_all );
+
+    if ( j.failed )
+    {
+        fprintf( stderr, "[ERROR] deflate failed, aborting.\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    // one zlib stream: header, the blocks, and the combined check
+    buf   = arena_alloc( &job_arena, PNG_IDAT_MAX );
+    check = j.block[0].adler;
+
+    for ( k = 1; k < j.nblocks; k++ )
+        check = adler32_combine( check, j.block[k].adler, (j.block[k].r1 - j.block[k].r0) * j.rawlen );
+
+    put32( adler, check );
+
+    fseek( out, g->idat_start, SEEK_SET );
+
+    w += put_idat( out, buf, &fill, zhead, 2 );
+
+    for ( k = 0; k < j.nblocks; k++ )
+        w += put_idat( out, buf, &fill, j.block[k].out, j.block[k].outlen );
+
+    w += put_idat( out, buf, &fill, adler, 4 );
+    w += put_idat( out, buf, &fill, NULL, 0 );
+
+    // the chunks after the image data (IEND, at least), as they were
+    fseek( c->fp, g->idat_end, SEEK_SET );
+
+    while ( (len = fread(buf, 1, PNG_IDAT_MAX, c->fp)) > 0 )
+        w += fwrite( buf, 1, len, out );
+
+    return w;
+}
+
+/*
+ * wrapper function to block-copy everything before the image data
+ * (signature, IHDR, palette and ancillary chunks) to "target"
+ */
+int write_png_header(FILE *target, struct container *c)
+{
+    return block_copy( c->fp, target, c->png->idat_start );
+}
+
+/*
+ * ensure we're using an 8-bit RGB or RGBA, non-interlaced PNG with usable
+ * color channels, and that it has at least 8 pixels per payload byte
+ */
+void validate_png(struct container *c, struct payload *p)
+{
+    long pixels = (long)c->b->width * c->b->height;
+
+    if ( c->png->bit_depth != 8 || (c->png->color_type != 2 && c->png->color_type != 6) )
+    {
+        fprintf( stderr, "[ERROR] %s: unsupported PNG (bit depth %d, color type %d); "
+                         "it must be 8-bit RGB or RGBA.\n", c->filename, c->png->bit_depth, c->png->color_type );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( c->png->interlace || c->b->compression )
+    {
+        fprintf( stderr, "[ERROR] %s: interlaced PNGs are not supported.\n", c->filename );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( c->layout.lanes == 0 )
+    {
+        fprintf( stderr, "[ERROR] %s: none of the selected color channels is an 8-bit channel we can use.\n",
+                 c->filename );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( pixels / p->size < 8 )
+    {
+        fprintf( stderr,
+                "[ERROR] ratio of pixels in %s to bytes in %s must be greater than 8.\n\n"
+                "%s: %dx%d = %ld pixels\n"
+                "%s: %d bytes\n",
+                c->filename, p->filename, c->filename, c->b->width, c->b->height, pixels, p->filename, p->size );
+        exit( EXIT_FAILURE );
+    }
+}
+
+/*
+ * pretty-print some info for the user
+ */
+void show_png_info(struct container *c, struct payload *p)
+{
+    printf( "--[base file]------------------\n"
+            "file name  : %s\n"
+            "file size  : %d bytes\n"
+            "image data : %d bytes\n"
+            "PNG width  : %d pixels\n"
+            "PNG height : %d pixels\n"
+            "color      : %s, 8 bits per channel\n",
+            c->filename, c->filesize, c->png->idat_end - c->png->idat_start,
+            c->b->width, c->b->height, (c->png->color_type == 6) ? "RGBA" : "RGB" );
+
+    if ( c->layout.stride > 1 )
+        printf( "\nembedding in %d of %d bytes per pixel.\n", c->layout.lanes, c->layout.stride );
+
+    printf( "\n--[hide file]------------------\n"
+            "file name: %s\n"
+            "file size: %d bytes (IMPORTANT: this number is required to recover the file)\n", p->filename, p->datasize );
+
+    puts( "-------------------------------\n" );
+}
@@ -12,11 +12,37 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
 
 #define VERSION 0.8
 
 #define MAX_FILENAME_LENGTH 255
 
+#define MATRIX_MAX_K 8        // largest hamming code for matrix embedding: (255, 247)
+
+/*
+ * USDT probes, provider "steganographer", for bpftrace and friends (see the
+ * README).  with <sys/sdt.h> around each one is a single nop until a tracer
+ * attaches; without it (or with -DNO_PROBES) they compile to nothing, though
+ * the arguments still have to type-check
+ */
+#if defined(__has_include) && !defined(NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE1(name, a)           DTRACE_PROBE1( steganographer, name, a )
+#define PROBE2(name, a, b)        DTRACE_PROBE2( steganographer, name, a, b )
+#define PROBE3(name, a, b, c)     DTRACE_PROBE3( steganographer, name, a, b, c )
+#else
+#define PROBE1(name, a)           ((void)sizeof(a))
+#define PROBE2(name, a, b)        ((void)sizeof(a), (void)sizeof(b))
+#define PROBE3(name, a, b, c)     ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#endif
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
  * BMP specs from https://en.wikipedia.org/wiki/BMP_file_format  *
  *                                                               *
@@ -30,6 +56,9 @@
  * 12              4               bitmap width (pixels)         *
  * 16              4               bitmap height (pixels)        *
  * 1C              2               color depth (bits)            *
+ * 1E              4               compression method            *
+ * 36              12              red, green, blue bit masks    *
+ *                                 (BI_BITFIELDS only)           *
  *                                                               *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
@@ -41,17 +70,53 @@
 #define OFF_BITMAP_WIDTH    0x12
 #define OFF_BITMAP_HEIGHT   0x16
 #define OFF_BITMAP_DEPTH    0x1C
+#define OFF_COMPRESSION     0x1E
+#define OFF_COLOR_MASKS     0x36
+
+// compression methods we can embed in
+#define BI_RGB              0
+#define BI_BITFIELDS        3
 
-// operational state
-enum MODE { hide, recover } mode;
+// color channels, for --channels
+#define CHANNEL_BLUE        0x01
+#define CHANNEL_GREEN       0x02
+#define CHANNEL_RED         0x04
+#define CHANNEL_ALL         0x07
+
+// operational state (defined in main.c)
+enum MODE { hide, recover, update, apply, analysis, pack, tune, migration, live, verification, worker };
+extern enum MODE mode;
 
 // command-line args get stored here
 struct user_input
 {
     int  payload_size;
+    int  range_start;         // first payload byte to recover (--range)
+    int  range_end;           // one past the last payload byte to recover
+    short range_set;
+    int  update_offset;       // where an update's bytes go in the hidden stream (--offset)
     char basefile[MAX_FILENAME_LENGTH + 1];
     char hidefile[MAX_FILENAME_LENGTH + 1];
     char outputfile[MAX_FILENAME_LENGTH + 1];
+    char deltafile[MAX_FILENAME_LENGTH + 1];  // --delta; empty if unused
+    char destfile[MAX_FILENAME_LENGTH + 1];   // migrate mode: the new carrier (--to)
+    int  period;              // live mode: frames per period (--period)
+    int  lease;               // worker mode: seconds a claimed job is held for (--lease)
+    short drain;              // worker mode: stop once the spool is empty (--drain)
+    int  threads;             // worker threads (-j); 0 means one per cpu when analyzing,
+                              // and a single thread otherwise
+    int  fec;                 // Reed-Solomon parity bytes per codeword (--fec)
+    int  matrix;              // matrix embedding bits per block (--matrix)
+    double adaptive;          // adaptive embedding texture threshold (--adaptive), 0 if off
+    unsigned char channels;   // CHANNEL_* bits for bitmaps (--channels), 0 for all
+    uint64_t wav_channels;    // channel numbers for WAV files (--channels 0,2-5), 0 for all
+    short checkpoint;         // stream the job and checkpoint it (--checkpoint)
+    short resume;             // pick a checkpointed job back up (--resume)
+    short direct;             // bypass the page cache for the carrier (--direct)
+    short profile;            // use this host's autotune profile (off with --no-profile)
+    short merkle;             // hash the output into <output>.merkle (--merkle)
+    char **packfiles;         // pack mode: the payloads (trailing arguments)
+    int  npackfiles;
 };
 
 // everything we need to know about the payload
@@ -59,7 +124,11 @@ struct payload
 {
     char filename[MAX_FILENAME_LENGTH + 1];
     FILE *fp;
-    int  size;                // size of the file in bytes
+    int  size;                // size of the hidden stream in bytes
+    int  datasize;            // ... of which payload (the rest is FEC parity)
+    int  fec;                 // Reed-Solomon parity bytes per codeword, 0 for none
+    int  matrix;              // bits per block with matrix embedding, 0 for plain lsb
+    int  offset;              // byte position of 'bytes' within the hidden stream
     unsigned char *bytes;     // payload data
 };
 
@@ -71,6 +140,10 @@ struct bitmap
     int32_t width;            // bitmap width in pixels
     int32_t height;           // bitmap height in pixels
     int16_t depth;            // color depth in bits
+    int32_t compression;      // BI_RGB or BI_BITFIELDS
+    uint32_t color_mask[3];   // red, green and blue masks (BI_BITFIELDS)
+
+    unsigned char channel_mask;  // CHANNEL_* bits to embed in (set before get_bitmap_info)
 
     // derived data
     int32_t start;            // byte location of first pixel
@@ -106,12 +179,107 @@ struct pcm
 
     unsigned char *samples;  // the sample stream
 
+    uint64_t channel_mask;    // channels to embed in, a lane each (--channels); 0 for all, interleaved
+    int  threads;             // lane threads (-j), 0 for one per cpu
+
     // derived data
     int32_t data_offset;      // byte location of the sample data
     int16_t sample_size;      // size in bytes of one sample
     int64_t total_samples;    // total number of samples in file
 };
 
+// what we need to know about a PNG besides its pixels (which live in a
+// struct bitmap, as unpadded RGB or RGBA rows, top row first)
+struct png
+{
+    int32_t idat_start;       // file position of the first IDAT chunk
+    int32_t idat_end;         // one past the end of the last IDAT chunk
+    unsigned char bit_depth;  // bits per channel; we handle 8
+    unsigned char color_type; // 2 for RGB, 6 for RGBA
+    unsigned char interlace;  // 0 for none; we don't handle Adam7
+    int  threads;             // deflate threads for write_png(), 0 for one per cpu
+};
+
+#define JPEG_LOOKAHEAD 9      // Huffman codes up to this long decode with one lookup
+
+// one Huffman table, in the forms decoding and encoding want it
+struct jpeg_huff
+{
+    unsigned char bits[17];   // number of codes of each length 1..16
+    unsigned char vals[256];  // symbols, in code order
+    uint16_t fast[1 << JPEG_LOOKAHEAD];  // symbol << 8 | length, by the next bits; 0 if longer
+    int32_t  maxcode[17];     // largest code of each length, -1 for none
+    int32_t  mincode[17];     // ... and smallest
+    int32_t  valptr[17];      // index in vals of the smallest code of each length
+    uint16_t code[256];       // encoding: the code of each symbol
+    unsigned char size[256];  // ... and its length, 0 if the table lacks it
+};
+
+// a color component of a JPEG, as its frame and scan headers describe it
+struct jpeg_component
+{
+    int id;
+    int h, v;                 // sampling factors
+    int dc, ac;               // Huffman table selectors
+};
+
+// everything we need to know about a baseline JPEG; its quantized DCT
+// coefficients are the carrier
+struct jpeg
+{
+    unsigned char *file;      // the whole file
+    int32_t scan_start;       // file position of the entropy-coded data
+    int32_t scan_end;         // ... and of the marker that ends it
+    int32_t width, height;    // in pixels
+
+    int  ncomps;
+    struct jpeg_component comp[4];
+    struct jpeg_huff huff[8]; // DC tables 0-3, then AC tables 0-3
+
+    int  mcu_blocks;          // blocks per MCU
+    unsigned char mcu_comp[10];  // ... and which component each belongs to
+    long mcus;                // MCUs in the scan
+    long restart;             // MCUs per restart interval (all of them without DRI)
+
+    int  nintervals;          // restart intervals
+    long *iv_start;           // file position of each interval's data
+    long *iv_len;             // ... and its length, restart marker excluded
+    long *iv_units;           // carrier units before each interval (nintervals + 1 entries)
+
+    int16_t *coef;            // 64 coefficients per block, in zigzag order; blocks in MCU order
+    int  threads;             // coding threads, 0 for one per cpu
+};
+
+/*
+ * where a carrier keeps its payload bits, filled in by the format's get_info
+ * callback and consumed by the one embed/extract engine in stego.c.  the
+ * units (bytes whose lsb holds a payload bit) come in 'runs' runs, bitmap rows
+ * for instance, 'run_stride' bytes apart.  each run is 'groups' groups of
+ * 'stride' bytes (a pixel, a sample), and bit k of 'lane_mask' says byte k of
+ * every group is a unit.  set_layout() derives the rest
+ */
+struct layout
+{
+    long offset;              // file position of the first run
+    long runs;                // number of runs
+    long run_stride;          // bytes from the start of one run to the next
+    long groups;              // groups per run
+    int  stride;              // bytes per group; the vector kernels take up to 16
+    unsigned lane_mask;       // which bytes of a group are units (the first 16 at most)
+
+    // derived
+    int  lanes;               // units per group
+    unsigned char lane[16];   // ... and their positions in the group, ascending
+    long run_units;           // units per run
+};
+
+// a run of consecutive carrier units
+struct span
+{
+    long start;               // first unit
+    long len;                 // number of units
+};
+
 // generic data container, an abstraction for the various data "classes"
 struct container
 {
@@ -119,17 +287,137 @@ struct container
     char filename[MAX_FILENAME_LENGTH + 1];
     int32_t filesize;
 
-    enum { bitmap, wavfile } type;
+    enum { bitmap, wavfile, pngfile, jpegfile } type;
 
     struct bitmap *b;
     struct pcm *w;
+    struct png *png;          // PNG chunk data; the pixels are in 'b'
+    struct jpeg *jpg;
+
+    struct layout layout;     // where the payload bits go
+
+    // threaded jobs (-j): how the carrier is split between threads and nodes
+    struct numa_plan *numa;
+
+    // --direct: the aligned image of the file the data above points into
+    unsigned char *image;
+
+    // adaptive embedding: the carrier units selected to hold the payload
+    struct span *spans;
+    long nspans;
+};
+
+#define PIPE_MAX_STAGES 8
+
+// a block of the stream passing through a pipeline
+struct pipe_block
+{
+    unsigned char *data;
+    long pos;                 // stream position of data[0]
+    long len;                 // bytes in the block
+    int  last;                // 1 for the stream's last block
 };
 
+// one step of a pipeline; process() gets NULL for 'in' in the first stage
+// and for 'out' in the last, and what it returns is added up in 'count'
+struct pipe_stage
+{
+    const char *name;
+    long (*process)(struct pipe_stage *, const struct pipe_block *in, struct pipe_block *out);
+    void *arg;
+    long count;
+};
+
+// a chain of stages joined by rings of blocks (see pipeline.c)
+struct pipeline
+{
+    struct pipe_stage stage[PIPE_MAX_STAGES];
+    unsigned char *place[PIPE_MAX_STAGES];   // buffer a stage's output ring is placed on, or NULL
+    struct pipe_ring *ring[PIPE_MAX_STAGES];
+    int  nstages;
+    long total;               // bytes in the stream
+    long block;               // bytes per block
+};
+
+// one chunk of arena memory; allocations are carved from just past the header
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t len;               // size of the mapping in bytes
+    size_t used;              // bytes handed out so far (including this header)
+    int    huge;              // 1 if backed by explicit huge pages
+};
+
+// bump allocator: everything a job allocates, released with one reset
+struct arena
+{
+    struct arena_chunk *head;
+    size_t mapped;            // total bytes mapped
+    size_t huge;              // ... of which backed by MAP_HUGETLB pages
+};
+
+extern struct arena job_arena;
+
+// format callbacks for the carrier at hand (defined in main.c)
+extern void (*get_info)(struct container *);
+extern int  (*get_data)(struct container *);
+extern void (*show_info)(struct container *, struct payload *);
+extern int  (*write_data)(FILE *, struct container *);
+extern int  (*write_header)(FILE *, struct container *);
+extern void (*init_data_storage)(struct container *);
+extern void (*validate_data)(struct container *, struct payload *);
+extern int  (*mode_action)(struct container *, struct payload *);
+
 // stego.c -- the hide and recover routines
 int bitmap_cover(struct container *, struct payload *);
 int bitmap_uncover(struct container *, struct payload *);
 int pcm_cover(struct container *, struct payload *);
 int pcm_uncover(struct container *, struct payload *);
+int uncover_range(struct container *, struct payload *);
+long carrier_offset(struct container *, long);
+int carrier_capacity(struct container *);
+long carrier_units(struct container *);
+long carrier_data_end(struct container *);
+unsigned char *carrier_unit(struct container *, long, long *, int *);
+unsigned char *read_carrier_span(struct container *, long, long, long *);
+long cover_units(struct container *, struct payload *, long, long);
+void show_quality(struct container *, long);
+int  uncover_units(struct container *, struct payload *, long, long);
+void set_layout(struct layout *);
+extern int vector_kernels;
+
+// numa.c -- threaded, NUMA-aware loading and embedding
+int  numa_load(struct container *, int);
+int  numa_cover(struct container *, struct payload *);
+int  numa_uncover(struct container *, struct payload *);
+
+// direct.c -- O_DIRECT carrier i/o
+int  direct_load(struct container *);
+int  direct_write(struct container *, const char *);
+extern long direct_request;
+
+// pipeline.c -- streaming payload pipelines
+void pipe_init(struct pipeline *, long, long);
+void pipe_add(struct pipeline *, const char *,
+              long (*)(struct pipe_stage *, const struct pipe_block *, struct pipe_block *), void *, unsigned char *);
+void pipe_run(struct pipeline *);
+int  pipeline_cover(struct container *, struct payload *);
+int  pipeline_uncover(struct container *, struct payload *);
+
+// update.c -- in-place payload updates
+int update_in_place(struct container *, struct payload *);
+
+// delta.c -- compact carrier deltas
+int write_delta(FILE *, struct container *, struct payload *);
+int apply_delta(const char *, const char *);
+
+// checkpoint.c -- resumable hide and recover jobs
+long checkpoint_run(struct container *, struct payload *, const char *, int);
+
+// arena.c -- huge-page arena allocator
+void *arena_alloc(struct arena *, size_t);
+void arena_reset(struct arena *);
+void arena_destroy(struct arena *);
 
 // memory.c -- heap managament
 void init_pixel_matrix(struct container *);
@@ -143,8 +431,49 @@ int  write_payload(FILE *, struct payload *);
 int  block_copy(FILE *, FILE *, int);
 FILE *open_file(const char *, char (*)[MAX_FILENAME_LENGTH + 1]);
 
+// migrate.c -- carrier-to-carrier payload moves
+long migrate(struct user_input *);
+
+// merkle.c -- output hashing and verification
+FILE *merkle_fopen(const char *);
+void merkle_file(const char *, int);
+long merkle_verify(const char *, int);
+
+// live.c -- real-time embedding in a PCM stream
+long live_embed(struct user_input *);
+
+// worker.c -- spool-directory workers
+int worker_run(struct user_input *);
+
+// pack.c -- many payloads into a carrier pool
+int  pack_payloads(struct user_input *);
+
+// autotune.c -- per-host engine and i/o tuning
+int  autotune(const char *, const char *);
+void load_profile(struct user_input *);
+
+// analyze.c -- steganalysis
+int  analyze(const char *, int);
+
+// fec.c -- reed-solomon error correction
+int  fec_encoded_size(int, int);
+void fec_encode(struct payload *);
+int  fec_decode(struct payload *);
+
+// adaptive.c -- texture-guided embedding
+long adaptive_select(struct container *, double, long);
+int  adaptive_cover(struct container *, struct payload *);
+int  adaptive_uncover(struct container *, struct payload *);
+
+// matrix.c -- matrix embedding
+long matrix_units(int, int);
+int  matrix_cover(struct container *, struct payload *);
+int  matrix_uncover(struct container *, struct payload *);
+
 // helpers.c -- aux routines
+int  magic_type(const unsigned char *);
 int  find_type(const char *);
+void bind_carrier(struct container *, unsigned char, uint64_t);
 void parse_args(int, char **, struct user_input *);
 void show_status(struct user_input *);
 void show_usage(void);
@@ -166,5 +495,26 @@ int  pcm_find_string(char *, FILE *);
 int  write_pcm_header(FILE *, struct container *);
 void show_pcm_info(struct container *, struct payload *);
 void validate_wavfile(struct container *, struct payload *);
+int  pcm_lane_cover(struct container *, struct payload *);
+int  pcm_lane_uncover(struct container *, struct payload *);
+
+// png.c -- PNG carriers
+void get_png_info(struct container *);
+int  get_png(struct container *);
+int  write_png(FILE *, struct container *);
+int  write_png_header(FILE *, struct container *);
+void validate_png(struct container *, struct payload *);
+void show_png_info(struct container *, struct payload *);
+
+// jpeg.c -- JPEG carriers
+void get_jpeg_info(struct container *);
+int  get_jpeg(struct container *);
+int  write_jpeg(FILE *, struct container *);
+int  write_jpeg_header(FILE *, struct container *);
+void validate_jpeg(struct container *, struct payload *);
+void show_jpeg_info(struct container *, struct payload *);
+void init_jpeg_storage(struct container *);
+int  jpeg_cover(struct container *, struct payload *);
+int  jpeg_uncover(struct container *, struct payload *);
 
 #endif
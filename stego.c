@@ -8,6 +8,12 @@
  */
 
 #include "steganographer.h"
+#include <stdint.h>
+#include <math.h>
+#include <immintrin.h>
+
+static int layout_cover(struct container *, struct payload *);
+static int layout_uncover(struct container *, struct payload *);
 
 /*
  * steganography comes from the Greek 'steganos', meaning 'covered'.
@@ -18,142 +24,579 @@
  * to the current bit from the current payload byte.  in this way, all n bits
  * in the payload are distributed throughout the first n bytes of the base
  * file, achieving lsb steganography.
+ *
+ * which bytes those are is up to the carrier's layout (see set_layout()), so
+ * the walk itself is shared by every format
  */
 int bitmap_cover(struct container *c, struct payload *p)
 {
-    int i, j, bitcount, bytecount, lastbyte;
-
     printf( "mixing bits from %s into image from %s...\n", p->filename, c->filename );
 
-    bitcount  = 0;
-    bytecount = 0;
-    lastbyte  = c->b->rowlen - c->b->pad; // marks the last non-pad byte
+    return layout_cover( c, p );
+}
+
+/*
+ * store the lsb of each carrier byte in the payload structure until we've
+ * recovered the complete file
+ */
+int bitmap_uncover(struct container *c, struct payload *p)
+{
+    return layout_uncover( c, p );
+}
 
-    for ( i = 0; i < c->b->height; i++ )
+/*
+ * pcm equivalent of bitmap_cover(); one bit per sample
+ */
+int pcm_cover(struct container *c, struct payload *p)
+{
+    printf( "mixing bits from %s into sample data from %s...\n", p->filename, c->filename );
+
+    return layout_cover( c, p );
+}
+
+/*
+ * pcm equivalent of bitmap_uncover()
+ */
+int pcm_uncover(struct container *c, struct payload *p)
+{
+    return layout_uncover( c, p );
+}
+
+/*
+ * fill in the derived half of a layout from its lane mask
+ */
+void set_layout(struct layout *l)
+{
+    int k;
+
+    if ( l->stride < 1 )
+        l->stride = 1;
+
+    l->lanes = 0;
+
+    for ( k = 0; k < l->stride && k < 16; k++ )
+        if ( l->lane_mask & (1u << k) )
+            l->lane[l->lanes++] = k;
+
+    l->run_units = l->groups * l->lanes;
+}
+
+/*
+ * the loaded carrier, laid out as in the file from layout.offset on (the
+ * pixel rows share one block, see init_pixel_matrix())
+ */
+static unsigned char *carrier_base(struct container *c)
+{
+    return (c->type == wavfile) ? c->w->samples : c->b->pixel[0];
+}
+
+/*
+ * the engine works on sixteen bytes at a time: 16 / stride whole groups,
+ * holding at most sixteen units.  for each of the sixteen bytes, 'shuf' names
+ * which byte of a two-byte window of payload bits holds its unit, and 'sel'
+ * which bit of that byte; bytes that aren't units (alpha, unused channels,
+ * the high bytes of a sample, the tail of a group that doesn't fill the
+ * vector) get 0x80 and 0, so PSHUFB zeroes them and they're written back
+ * untouched.  'gather' is the inverse, unit n's byte moves to byte 15 - n so
+ * that PMOVMSKB produces the window msb first.
+ */
+struct layout_tables
+{
+    unsigned char shuf[16];
+    unsigned char sel[16];
+    unsigned char gather[16];
+    int groups;               // groups per vector
+    int units;                // units per vector
+};
+
+static void init_layout_tables(struct layout *l, struct layout_tables *t)
+{
+    int q, k, pos, n;
+
+    memset( t->shuf, 0x80, sizeof(t->shuf) );
+    memset( t->sel, 0, sizeof(t->sel) );
+    memset( t->gather, 0x80, sizeof(t->gather) );
+
+    t->groups = 16 / l->stride;
+    t->units  = t->groups * l->lanes;
+
+    for ( q = 0; q < t->groups; q++ )
     {
-        for ( j = 0; j < c->b->rowlen; j++ )
+        for ( k = 0; k < l->lanes; k++ )
         {
-            if ( j == lastbyte )
-                break;
+            pos = q * l->stride + l->lane[k];
+            n   = q * l->lanes + k;
 
-            // set the lsb of the pixel byte to the value of the current payload bit (see NOTE at end of this file)
-            c->b->pixel[i][j] = (c->b->pixel[i][j] & ~1) | (1 & (p->bytes[bytecount] >> (7 - (bitcount % 8))));
+            t->shuf[pos]      = n / 8;
+            t->sel[pos]       = 0x80 >> (n % 8);
+            t->gather[15 - n] = pos;
+        }
+    }
+}
 
-            bitcount++;
+/*
+ * the 16 payload bits starting at bit 'n', msb first (zeros past the end)
+ */
+static inline unsigned get_window(struct payload *p, long n)
+{
+    long i = n / 8;
+    uint32_t v = p->bytes[i] << 16;
 
-            if ( (bitcount % 8) == 0 )
-                bytecount++;
+    if ( i + 1 < p->size )
+        v |= p->bytes[i + 1] << 8;
 
-            // done, bail out of the loops with the mighty GOTO
-            if ( bytecount == p->size )
-                goto GALOIS_FIELD_2;
-        }
+    if ( i + 2 < p->size )
+        v |= p->bytes[i + 2];
+
+    return (v << (n % 8)) >> 8 & 0xFFFF;
+}
+
+/*
+ * OR a window of 'k' bits, msb first, into the payload at bit 'n'.  only the
+ * bytes the window actually reaches are touched, so threads working on
+ * byte-aligned slices of the payload never write each other's bytes
+ */
+static inline void put_window(struct payload *p, long n, unsigned w, int k)
+{
+    long i = n / 8;
+    uint32_t v = (w << 8) >> (n % 8);
+
+    p->bytes[i] |= v >> 16;
+
+    if ( n % 8 + k > 8 )
+        p->bytes[i + 1] |= v >> 8;
+
+    if ( n % 8 + k > 16 )
+        p->bytes[i + 2] |= v;
+}
+
+/*
+ * embed whole vectors into groups [q, qend) of one run for as long as the
+ * groups and the units below 'end' last; returns the first group not done,
+ * and advances *bit
+ */
+__attribute__((target("ssse3")))
+static long cover_run_ssse3(struct layout *l, struct layout_tables *t, unsigned char *run, struct payload *p,
+                            long q, long qend, long *bit, long end, long *changed)
+{
+    const __m128i shuf = _mm_loadu_si128( (const __m128i *)t->shuf );
+    const __m128i sel  = _mm_loadu_si128( (const __m128i *)t->sel );
+    const __m128i one  = _mm_set1_epi8( 1 );
+    const __m128i lsb  = _mm_min_epu8( sel, one );
+    __m128i flips      = _mm_setzero_si128();
+    __m128i old;
+
+    for ( ; q * l->stride + 16 <= qend * l->stride && end - *bit >= t->units; q += t->groups, *bit += t->units )
+    {
+        unsigned w = get_window( p, *bit );
+        __m128i v  = _mm_cvtsi32_si128( (w >> 8) | ((w & 0xFF) << 8) );
+        __m128i px = _mm_loadu_si128( (const __m128i *)(run + q * l->stride) );
+
+        // each unit's payload bit as 0 or 1 in its own byte, zeros elsewhere
+        v   = _mm_min_epu8( _mm_and_si128(_mm_shuffle_epi8(v, shuf), sel), one );
+        old = px;
+        px  = _mm_or_si128( _mm_andnot_si128(lsb, px), v );
+
+        // every flipped lsb is a squared error of one; PSADBW adds them up
+        flips = _mm_add_epi64( flips, _mm_sad_epu8(_mm_xor_si128(old, px), _mm_setzero_si128()) );
+
+        _mm_storeu_si128( (__m128i *)(run + q * l->stride), px );
     }
 
-GALOIS_FIELD_2:
-    return 0;
+    *changed += _mm_cvtsi128_si64( flips ) + _mm_cvtsi128_si64( _mm_unpackhi_epi64(flips, flips) );
+
+    return q;
+}
+
+__attribute__((target("ssse3")))
+static long uncover_run_ssse3(struct layout *l, struct layout_tables *t, unsigned char *run, struct payload *p,
+                              long q, long qend, long *bit, long end)
+{
+    const __m128i gather = _mm_loadu_si128( (const __m128i *)t->gather );
+
+    for ( ; q * l->stride + 16 <= qend * l->stride && end - *bit >= t->units; q += t->groups, *bit += t->units )
+    {
+        __m128i px = _mm_loadu_si128( (const __m128i *)(run + q * l->stride) );
+
+        // lsbs up to the sign bits, in window order
+        px = _mm_slli_epi16( _mm_shuffle_epi8(px, gather), 7 );
+
+        put_window( p, *bit, _mm_movemask_epi8(px), t->units );
+    }
+
+    return q;
+}
+
+// 0 keeps the engine on the scalar loops even where SSSE3 is available
+// (set from the autotune profile)
+int vector_kernels = 1;
+
+static int have_ssse3(void)
+{
+    static int ssse3 = -1;
+
+    if ( ssse3 < 0 )
+    {
+        __builtin_cpu_init();
+        ssse3 = __builtin_cpu_supports( "ssse3" );
+    }
+
+    return ssse3 && vector_kernels;
 }
 
 /*
- * iterate through each byte in the pixel matrix (stepping over the pad bytes),
- * and store each lsb in the payload structure until we've recovered the
- * complete file
+ * set the lsb of units [u0, u1) to payload bits [u0, u1), run by run.  u0
+ * has to start a group.  whatever the vector kernel leaves of a run (its
+ * tail, or all of it without SSSE3) goes a group at a time (see NOTE at the
+ * end of this file).  only the bytes of those units' groups are written, so
+ * threads can cover disjoint, group-aligned ranges of one carrier.
+ *
+ * returns the number of units whose lsb actually flipped
  */
-int bitmap_uncover(struct container *c, struct payload *p)
+long cover_units(struct container *c, struct payload *p, long u0, long u1)
 {
-    int i, j, bitcount, bytecount, lastbyte;
-    int bits[8]; // temp storage
+    struct layout *l = &c->layout;
+    struct layout_tables t;
+    long r, q, qend, bit = u0, changed = 0;
+    int k, b, ssse3 = have_ssse3() && l->stride <= 16;
+    unsigned char *run, *g;
+
+    if ( l->run_units == 0 )
+        return 0;
 
-    bitcount  = 0;
-    bytecount = 0;
-    lastbyte  = c->b->rowlen - c->b->pad; // marks the last non-pad byte
+    PROBE2( cover_start, u0, u1 );
 
-    for ( i = 0; i < c->b->height; i++ )
+    init_layout_tables( l, &t );
+
+    while ( bit < u1 )
     {
-        for ( j = 0; j < c->b->rowlen; j++ )
-        {
-            if ( j == lastbyte )
-                break;
+        r    = bit / l->run_units;
+        q    = (bit % l->run_units) / l->lanes;
+        qend = (u1 - r * l->run_units + l->lanes - 1) / l->lanes;
 
-            // the bit assignment can be accomplished in one line:
-            //
-            //   p->bytes[bytecount] |= (b->pixel[i][j] & 1) << (7 - (bitcount % 8));
-            //
-            // but i'm spelling it all out to make it more clear
+        if ( qend > l->groups )
+            qend = l->groups;
 
-            bits[bitcount % 8] = c->b->pixel[i][j] & 1; // get lsb from each byte
+        run = carrier_base( c ) + r * l->run_stride;
 
-            bitcount++;
+        if ( ssse3 )
+            q = cover_run_ssse3( l, &t, run, p, q, qend, &bit, u1, &changed );
+
+        for ( ; q < qend && bit < u1; q++ )
+        {
+            g = run + q * l->stride;
 
-            if ( (bitcount % 8) == 0 )
+            // bytes whose lsb already matches aren't stored to at all
+            for ( k = 0; k < l->lanes && bit < u1; k++, bit++ )
             {
-                p->bytes[bytecount] = (bits[0] << 7) | (bits[1] << 6) | (bits[2] << 5) |
-                                      (bits[3] << 4) | (bits[4] << 3) | (bits[5] << 2) |
-                                      (bits[6] << 1) | (bits[7] << 0);
+                b = 1 & (p->bytes[bit / 8] >> (7 - (bit % 8)));
 
-                bytecount++;
+                if ( (g[l->lane[k]] & 1) != b )
+                {
+                    g[l->lane[k]] = (g[l->lane[k]] & ~1) | b;
+                    changed++;
+                }
             }
+        }
+    }
+
+    PROBE3( cover_done, u0, u1, changed );
+
+    return changed;
+}
+
+/*
+ * OR the lsbs of units [u0, u1) into payload bits [u0, u1), msb first.  u0
+ * has to start a group, and for threads to share a payload, a byte
+ */
+int uncover_units(struct container *c, struct payload *p, long u0, long u1)
+{
+    struct layout *l = &c->layout;
+    struct layout_tables t;
+    long r, q, qend, bit = u0;
+    int k, ssse3 = have_ssse3() && l->stride <= 16;
+    unsigned char *run, *g;
 
-            if ( bytecount == p->size )
-                goto RIEMANNIAN_MANIFOLD;
+    if ( l->run_units == 0 )
+        return 0;
+
+    PROBE2( uncover_start, u0, u1 );
+
+    init_layout_tables( l, &t );
+
+    while ( bit < u1 )
+    {
+        r    = bit / l->run_units;
+        q    = (bit % l->run_units) / l->lanes;
+        qend = (u1 - r * l->run_units + l->lanes - 1) / l->lanes;
+
+        if ( qend > l->groups )
+            qend = l->groups;
+
+        run = carrier_base( c ) + r * l->run_stride;
+
+        if ( ssse3 )
+            q = uncover_run_ssse3( l, &t, run, p, q, qend, &bit, u1 );
+
+        for ( ; q < qend && bit < u1; q++ )
+        {
+            g = run + q * l->stride;
+
+            for ( k = 0; k < l->lanes && bit < u1; k++, bit++ )
+                p->bytes[bit / 8] |= (g[l->lane[k]] & 1) << (7 - (bit % 8));
         }
     }
 
-RIEMANNIAN_MANIFOLD:
+    PROBE2( uncover_done, u0, u1 );
+
     return 0;
 }
 
+static int layout_cover(struct container *c, struct payload *p)
+{
+    long total = 8L * p->size;
+
+    if ( total > carrier_units(c) )
+        total = carrier_units( c );
+
+    show_quality( c, cover_units(c, p, 0, total) );
+
+    return 0;
+}
+
+static int layout_uncover(struct container *c, struct payload *p)
+{
+    long total = 8L * p->size;
+
+    if ( total > carrier_units(c) )
+        total = carrier_units( c );
+
+    memset( p->bytes, 0, p->size );
+
+    return uncover_units( c, p, 0, total );
+}
+
 /*
- * pcm equivalent of bitmap_cover()
+ * sum of squared sample values over the whole sample stream, the signal
+ * power for the SNR.  16-bit audio, by far the most common, goes eight
+ * samples at a time with PMADDWD
  */
-int pcm_cover(struct container *c, struct payload *p)
+static double signal_energy(struct pcm *w)
 {
-    int i, bitcount, bytecount;
+    const unsigned char *s = w->samples;
+    long i, n = w->subchunk2size / w->sample_size;
+    double e = 0;
 
-    printf( "mixing bits from %s into sample data from %s...\n", p->filename, c->filename );
+    if ( w->sample_size == 2 )
+    {
+        __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+        uint64_t lanes[2];
 
-    bitcount  = 0;
-    bytecount = 0;
+        for ( i = 0; i + 8 <= n; i += 8 )
+        {
+            // pairs of squares fit in 32 unsigned bits, then widen to 64
+            __m128i v  = _mm_loadu_si128( (const __m128i *)(s + 2 * i) );
+            __m128i sq = _mm_madd_epi16( v, v );
+
+            acc = _mm_add_epi64( acc, _mm_unpacklo_epi32(sq, zero) );
+            acc = _mm_add_epi64( acc, _mm_unpackhi_epi32(sq, zero) );
+        }
+
+        _mm_storeu_si128( (__m128i *)lanes, acc );
+        e = (double)lanes[0] + (double)lanes[1];
+
+        for ( ; i < n; i++ )
+        {
+            int16_t x = s[2 * i] | (s[2 * i + 1] << 8);
+
+            e += (double)x * x;
+        }
+
+        return e;
+    }
+
+    for ( i = 0; i < n; i++, s += w->sample_size )
+    {
+        double x;
+
+        if ( w->sample_size == 3 )
+            x = (int32_t)((uint32_t)(s[0] | (s[1] << 8) | (s[2] << 16)) << 8) >> 8;
+        else if ( w->sample_size == 4 )
+            x = (int32_t)(s[0] | (s[1] << 8) | (s[2] << 16) | ((uint32_t)s[3] << 24));
+        else
+            x = s[0] - 128;
 
-    // iterate through each sample (not each byte)
-    for ( i = 0; i < c->w->subchunk2size; i += c->w->sample_size )
+        e += x * x;
+    }
+
+    return e;
+}
+
+/*
+ * report the distortion a hide job caused, from the number of lsbs it flipped.
+ * a flipped lsb changes its pixel byte or sample by exactly one, so the sum of
+ * squared errors is just that count; the carrier was never re-read for this.
+ * images get PSNR over the color bytes that could have carried a bit (not
+ * alpha, nor channels left out by --channels), audio the SNR against the
+ * signal power (and PSNR against full scale)
+ */
+void show_quality(struct container *c, long changed)
+{
+    double mse, peak;
+
+    if ( changed == 0 )
     {
-        // set the lsb of each sample to the value of the current payload bit (see NOTE at bottom)
-        c->w->samples[i] = (c->w->samples[i] & ~1) | (1 & (p->bytes[bytecount] >> (7 - (bitcount % 8))));
+        printf( "quality: no carrier bytes changed.\n" );
+        return;
+    }
 
-        bitcount++;
+    if ( c->type == jpegfile )
+    {
+        printf( "quality: %ld of %ld usable DCT coefficients changed.\n", changed, carrier_units(c) );
+        return;
+    }
 
-        if ( (bitcount % 8) == 0 )
-            bytecount++;
+    if ( c->type != wavfile )
+    {
+        mse = (double)changed / carrier_units( c );
 
-        // done, bail out of the loop
-        if ( bytecount == p->size )
-            break;
+        printf( "quality: %ld carrier bytes changed, PSNR %.2f dB\n", changed, 10 * log10(255.0 * 255.0 / mse) );
+        return;
     }
 
-    return 0;
+    mse  = (double)changed / c->layout.groups;
+    peak = ldexp( 1.0, 8 * c->w->sample_size - 1 );
+
+    printf( "quality: %ld samples changed, SNR %.2f dB, PSNR %.2f dB\n", changed,
+            10 * log10(signal_energy(c->w) / changed), 10 * log10(peak * peak / mse) );
 }
 
 /*
- * pcm equivalent of bitmap_uncover()
+ * file position of the carrier byte whose lsb holds payload bit number 'bit':
+ * skip whole runs first, then whole groups, then step into the group
  */
-int pcm_uncover(struct container *c, struct payload *p)
+long carrier_offset(struct container *c, long bit)
+{
+    struct layout *l = &c->layout;
+    long u = bit % l->run_units;
+
+    return l->offset + (bit / l->run_units) * l->run_stride + (u / l->lanes) * l->stride + l->lane[u % l->lanes];
+}
+
+/*
+ * address of carrier unit n (the byte whose lsb holds payload bit n) in the
+ * loaded carrier.  'run' receives how many units from there on are evenly
+ * spaced, and 'stride' how far apart they are
+ */
+unsigned char *carrier_unit(struct container *c, long n, long *run, int *stride)
 {
-    int i, bitcount = 0, bytecount = 0;
+    struct layout *l = &c->layout;
+    long u = n % l->run_units;
 
-    // iterate through each sample
-    for ( i = 0; i < c->w->subchunk2size; i += c->w->sample_size )
+    // one lane per group is evenly spaced; several aren't
+    *run    = (l->lanes == 1) ? l->run_units - u : 1;
+    *stride = l->stride;
+
+    return carrier_base( c ) + (n / l->run_units) * l->run_stride + (u / l->lanes) * l->stride + l->lane[u % l->lanes];
+}
+
+/*
+ * number of carrier bytes that can hold a payload bit
+ */
+long carrier_units(struct container *c)
+{
+    return c->layout.runs * c->layout.run_units;
+}
+
+/*
+ * one past the last byte of the pixel matrix or sample data in the file
+ */
+long carrier_data_end(struct container *c)
+{
+    if ( c->type == bitmap )
+        return c->b->start + (long)c->b->height * c->b->rowlen;
+
+    return c->w->data_offset + (long)c->w->subchunk2size;
+}
+
+/*
+ * number of payload bytes the carrier can hold
+ */
+int carrier_capacity(struct container *c)
+{
+    return carrier_units( c ) / 8;
+}
+
+/*
+ * read the stretch of the carrier file that holds payload bits
+ * [firstbit, firstbit + nbits) into a fresh buffer from the job arena.  'base' receives the file
+ * position of buf[0], so the byte for bit n is buf[carrier_offset(c, n) - base]
+ */
+unsigned char *read_carrier_span(struct container *c, long firstbit, long nbits, long *base)
+{
+    long last, span;
+    unsigned char *buf;
+
+    *base = carrier_offset( c, firstbit );
+    last  = carrier_offset( c, firstbit + nbits - 1 );
+    span  = last - *base + 1;
+
+    buf = arena_alloc( &job_arena, span );
+
+    fseek( c->fp, *base, SEEK_SET );
+
+    if ( fread(buf, 1, span, c->fp) != (size_t)span )
+    {
+        fprintf( stderr, "[ERROR] %s: short read while seeking payload bytes, aborting.\n", c->filename );
+        exit( EXIT_FAILURE );
+    }
+
+    return buf;
+}
+
+/*
+ * recover payload bytes [p->offset, p->offset + p->size) without loading the
+ * rest of the carrier.  the carrier position of any payload bit is directly
+ * computable, so we seek to the first carrier byte we need, read the span
+ * that covers the requested bits, and pull the lsbs out of that.  a PNG's
+ * pixels and a JPEG's coefficients have no file positions; they're loaded
+ * whole and read in place.
+ */
+int uncover_range(struct container *c, struct payload *p)
+{
+    long base, bit, run;
+    int bytecount, stride;
+    unsigned char *buf;
+
+    if ( c->type == jpegfile )
+        return jpeg_uncover( c, p );
+
+    if ( c->type == pngfile )
     {
-        // build each byte one LSB at a time
-        p->bytes[bytecount] |= (c->w->samples[i] & 1) << (7 - (bitcount % 8));
+        for ( bytecount = 0, bit = 8L * p->offset; bytecount < p->size; bytecount++ )
+        {
+            int k;
+
+            p->bytes[bytecount] = 0;
 
-        bitcount++;
+            for ( k = 7; k >= 0; k--, bit++ )
+                p->bytes[bytecount] |= (*carrier_unit(c, bit, &run, &stride) & 1) << k;
+        }
+
+        return 0;
+    }
+
+    buf = read_carrier_span( c, 8L * p->offset, 8L * p->size, &base );
+    bit = 8L * p->offset;
+
+    for ( bytecount = 0; bytecount < p->size; bytecount++ )
+    {
+        int k;
 
-        if ( (bitcount % 8) == 0 )
-            bytecount++;
+        p->bytes[bytecount] = 0;
 
-        if ( bytecount == p->size )
-            break;
+        for ( k = 7; k >= 0; k--, bit++ )
+            p->bytes[bytecount] |= (buf[carrier_offset(c, bit) - base] & 1) << k;
     }
 
     return 0;
@@ -161,7 +604,9 @@ int pcm_uncover(struct container *c, struct payload *p)
 
 /**** NOTE ****
 
-The hairy expression in the bitmap_cover() function is
+The hairy expression in the layout_cover() function, which does the work for
+bitmap_cover() and pcm_cover(), is (for a 24-bit bitmap, where the units are
+just the pixel bytes)
 
     b->pixel[i][j] = (b->pixel[i][j] & ~1) | (1 & (p->bytes[bytecount] >> (7 - (bitcount % 8))));
 
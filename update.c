@@ -0,0 +1,93 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, update.c
+ *
+ * in-place updates of an already hidden payload
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <fcntl.h>   // for open()
+#include <unistd.h>  // for pwrite()
+
+// changed carrier bytes closer together than this are written with a single
+// pwrite(); rewriting a few unchanged bytes in between is cheaper than the
+// extra system calls, and they land on the same page anyway
+#define UPDATE_MAX_GAP 64
+
+/*
+ * flush carrier bytes [from, to] of the span buffer back to the carrier file
+ */
+static void flush_run(int fd, struct container *c, unsigned char *buf, long base, long from, long to)
+{
+    long len = to - from + 1;
+
+    PROBE1( write_start, from );
+
+    if ( pwrite(fd, buf + (from - base), len, from) != len )
+    {
+        fprintf( stderr, "[ERROR] %s: write failed during update: %s\n", c->filename, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    PROBE2( write_done, from, len );
+}
+
+/*
+ * overwrite payload bytes [p->offset, p->offset + p->size) of the stream
+ * hidden in 'c' with p->bytes.  only the carrier span covering those bits is
+ * read, the new bits are diffed against the ones already embedded, and just
+ * the carrier bytes whose lsb actually flips are written back, in place.
+ *
+ * returns the number of carrier bytes that changed
+ */
+int update_in_place(struct container *c, struct payload *p)
+{
+    int fd, k, changed = 0;
+    long base, bit, off, run_start = -1, run_end = -1;
+    unsigned char *buf, want;
+
+    fd = open( c->filename, O_WRONLY );
+
+    if ( fd < 0 )
+    {
+        fprintf( stderr, "[ERROR] could not open %s for updating: %s\n", c->filename, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    buf = read_carrier_span( c, 8L * p->offset, 8L * p->size, &base );
+    bit = 8L * p->offset;
+
+    for ( k = 0; k < p->size * 8; k++, bit++ )
+    {
+        off  = carrier_offset( c, bit );
+        want = 1 & (p->bytes[k / 8] >> (7 - (k % 8)));
+
+        if ( (buf[off - base] & 1) == want )
+            continue;
+
+        buf[off - base] ^= 1;
+        changed++;
+
+        // extend the current run, or flush it and start another
+        if ( run_start >= 0 && off - run_end <= UPDATE_MAX_GAP )
+        {
+            run_end = off;
+        }
+        else
+        {
+            if ( run_start >= 0 )
+                flush_run( fd, c, buf, base, run_start, run_end );
+
+            run_start = run_end = off;
+        }
+    }
+
+    if ( run_start >= 0 )
+        flush_run( fd, c, buf, base, run_start, run_end );
+
+    close( fd );
+
+    return changed;
+}
@@ -0,0 +1,667 @@
+/* * * * * * * * * * * * * * * *
+ * steganographer, worker.c
+ *
+ * spool-directory workers for many jobs on many hosts
+ *
+ * Javier Lombillo
+ * October 2015
+ */
+
+#include "steganographer.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>          // for fork(), execv(), gethostname()
+#include <sys/prctl.h>       // for PR_SET_PDEATHSIG
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ * a process used to run one job.  worker mode (-W) runs as many as there are:
+ * any number of workers, on any number of hosts, share a spool directory on
+ * a shared filesystem, and the only coordination is rename(2), which is
+ * atomic there.
+ *
+ *   new/     jobs waiting: <name>.job, the job's arguments as they'd be given
+ *            on the command line (a hide, recover or migrate with -o); paths
+ *            are relative to the spool
+ *   work/    jobs running, each with a <name>.lease
+ *   done/    jobs that succeeded, with their <name>.log
+ *   failed/  jobs that didn't, likewise
+ *
+ * a worker claims a job by renaming it from new/ into work/; of any number of
+ * workers trying, exactly one succeeds.  it then writes a lease, an expiry
+ * time and its host and pid, and renews it while the job runs.  workers also
+ * look at the leases of the jobs other workers hold: a job whose lease has
+ * run out (its worker died, or its host did) is renamed out of work/ by
+ * whoever sees it first, marked with a retry line and put back into new/.
+ * a job that has been retried WORKER_RETRIES times goes to failed/ instead.
+ * a worker that finds its lease gone, or someone else's, kills the job.
+ *
+ * each job runs in a process of its own, this program again with the job's
+ * arguments, except that -o points at a temporary name next to the output.
+ * when it succeeds the output (and its merkle sidecar, if any) is renamed
+ * into place, and only then is the job moved to done/.  a job can so run
+ * twice if a lease expires under a live worker, but an output is never seen
+ * half-written, and since jobs are deterministic a second run publishes the
+ * same bytes.  leases compare times from different hosts, so they should be
+ * much longer than the hosts' clocks are apart.
+ */
+
+#define WORKER_RETRIES   3            // expired leases before a job is failed
+#define WORKER_MAX_ARGS  64
+#define WORKER_POLL_MS   200
+
+// a job this worker is running
+struct slot
+{
+    pid_t pid;                // 0 for a free slot
+    char name[MAX_FILENAME_LENGTH + 1];
+    char out[MAX_FILENAME_LENGTH + 1];       // the output, as the job named it
+    char tmp[MAX_FILENAME_LENGTH + 64];      // where the job writes it
+    char log[MAX_FILENAME_LENGTH + 64];
+    char text[4096];          // the job file, split into args[]
+    char opt[MAX_FILENAME_LENGTH + 80];      // the rewritten word holding -o's file name
+    char *args[WORKER_MAX_ARGS + 2];
+    time_t started, renewed;
+};
+
+static char ident[128];       // host:pid, for leases and messages
+
+static void say(const char *fmt, const char *name, const char *extra)
+{
+    printf( "[%s] ", ident );
+    printf( fmt, name, extra );
+    putchar( '\n' );
+    fflush( stdout );
+}
+
+static void path(char *buf, size_t len, const char *dir, const char *name, const char *ext)
+{
+    if ( snprintf(buf, len, "%s/%s%s", dir, name, ext) >= (int)len )
+    {
+        fprintf( stderr, "[ERROR] the job name %s is too long, aborting.\n", name );
+        exit( EXIT_FAILURE );
+    }
+}
+
+/*
+ * (re)write the lease on 'name': rename() replaces it in one go
+ */
+static void write_lease(const char *name, int lease)
+{
+    char tmp[MAX_FILENAME_LENGTH + 160], dst[MAX_FILENAME_LENGTH + 32];
+    FILE *f;
+
+    snprintf( tmp, sizeof(tmp), "work/.%s.lease.%s", name, ident );
+    path( dst, sizeof(dst), "work", name, ".lease" );
+
+    if ( (f = fopen(tmp, "w")) )
+    {
+        fprintf( f, "%ld %s\n", (long)time(NULL) + lease, ident );
+
+        if ( fclose(f) == 0 && rename(tmp, dst) == 0 )
+            return;
+    }
+
+    fprintf( stderr, "[ERROR] could not write the lease on %s: %s\n", name, strerror(errno) );
+}
+
+/*
+ * the worker (host:pid) named in the lease on 'name', into 'who'; returns 0
+ * if there's no lease
+ */
+static int lease_owner(const char *name, char *who)
+{
+    char buf[MAX_FILENAME_LENGTH + 32];
+    long expiry;
+    FILE *f;
+    int ok;
+
+    path( buf, sizeof(buf), "work", name, ".lease" );
+
+    if ( !(f = fopen(buf, "r")) )
+        return 0;
+
+    ok = (fscanf(f, "%ld %127s", &expiry, who) == 2);
+    fclose( f );
+
+    return ok;
+}
+
+/*
+ * whether this worker still holds the lease on 'name': a reclaimed job may
+ * well be back in work/, but under someone else's lease
+ */
+static int holds(const char *name)
+{
+    char who[128];
+
+    return lease_owner( name, who ) && strcmp( who, ident ) == 0;
+}
+
+/*
+ * when the lease on 'name' runs out; a job claimed a moment ago may not have
+ * one yet, so then it's a lease from when it was renamed into work/
+ */
+static long lease_expiry(const char *name, int lease)
+{
+    char buf[MAX_FILENAME_LENGTH + 32];
+    struct stat st;
+    long expiry;
+    FILE *f;
+
+    path( buf, sizeof(buf), "work", name, ".lease" );
+
+    if ( (f = fopen(buf, "r")) )
+    {
+        if ( fscanf(f, "%ld", &expiry) != 1 )
+            expiry = 0;
+
+        fclose( f );
+        return expiry;
+    }
+
+    path( buf, sizeof(buf), "work", name, ".job" );
+
+    return (stat(buf, &st) == 0) ? (long)st.st_ctime + lease : -1;
+}
+
+static int own(struct slot *slot, int nslots, const char *name)
+{
+    int i;
+
+    for ( i = 0; i < nslots; i++ )
+        if ( slot[i].pid && strcmp(slot[i].name, name) == 0 )
+            return 1;
+
+    return 0;
+}
+
+/*
+ * the job names in 'dir' (new/ or work/), at most 'max' of them
+ */
+static int list_jobs(const char *dir, char (*names)[MAX_FILENAME_LENGTH + 1], int max)
+{
+    DIR *d = opendir( dir );
+    struct dirent *e;
+    size_t len;
+    int n = 0;
+
+    if ( !d )
+    {
+        fprintf( stderr, "[ERROR] could not read %s: %s, aborting.\n", dir, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    while ( n < max && (e = readdir(d)) )
+    {
+        len = strlen( e->d_name );
+
+        if ( e->d_name[0] != '.' && len > 4 && len <= MAX_FILENAME_LENGTH && strcmp(e->d_name + len - 4, ".job") == 0 )
+        {
+            memcpy( names[n], e->d_name, len - 4 );
+            names[n++][len - 4] = '\0';
+        }
+    }
+
+    closedir( d );
+
+    return n;
+}
+
+/*
+ * move the job in slot 's' and its log from work/ to 'dir'; returns 0, and
+ * drops the log, if the job was no longer this worker's to move
+ */
+static int retire(struct slot *s, const char *dir)
+{
+    char from[MAX_FILENAME_LENGTH + 32], to[MAX_FILENAME_LENGTH + 32];
+
+    path( from, sizeof(from), "work", s->name, ".job" );
+    path( to, sizeof(to), dir, s->name, ".job" );
+
+    if ( !holds(s->name) || rename(from, to) != 0 )
+    {
+        unlink( s->log );
+        return 0;
+    }
+
+    path( from, sizeof(from), "work", s->name, ".lease" );
+    unlink( from );
+
+    path( to, sizeof(to), dir, s->name, ".log" );
+    rename( s->log, to );
+
+    return 1;
+}
+
+/*
+ * whether the long option named by the first 'len' characters of 'name'
+ * takes an argument
+ */
+static int long_arg(const char *name, size_t len)
+{
+    static const char *with_arg[] = { "period", "to", "threads", "payload", "base", "output", "size", "range",
+                                      "offset", "delta", "fec", "matrix", "adaptive", "channels", "lease" };
+    size_t i;
+
+    for ( i = 0; i < sizeof(with_arg) / sizeof(*with_arg); i++ )
+        if ( len <= strlen(with_arg[i]) && strncmp(name, with_arg[i], len) == 0 )
+            return 1;
+
+    return 0;
+}
+
+/*
+ * split the job in 'file' into arguments and point its output at worker
+ * 'who''s temporary name beside the real one (s->tmp, left empty if there's
+ * no -o); returns 0 with a reason in 'why' if the job can't be run
+ */
+static int prepare(struct slot *s, const char *file, const char *who, const char **why)
+{
+    char *line, *tok, *save1, *save2, *slash;
+    int n = 1, retries = 0, i, k, outarg = -1, outpos = 0, worker = 0;
+    size_t len;
+    char *a;
+    FILE *f;
+
+    s->tmp[0] = '\0';
+
+    if ( !(f = fopen(file, "r")) )
+    {
+        *why = "can't be read";
+        return 0;
+    }
+
+    n = fread( s->text, 1, sizeof(s->text) - 1, f );
+    fclose( f );
+    s->text[n] = '\0';
+
+    s->args[0] = "steganographer";
+    n = 1;
+
+    for ( line = strtok_r(s->text, "\n", &save1); line; line = strtok_r(NULL, "\n", &save1) )
+    {
+        if ( line[0] == '#' )
+        {
+            retries += (strncmp(line, "# lease expired", 15) == 0);
+            continue;
+        }
+
+        for ( tok = strtok_r(line, " \t\r", &save2); tok; tok = strtok_r(NULL, " \t\r", &save2) )
+        {
+            if ( n == WORKER_MAX_ARGS + 1 )
+            {
+                *why = "has too many arguments";
+                return 0;
+            }
+
+            s->args[n++] = tok;
+        }
+    }
+
+    s->args[n] = NULL;
+
+    // find -o the way getopt_long() will: in a cluster of short options the
+    // first that takes an argument takes the rest of the word, or else the
+    // next word, and long options may be abbreviated
+    for ( i = 1; i < n && strcmp(s->args[i], "--") != 0; i++ )
+    {
+        a = s->args[i];
+
+        if ( a[0] != '-' || a[1] == '\0' )
+            continue;
+
+        if ( a[1] == '-' )
+        {
+            len = strcspn( a + 2, "=" );
+
+            if ( len > 0 && len <= 6 && strncmp(a + 2, "worker", len) == 0 )
+                worker = 1;
+            else if ( len > 1 && len <= 6 && strncmp(a + 2, "output", len) == 0 && (a[2 + len] || i + 1 < n) )
+            {
+                outarg = a[2 + len] ? i : i + 1;
+                outpos = a[2 + len] ? 3 + len : 0;
+            }
+
+            if ( !a[2 + len] && long_arg(a + 2, len) )
+                i++;
+
+            continue;
+        }
+
+        for ( k = 1; a[k]; k++ )
+        {
+            worker |= (a[k] == 'W');
+
+            if ( strchr("pbosj", a[k]) )
+            {
+                if ( a[k] == 'o' && (a[k + 1] || i + 1 < n) )
+                {
+                    outarg = a[k + 1] ? i : i + 1;
+                    outpos = a[k + 1] ? k + 1 : 0;
+                }
+
+                if ( !a[k + 1] )
+                    i++;
+
+                break;
+            }
+        }
+    }
+
+    if ( worker )
+    {
+        *why = "is itself a worker";
+        return 0;
+    }
+
+    if ( outarg < 0 )
+    {
+        *why = "has no -o";
+        return 0;
+    }
+
+    strncpy( s->out, s->args[outarg] + outpos, MAX_FILENAME_LENGTH );
+    s->out[MAX_FILENAME_LENGTH] = '\0';
+
+    // same directory, so publishing is a rename within one filesystem
+    slash = strrchr( s->out, '/' );
+    snprintf( s->tmp, sizeof(s->tmp), "%.*s.%s.%s.tmp", slash ? (int)(slash - s->out + 1) : 0, s->out,
+              slash ? slash + 1 : s->out, who );
+
+    // whatever came before the file name in its word stays as it was
+    snprintf( s->opt, sizeof(s->opt), "%.*s%s", outpos, s->args[outarg], s->tmp );
+    s->args[outarg] = s->opt;
+
+    if ( retries >= WORKER_RETRIES )
+    {
+        *why = "lost its worker too many times";
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * put the jobs of dead workers back in new/; returns how many
+ */
+static int reap(struct slot *slot, int nslots, int lease)
+{
+    static char names[256][MAX_FILENAME_LENGTH + 1];
+    static struct slot dead;  // the job as its worker ran it
+    char job[MAX_FILENAME_LENGTH + 32], held[MAX_FILENAME_LENGTH + 160], buf[MAX_FILENAME_LENGTH + 160];
+    char who[128];
+    const char *why;
+    long expiry;
+    int n = list_jobs( "work", names, 256 ), i, reaped = 0;
+    FILE *f;
+
+    for ( i = 0; i < n; i++ )
+    {
+        if ( own(slot, nslots, names[i]) )
+            continue;
+
+        expiry = lease_expiry( names[i], lease );
+
+        if ( expiry < 0 || expiry >= time(NULL) )
+            continue;
+
+        // whoever renames it first does the rest
+        path( job, sizeof(job), "work", names[i], ".job" );
+        if ( snprintf(held, sizeof(held), "work/.%s.reaped.%s", names[i], ident) >= (int)sizeof(held)
+          || rename(job, held) != 0 )
+            continue;
+
+        // the dead worker's log and half-written output go with its lease
+        if ( lease_owner(names[i], who) )
+        {
+            if ( snprintf(buf, sizeof(buf), "work/.%s.log.%s", names[i], who) < (int)sizeof(buf) )
+                unlink( buf );
+
+            prepare( &dead, held, who, &why );
+
+            if ( dead.tmp[0] )
+            {
+                unlink( dead.tmp );
+
+                if ( snprintf(buf, sizeof(buf), "%s.merkle", dead.tmp) < (int)sizeof(buf) )
+                    unlink( buf );
+            }
+        }
+
+        if ( (f = fopen(held, "a")) )
+        {
+            fprintf( f, "\n# lease expired at %ld, reclaimed by %s\n", expiry, ident );
+            fclose( f );
+        }
+
+        path( buf, sizeof(buf), "work", names[i], ".lease" );
+        unlink( buf );
+
+        path( buf, sizeof(buf), "new", names[i], ".job" );
+
+        if ( rename(held, buf) == 0 )
+        {
+            say( "%s: lease expired, back in new/", names[i], "" );
+            reaped++;
+        }
+    }
+
+    return reaped;
+}
+
+/*
+ * claim a job from new/ into slot 's' and start it; returns 1 if one was
+ * started, 0 if new/ had nothing this worker could get
+ */
+static int claim(struct slot *s, int lease)
+{
+    static char names[256][MAX_FILENAME_LENGTH + 1];
+    char from[MAX_FILENAME_LENGTH + 32], to[MAX_FILENAME_LENGTH + 32];
+    const char *why;
+    int n = list_jobs( "new", names, 256 ), i, k, fd;
+
+    // start somewhere different from the other workers
+    for ( k = 0, i = n ? rand() % n : 0; k < n; k++, i = (i + 1) % n )
+    {
+        path( from, sizeof(from), "new", names[i], ".job" );
+        path( to, sizeof(to), "work", names[i], ".job" );
+
+        if ( rename(from, to) == 0 )
+            break;
+    }
+
+    if ( k == n )
+        return 0;
+
+    strcpy( s->name, names[i] );
+    write_lease( s->name, lease );
+
+    snprintf( s->log, sizeof(s->log), "work/.%s.log.%s", s->name, ident );
+
+    path( from, sizeof(from), "work", s->name, ".job" );
+
+    if ( !prepare(s, from, ident, &why) )
+    {
+        if ( (fd = open(s->log, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0 )
+        {
+            dprintf( fd, "[ERROR] job %s %s, not run.\n", s->name, why );
+            close( fd );
+        }
+
+        retire( s, "failed" );
+        say( "%s %s; failed", s->name, why );
+
+        return 1;
+    }
+
+    say( "%s: claimed, output %s", s->name, s->out );
+
+    fflush( NULL );
+    s->pid = fork();
+
+    if ( s->pid < 0 )
+    {
+        fprintf( stderr, "[ERROR] fork: %s, aborting.\n", strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    if ( s->pid == 0 )
+    {
+        // a job outlives its worker only as a stray temporary file
+        prctl( PR_SET_PDEATHSIG, SIGKILL );
+
+        fd = open( s->log, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+
+        if ( fd >= 0 )
+        {
+            dup2( fd, STDOUT_FILENO );
+            dup2( fd, STDERR_FILENO );
+            close( fd );
+        }
+
+        execv( "/proc/self/exe", s->args );
+
+        fprintf( stderr, "[ERROR] could not run the job: %s\n", strerror(errno) );
+        _exit( EXIT_FAILURE );
+    }
+
+    s->started = s->renewed = time( NULL );
+
+    return 1;
+}
+
+/*
+ * a job's process has exited: publish its output, or throw it away
+ */
+static int finish(struct slot *s, int status)
+{
+    char a[MAX_FILENAME_LENGTH + 80], b[MAX_FILENAME_LENGTH + 80], secs[32];
+    int ok = WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+
+    snprintf( a, sizeof(a), "%s.merkle", s->tmp );
+    snprintf( b, sizeof(b), "%s.merkle", s->out );
+    snprintf( secs, sizeof(secs), "%ld", (long)(time(NULL) - s->started) );
+
+    // the sidecar goes first, so it's there whenever the output is
+    if ( ok && (access(a, F_OK) != 0 || rename(a, b) == 0) && rename(s->tmp, s->out) == 0 )
+    {
+        if ( retire(s, "done") )
+            say( "%s: done in %s s", s->name, secs );
+        else
+            say( "%s: done in %s s, but its lease had expired (published anyway)", s->name, secs );
+    }
+    else
+    {
+        unlink( s->tmp );
+        unlink( a );
+
+        if ( retire(s, "failed") )
+            say( "%s: failed, see failed/%s.log", s->name, s->name );
+        else
+            say( "%s: stopped; it's another worker's now", s->name, "" );
+
+        ok = 0;
+    }
+
+    s->pid = 0;
+
+    return ok;
+}
+
+/*
+ * run jobs from the spool directory u->basefile, u->threads at a time (at
+ * least one), until killed or, with --drain, until new/ is empty
+ */
+int worker_run(struct user_input *u)
+{
+    static const char *dirs[] = { "new", "work", "done", "failed" };
+    struct slot *slot;
+    struct timespec poll = { 0, WORKER_POLL_MS * 1000000L };
+    char host[64] = "localhost";
+    int nslots = (u->threads > 1) ? u->threads : 1, busy = 0, ran = 0, failed = 0, i, status, started;
+    pid_t pid;
+
+    if ( chdir(u->basefile) != 0 )
+    {
+        fprintf( stderr, "[ERROR] could not enter the spool directory %s: %s, aborting.\n", u->basefile, strerror(errno) );
+        exit( EXIT_FAILURE );
+    }
+
+    for ( i = 0; i < 4; i++ )
+    {
+        if ( mkdir(dirs[i], 0755) != 0 && errno != EEXIST )
+        {
+            fprintf( stderr, "[ERROR] could not create %s/%s: %s, aborting.\n", u->basefile, dirs[i], strerror(errno) );
+            exit( EXIT_FAILURE );
+        }
+    }
+
+    gethostname( host, sizeof(host) - 1 );
+    snprintf( ident, sizeof(ident), "%s:%d", host, (int)getpid() );
+    srand( time(NULL) ^ getpid() );
+
+    slot = arena_alloc( &job_arena, nslots * sizeof(*slot) );
+    memset( slot, 0, nslots * sizeof(*slot) );
+
+    printf( "[%s] working on %s, %d job%s at a time, %d s leases\n", ident, u->basefile,
+            nslots, (nslots == 1) ? "" : "s", u->lease );
+
+    while ( 1 )
+    {
+        started = reap( slot, nslots, u->lease );
+
+        for ( i = 0; i < nslots; i++ )
+        {
+            if ( slot[i].pid == 0 && claim(&slot[i], u->lease) )
+            {
+                started++;
+                busy += (slot[i].pid != 0);
+                ran  += (slot[i].pid == 0);
+                failed += (slot[i].pid == 0);
+            }
+        }
+
+        if ( u->drain && !busy && !started )
+            break;
+
+        while ( busy && (pid = waitpid(-1, &status, WNOHANG)) > 0 )
+        {
+            for ( i = 0; i < nslots; i++ )
+            {
+                if ( slot[i].pid == pid )
+                {
+                    failed += !finish( &slot[i], status );
+                    ran++;
+                    busy--;
+                }
+            }
+        }
+
+        // renew leases, and drop jobs that were taken away
+        for ( i = 0; i < nslots; i++ )
+        {
+            if ( slot[i].pid == 0 || time(NULL) - slot[i].renewed < u->lease / 3 )
+                continue;
+
+            if ( !holds(slot[i].name) )
+            {
+                say( "%s: lost its lease, stopping it", slot[i].name, "" );
+                kill( slot[i].pid, SIGKILL );
+            }
+            else
+                write_lease( slot[i].name, u->lease );
+
+            slot[i].renewed = time( NULL );
+        }
+
+        nanosleep( &poll, NULL );
+    }
+
+    printf( "[%s] new/ is empty; ran %d job%s, %d failed\n", ident, ran, (ran == 1) ? "" : "s", failed );
+
+    return failed;
+}